@@ -105,4 +105,56 @@ struct canfd_frame {
 #define CAN_MTU (sizeof(struct can_frame))
 #define CANFD_MTU (sizeof(struct canfd_frame))
 
-#endif
\ No newline at end of file
+#endif
+
+#ifndef CANXL_XLF
+#include <stddef.h>
+#include <stdint.h>
+
+/* CAN XL data length code and payload definitions */
+#define CANXL_MIN_DLC 0
+#define CANXL_MAX_DLC 2047
+#define CANXL_MAX_DLC_MASK 0x07FF
+#define CANXL_MIN_DLEN 1
+#define CANXL_MAX_DLEN 2048
+
+/* CAN XL mandatory flags */
+#define CANXL_XLF 0x80 /* mandatory CAN XL frame flag (must always be set!) */
+#define CANXL_SEC 0x01 /* Simple Extended Content (security/segmentation) */
+
+/* CAN XL priority is the 11 bit SFF id */
+#define CANXL_PRIO_BITS CAN_SFF_ID_BITS
+#define CANXL_PRIO_MASK CAN_SFF_MASK
+
+/**
+ * struct canxl_frame - CAN with e'X'tended frame 'L'ength frame structure
+ * @prio:  11 bit arbitration priority with zero'ed CAN_*_FLAG flags
+ * @flags: additional flags for CAN XL
+ * @sdt:   SDU (service data unit) type
+ * @len:   frame payload length in byte (CANXL_MIN_DLEN .. CANXL_MAX_DLEN)
+ * @af:    acceptance field
+ * @data:  CAN XL frame payload (CANXL_MIN_DLEN .. CANXL_MAX_DLEN byte)
+ *
+ * @prio shares the same position as @can_id from struct can[fd]_frame.
+ */
+struct canxl_frame {
+	canid_t prio; /* 11 bit priority for arbitration (canid_t) */
+	uint8_t flags; /* additional flags for CAN XL */
+	uint8_t sdt; /* SDU (service data unit) type */
+	uint16_t len; /* frame payload length in byte */
+	uint32_t af; /* acceptance field */
+	uint8_t data[CANXL_MAX_DLEN];
+};
+
+#define CANXL_MTU (sizeof(struct canxl_frame))
+#define CANXL_HDR_SIZE (offsetof(struct canxl_frame, data))
+#define CANXL_MIN_MTU (CANXL_HDR_SIZE + 64)
+#define CANXL_MAX_MTU CANXL_MTU
+#endif
+
+#ifndef CANXL_VCID_OFFSET
+/* the 8-bit VCID is optionally placed in the canxl_frame.prio element */
+#define CANXL_VCID_OFFSET 16 /* bit offset of VCID in prio element */
+#define CANXL_VCID_VAL_MASK 0xFFUL /* VCID is an 8-bit value */
+#define CANXL_VCID_MASK (CANXL_VCID_VAL_MASK << CANXL_VCID_OFFSET)
+#endif
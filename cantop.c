@@ -0,0 +1,505 @@
+#define _GNU_SOURCE
+
+#include "vcan.h"
+#include "vcan_connect.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+/*
+ * Live view of the traffic on a vcand bus, fed by a tap (VCAN_TAP).
+ *
+ *   ./cantop [-i refresh_ms] [-n rows] [-b bitrate[:data_bitrate]]
+ *            [-e file.csv [-s secs]] unix-socket
+ *   ./cantop ... host tcp-port
+ *
+ * Every refresh (default 1000 ms) it shows the frame rate and load of the
+ * bus and the ids with the most frames since the last refresh. For each it
+ * gives that rate, the mean and standard deviation of the period and the
+ * shortest and longest period since the start, the lengths seen and the
+ * connection that last sent it. Below are the connections that sent the
+ * most. Periods are taken from vcand's timestamps, so any delay on the way
+ * to cantop does not show as jitter.
+ *
+ * Load is the time the frames would take at bitrate (default 500000), with
+ * the data phase of CAN FD and XL frames at data_bitrate (default 2000000),
+ * not counting stuff bits.
+ *
+ * Ids and connections live in fixed size open addressed tables, updated in a
+ * few cache lines per frame, so cantop keeps up with the bus however often
+ * it redraws. Ids beyond MAX_IDS are only counted in the totals. With -e a
+ * snapshot of every id is appended to file.csv every secs (default 10)
+ * seconds, to compare runs offline.
+ */
+#define MAX_IDS 8192
+#define MAX_CLIENTS 1024
+#define LEN_SLOTS 17
+
+/* id of XL frames in the table, RTR | ERR which no data frame has */
+#define XL_KEY (CAN_RTR_FLAG | CAN_ERR_FLAG)
+
+/*
+ * Tables
+ *
+ * The period mean and variance are kept with Welford's method. Lengths are
+ * counted by DLC, with XL frames in the last slot.
+ */
+struct id_stats {
+	canid_t id;
+	uint32_t used;
+	uint32_t ival, from;
+	uint64_t count, snap;
+	uint64_t last, min, max;
+	double mean, m2;
+	uint32_t lens[LEN_SLOTS];
+} __attribute__((aligned(64)));
+
+struct client_stats {
+	uint32_t from;
+	uint32_t used;
+	uint64_t ival;
+	double ival_ns;
+};
+
+static struct id_stats ids[MAX_IDS];
+static struct client_stats clients[MAX_CLIENTS];
+static int nids, nclients;
+
+static uint64_t frames, frames_ival, untracked;
+static double busy_ns;
+static uint32_t bitrate = 500000, data_bitrate = 2000000;
+
+static uint32_t hash(uint32_t v, int size)
+{
+	return (v * 0x9E3779B1U) >> (32 - __builtin_ctz(size));
+}
+
+static struct id_stats *find_id(canid_t id)
+{
+	uint32_t mask = MAX_IDS - 1;
+	for (uint32_t h = hash(id, MAX_IDS);; h = (h + 1) & mask) {
+		struct id_stats *s = &ids[h];
+		if (s->used && s->id == id) {
+			return s;
+		} else if (!s->used) {
+			/* keep the table at most 3/4 full */
+			if (4 * (nids + 1) > 3 * MAX_IDS) {
+				return NULL;
+			}
+			s->used = 1;
+			s->id = id;
+			s->min = UINT64_MAX;
+			nids++;
+			return s;
+		}
+	}
+}
+
+static struct client_stats *find_client(uint32_t from)
+{
+	uint32_t mask = MAX_CLIENTS - 1;
+	for (uint32_t h = hash(from, MAX_CLIENTS);; h = (h + 1) & mask) {
+		struct client_stats *c = &clients[h];
+		if (c->used && c->from == from) {
+			return c;
+		} else if (!c->used) {
+			if (4 * (nclients + 1) > 3 * MAX_CLIENTS) {
+				return NULL;
+			}
+			c->used = 1;
+			c->from = from;
+			nclients++;
+			return c;
+		}
+	}
+}
+
+static int len_slot(int len)
+{
+	static const uint8_t fd[] = {12, 16, 20, 24, 32, 48, 64};
+	if (len <= CAN_MAX_DLEN) {
+		return len;
+	}
+	for (int i = 0; i < sizeof(fd); i++) {
+		if (len <= fd[i]) {
+			return 9 + i;
+		}
+	}
+	return 15;
+}
+
+static const char *slot_name(int i)
+{
+	static const char *names[LEN_SLOTS] = {
+		"0",  "1",  "2",  "3",  "4",  "5",  "6",  "7", "8",
+		"12", "16", "20", "24", "32", "48", "64", "xl",
+	};
+	return names[i];
+}
+
+/* Time on the wire in ns, without stuff bits */
+static double frame_ns(canid_t id, int len, int fd, int xl)
+{
+	int eff = (id & CAN_EFF_FLAG) != 0;
+	if (!fd && !xl) {
+		return (eff ? 67 + 8 * len : 47 + 8 * len) * 1e9 / bitrate;
+	}
+	/* arbitration up to BRS and the end of frame at bitrate, the rest
+	 * at data_bitrate */
+	int slow = (eff ? 37 : 18) + 13;
+	int fast = (xl ? 40 : 5) + 8 * len + (len > 16 ? 22 : 18);
+	return slow * 1e9 / bitrate + fast * 1e9 / data_bitrate;
+}
+
+static void add_frame(uint32_t from, uint64_t ns, const char *p, int len)
+{
+	canid_t id;
+	int dlen, fd = 0, xl = 0;
+	if (vcan_is_xl(p, len)) {
+		struct canxl_frame x;
+		memcpy(&x, p, CANXL_HDR_SIZE);
+		id = (x.prio & CANXL_PRIO_MASK) | XL_KEY;
+		dlen = x.len;
+		xl = 1;
+	} else if (len >= CAN_MTU) {
+		struct canfd_frame f;
+		memcpy(&f, p, CAN_MTU);
+		id = f.can_id;
+		dlen = f.len;
+		fd = len == CANFD_MTU;
+	} else {
+		return;
+	}
+
+	double t = frame_ns(id, dlen, fd, xl);
+	frames++;
+	frames_ival++;
+	busy_ns += t;
+
+	struct client_stats *c = find_client(from);
+	if (c) {
+		c->ival++;
+		c->ival_ns += t;
+	}
+
+	struct id_stats *s = find_id(id);
+	if (!s) {
+		untracked++;
+		return;
+	}
+	if (s->count && ns > s->last) {
+		uint64_t period = ns - s->last;
+		uint64_t n = s->count;
+		double d = period - s->mean;
+		s->mean += d / n;
+		s->m2 += d * (period - s->mean);
+		if (period < s->min) {
+			s->min = period;
+		}
+		if (period > s->max) {
+			s->max = period;
+		}
+	}
+	s->last = ns;
+	s->count++;
+	s->ival++;
+	s->from = from;
+	s->lens[xl ? LEN_SLOTS - 1 : len_slot(dlen)]++;
+}
+
+static void add_tap(const char *p, int n)
+{
+	struct vcan_tap h;
+	if (n < sizeof(h)) {
+		return;
+	}
+	memcpy(&h, p, sizeof(h));
+	const char *e = p + n;
+	for (p += sizeof(h); e - p >= 2;) {
+		uint16_t len;
+		memcpy(&len, p, 2);
+		if (e - p < 2 + len) {
+			break;
+		}
+		add_frame(h.from, h.ns, p + 2, len);
+		p += 2 + len;
+	}
+}
+
+/*
+ * Output
+ */
+static double stddev(const struct id_stats *s)
+{
+	return s->count > 2 ? sqrt(s->m2 / (s->count - 2)) : 0;
+}
+
+static void print_id(FILE *f, canid_t id)
+{
+	if ((id & XL_KEY) == XL_KEY) {
+		fprintf(f, "xl %03X", id & CANXL_PRIO_MASK);
+	} else if (id & CAN_EFF_FLAG) {
+		fprintf(f, "%08X", id & CAN_EFF_MASK);
+	} else {
+		fprintf(f, "     %03X", id & CAN_SFF_MASK);
+	}
+}
+
+static void print_lens(FILE *f, const struct id_stats *s, const char *sep)
+{
+	int first = 1;
+	for (int i = 0; i < LEN_SLOTS; i++) {
+		if (s->lens[i]) {
+			fprintf(f, "%s%s", first ? "" : sep, slot_name(i));
+			first = 0;
+		}
+	}
+}
+
+static int cmp_ival(const void *a, const void *b)
+{
+	const struct id_stats *x = *(const struct id_stats **)a;
+	const struct id_stats *y = *(const struct id_stats **)b;
+	if (x->ival != y->ival) {
+		return x->ival < y->ival ? 1 : -1;
+	}
+	return x->id < y->id ? -1 : x->id > y->id;
+}
+
+static int cmp_client(const void *a, const void *b)
+{
+	const struct client_stats *x = *(const struct client_stats **)a;
+	const struct client_stats *y = *(const struct client_stats **)b;
+	if (x->ival_ns != y->ival_ns) {
+		return x->ival_ns < y->ival_ns ? 1 : -1;
+	}
+	return x->from < y->from ? -1 : x->from > y->from;
+}
+
+static void refresh(double secs, int rows, int tty)
+{
+	static struct id_stats *top[MAX_IDS];
+	static struct client_stats *ctop[MAX_CLIENTS];
+	int n = 0, nc = 0;
+	for (int i = 0; i < MAX_IDS; i++) {
+		if (ids[i].used) {
+			top[n++] = &ids[i];
+		}
+	}
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].used && clients[i].ival) {
+			ctop[nc++] = &clients[i];
+		}
+	}
+	qsort(top, n, sizeof(*top), &cmp_ival);
+	qsort(ctop, nc, sizeof(*ctop), &cmp_client);
+
+	if (tty) {
+		fputs("\033[H\033[2J", stdout);
+	}
+	printf("frames %.0f/s  load %.1f%%  ids %d", frames_ival / secs,
+	       100 * busy_ns / (secs * 1e9), nids);
+	if (untracked) {
+		printf(" (%llu frames of ids over %d)",
+		       (unsigned long long)untracked, MAX_IDS);
+	}
+	printf("\n\n      id   rate/s  period ms  stddev ms     min ms"
+	       "     max ms  from  lengths\n");
+	for (int i = 0; i < n && i < rows; i++) {
+		struct id_stats *s = top[i];
+		print_id(stdout, s->id);
+		printf(" %8.0f %10.3f %10.3f %10.3f %10.3f %5u  ",
+		       s->ival / secs, s->mean / 1e6, stddev(s) / 1e6,
+		       s->count > 1 ? s->min / 1e6 : 0, s->max / 1e6,
+		       s->from);
+		print_lens(stdout, s, ",");
+		putchar('\n');
+	}
+	printf("\n    from   rate/s   load %%\n");
+	for (int i = 0; i < nc && i < 8; i++) {
+		struct client_stats *c = ctop[i];
+		printf("%8u %8.0f %8.1f\n", c->from, c->ival / secs,
+		       100 * c->ival_ns / (secs * 1e9));
+	}
+	fflush(stdout);
+
+	for (int i = 0; i < n; i++) {
+		top[i]->ival = 0;
+	}
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		clients[i].ival = 0;
+		clients[i].ival_ns = 0;
+	}
+	frames_ival = 0;
+	busy_ns = 0;
+}
+
+static void export(FILE *f, double at, double secs)
+{
+	for (int i = 0; i < MAX_IDS; i++) {
+		struct id_stats *s = &ids[i];
+		if (!s->used) {
+			continue;
+		}
+		fprintf(f, "%.3f,", at);
+		if ((s->id & XL_KEY) == XL_KEY) {
+			fprintf(f, "xl%03X", s->id & CANXL_PRIO_MASK);
+		} else {
+			fprintf(f, "%X", s->id & (s->id & CAN_EFF_FLAG
+							  ? CAN_EFF_MASK
+							  : CAN_SFF_MASK));
+		}
+		fprintf(f, ",%llu,%.3f,%.6f,%.6f,%.6f,%.6f,",
+			(unsigned long long)s->count, (s->count - s->snap) / secs,
+			s->mean / 1e6, stddev(s) / 1e6,
+			s->count > 1 ? s->min / 1e6 : 0, s->max / 1e6);
+		int first = 1;
+		for (int j = 0; j < LEN_SLOTS; j++) {
+			if (s->lens[j]) {
+				fprintf(f, "%s%s:%u", first ? "" : " ",
+					slot_name(j), s->lens[j]);
+				first = 0;
+			}
+		}
+		fputc('\n', f);
+		s->snap = s->count;
+	}
+	fflush(f);
+}
+
+int main(int argc, char *argv[])
+{
+	int ival_ms = 1000, rows = 20, snap_secs = 10;
+	const char *out = NULL;
+
+	while (argc > 2 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-i")) {
+			ival_ms = atoi(argv[2]);
+		} else if (!strcmp(argv[1], "-n")) {
+			rows = atoi(argv[2]);
+		} else if (!strcmp(argv[1], "-b")) {
+			char *e;
+			bitrate = strtoul(argv[2], &e, 10);
+			if (*e == ':') {
+				data_bitrate = strtoul(e + 1, NULL, 10);
+			}
+		} else if (!strcmp(argv[1], "-e")) {
+			out = argv[2];
+		} else if (!strcmp(argv[1], "-s")) {
+			snap_secs = atoi(argv[2]);
+		} else {
+			break;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+
+	int fd;
+	if (ival_ms <= 0 || rows < 0 || !bitrate || !data_bitrate ||
+	    snap_secs <= 0 || do_connect(&fd, argc, argv)) {
+		fputs("usage: cantop [-i refresh_ms] [-n rows] "
+		      "[-b bitrate[:data_bitrate]]\n"
+		      "              [-e file.csv [-s secs]] unix-socket\n",
+		      stderr);
+		fputs("usage: cantop ... host tcp-port\n", stderr);
+		return 2;
+	}
+
+	FILE *csv = NULL;
+	if (out) {
+		csv = fopen(out, "a");
+		if (!csv) {
+			perror(out);
+			return 1;
+		}
+		/* a file appended to already has its header */
+		fseek(csv, 0, SEEK_END);
+		if (ftell(csv) == 0) {
+			fputs("time_s,id,frames,rate,period_ms,stddev_ms,"
+			      "min_ms,max_ms,lengths\n",
+			      csv);
+		}
+	}
+
+	struct vcan_tap tap;
+	memset(&tap, 0, sizeof(tap));
+	tap.type = VCAN_TAP;
+	tap.flags = VCAN_TAP_ON;
+	char req[2 + sizeof(tap)];
+	uint16_t len = VCAN_CTRL | sizeof(tap);
+	memcpy(req, &len, 2);
+	memcpy(req + 2, &tap, sizeof(tap));
+	if (send(fd, req, sizeof(req), MSG_NOSIGNAL) != sizeof(req)) {
+		perror("send");
+		return 1;
+	}
+
+	int tty = isatty(STDOUT_FILENO);
+	uint64_t start = now_ns();
+	uint64_t last = start;
+	uint64_t next = start + ival_ms * 1000000ULL;
+	uint64_t last_snap = start;
+	uint64_t next_snap = start + snap_secs * 1000000000ULL;
+
+	static char buf[1 << 18];
+	int have = 0;
+	for (;;) {
+		uint64_t now = now_ns();
+		if (now >= next) {
+			refresh((now - last) / 1e9, rows, tty);
+			last = now;
+			next += ival_ms * 1000000ULL;
+			if (next <= now) {
+				next = now + ival_ms * 1000000ULL;
+			}
+		}
+		if (csv && now >= next_snap) {
+			export(csv, (now - start) / 1e9, (now - last_snap) / 1e9);
+			last_snap = now;
+			next_snap += snap_secs * 1000000000ULL;
+		}
+
+		uint64_t due = csv && next_snap < next ? next_snap : next;
+		struct pollfd pfd = {fd, POLLIN, 0};
+		int ms = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+		if (poll(&pfd, 1, ms) < 0 && errno != EINTR) {
+			perror("poll");
+			return 1;
+		} else if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+			continue;
+		}
+
+		int n = recv(fd, buf + have, sizeof(buf) - have, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			fputs("connection closed\n", stderr);
+			return 1;
+		}
+		have += n;
+
+		int off = 0;
+		while (have - off >= 2) {
+			memcpy(&len, buf + off, 2);
+			int sz = 2 + (len & VCAN_LEN_MASK);
+			if (have - off < sz) {
+				break;
+			}
+			if ((len & VCAN_CTRL) && sz > 2 &&
+			    (uint8_t)buf[off + 2] == VCAN_TAP) {
+				add_tap(buf + off + 2, sz - 2);
+			}
+			off += sz;
+		}
+		memmove(buf, buf + off, have - off);
+		have -= off;
+	}
+}
@@ -0,0 +1,878 @@
+#define _GNU_SOURCE
+
+#include "can.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * Indexes bus traces for fast queries.
+ *
+ *   ./cantrace build out.ctr in.log [in.log ...]
+ *   ./cantrace query [-j threads] [-c] [-i id[/mask]]... [-b bus]
+ *                    [-t from:to] file.ctr [file.ctr ...]
+ *   ./cantrace info file.ctr [file.ctr ...]
+ *
+ * build reads candump -L logs, merges them by timestamp and writes the frames
+ * in chunks of CT_CHUNK. Each chunk is stored column by column: timestamps,
+ * ids, data offsets, lengths, flags, bus numbers and then the data. A
+ * directory at the end of the file gives the offset, time range and a bloom
+ * filter of the ids of every chunk, so a query only touches the chunks that
+ * can match and, within those, binary searches the time column and scans the
+ * id column. Chunks are farmed out to threads over an mmap of the file and
+ * the matches are printed in file order as candump -L lines, or counted with
+ * -c. Ids given without a mask must match exactly and are the ones the bloom
+ * filters can skip chunks for. Times are seconds as in the logs.
+ *
+ * Files are in native byte order.
+ */
+#define CT_MAGIC 0x43525443U /* "CTRC" on little endian */
+#define CT_VERSION 1
+#define CT_CHUNK 65536
+#define CT_MAX_BUS 256
+#define CT_BUS_NAME 16
+#define CT_BLOOM_BITS 16384
+#define CT_BLOOM_WORDS (CT_BLOOM_BITS / 64)
+
+/* ct_frame.flags, besides the canfd_frame flags */
+#define CT_FD 0x80
+
+struct ct_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nbus;
+	uint32_t __pad;
+	char bus[CT_MAX_BUS][CT_BUS_NAME];
+};
+
+struct ct_chunk {
+	uint64_t off;
+	uint64_t tmin, tmax;
+	uint32_t n;
+	uint32_t sorted;
+	uint64_t bloom[CT_BLOOM_WORDS];
+};
+
+struct ct_trailer {
+	uint64_t dir;
+	uint32_t nchunk;
+	uint32_t magic;
+};
+
+/* Column layout of a chunk of n frames starting at its offset */
+#define CT_TIME(n) 0
+#define CT_ID(n) (8 * (size_t)(n))
+#define CT_OFF(n) (12 * (size_t)(n))
+#define CT_LEN(n) (16 * (size_t)(n))
+#define CT_FLAGS(n) (17 * (size_t)(n))
+#define CT_BUS(n) (18 * (size_t)(n))
+#define CT_DATA(n) ((19 * (size_t)(n) + 7) & ~(size_t)7)
+
+struct ct_frame {
+	uint64_t ns;
+	canid_t id;
+	uint8_t len, flags, bus;
+	uint8_t data[CANFD_MAX_DLEN];
+};
+
+static void bloom_bits(canid_t id, uint32_t bit[3])
+{
+	uint64_t h = id * 0x9E3779B97F4A7C15ULL;
+	bit[0] = (h >> 16) % CT_BLOOM_BITS;
+	bit[1] = (h >> 32) % CT_BLOOM_BITS;
+	bit[2] = (h >> 48) % CT_BLOOM_BITS;
+}
+
+static void bloom_add(uint64_t *bloom, canid_t id)
+{
+	uint32_t bit[3];
+	bloom_bits(id, bit);
+	for (int i = 0; i < 3; i++) {
+		bloom[bit[i] / 64] |= (uint64_t)1 << (bit[i] % 64);
+	}
+}
+
+static int bloom_has(const uint64_t *bloom, canid_t id)
+{
+	uint32_t bit[3];
+	bloom_bits(id, bit);
+	for (int i = 0; i < 3; i++) {
+		if (!(bloom[bit[i] / 64] & ((uint64_t)1 << (bit[i] % 64)))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	} else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+/*
+ * Parses a candump -L line, "(sec.usec) bus id#data", "id#R" or
+ * "id##Fdata" for CAN FD, the way candump prints them. Returns the bus name
+ * in bus or -1 if the line is not a frame.
+ */
+static int parse_line(const char *s, struct ct_frame *f, char *bus)
+{
+	char *e;
+	if (*s++ != '(') {
+		return -1;
+	}
+	uint64_t sec = strtoull(s, &e, 10);
+	if (*e != '.') {
+		return -1;
+	}
+	s = e + 1;
+	uint64_t frac = 0;
+	int digits = 0;
+	for (; *s >= '0' && *s <= '9'; s++, digits++) {
+		if (digits < 9) {
+			frac = frac * 10 + (*s - '0');
+		}
+	}
+	for (; digits < 9; digits++) {
+		frac *= 10;
+	}
+	if (*s++ != ')' || *s++ != ' ') {
+		return -1;
+	}
+	f->ns = sec * 1000000000 + frac;
+
+	int n = 0;
+	while (*s && *s != ' ' && n < CT_BUS_NAME - 1) {
+		bus[n++] = *s++;
+	}
+	bus[n] = 0;
+	if (*s++ != ' ') {
+		return -1;
+	}
+
+	canid_t id = 0;
+	for (n = 0; hexval(s[n]) >= 0; n++) {
+		id = (id << 4) | hexval(s[n]);
+	}
+	if (s[n] != '#' || (n != 3 && n != 8)) {
+		return -1;
+	} else if (n == 8 && !(id & CAN_ERR_FLAG)) {
+		id |= CAN_EFF_FLAG;
+	}
+	s += n + 1;
+
+	f->flags = 0;
+	int max = CAN_MAX_DLEN;
+	if (*s == '#') {
+		if (hexval(s[1]) < 0) {
+			return -1;
+		}
+		f->flags = CT_FD | hexval(s[1]);
+		max = CANFD_MAX_DLEN;
+		s += 2;
+	} else if (*s == 'R') {
+		id |= CAN_RTR_FLAG;
+		s++;
+	}
+	f->id = id;
+
+	for (n = 0; n < max; n++, s += 2) {
+		if (*s == '.') {
+			s++;
+		}
+		int hi = hexval(s[0]), lo = hi < 0 ? -1 : hexval(s[1]);
+		if (lo < 0) {
+			break;
+		}
+		f->data[n] = (uint8_t)(hi << 4 | lo);
+	}
+	f->len = n;
+	return 0;
+}
+
+/*
+ * Building
+ *
+ * Inputs are read a line at a time and merged with a binary heap on the
+ * timestamp of the frame each has ready.
+ */
+struct input {
+	FILE *f;
+	const char *path;
+	uint8_t bus[CT_MAX_BUS]; /* local to global bus number, 0 unmapped */
+	char names[CT_MAX_BUS][CT_BUS_NAME];
+	int nnames;
+	struct ct_frame cur;
+};
+
+static struct ct_header hdr;
+
+static int bus_number(struct input *in, const char *name)
+{
+	for (int i = 0; i < in->nnames; i++) {
+		if (!strcmp(in->names[i], name)) {
+			return in->bus[i];
+		}
+	}
+	int b;
+	for (b = 0; b < hdr.nbus; b++) {
+		if (!strcmp(hdr.bus[b], name)) {
+			break;
+		}
+	}
+	if (b == hdr.nbus) {
+		if (hdr.nbus == CT_MAX_BUS) {
+			return -1;
+		}
+		strcpy(hdr.bus[hdr.nbus++], name);
+	}
+	if (in->nnames < CT_MAX_BUS) {
+		strcpy(in->names[in->nnames], name);
+		in->bus[in->nnames++] = b;
+	}
+	return b;
+}
+
+/* Reads the next frame of in into in->cur. Returns 0 at the end. */
+static int next_frame(struct input *in)
+{
+	char line[512];
+	char bus[CT_BUS_NAME];
+	while (fgets(line, sizeof(line), in->f)) {
+		if (parse_line(line, &in->cur, bus)) {
+			continue;
+		}
+		int b = bus_number(in, bus);
+		if (b < 0) {
+			fprintf(stderr, "%s: too many buses\n", in->path);
+			continue;
+		}
+		in->cur.bus = b;
+		return 1;
+	}
+	return 0;
+}
+
+static void heap_down(struct input **h, int n, int i)
+{
+	for (;;) {
+		int m = i, l = 2 * i + 1, r = l + 1;
+		if (l < n && h[l]->cur.ns < h[m]->cur.ns) {
+			m = l;
+		}
+		if (r < n && h[r]->cur.ns < h[m]->cur.ns) {
+			m = r;
+		}
+		if (m == i) {
+			return;
+		}
+		struct input *t = h[i];
+		h[i] = h[m];
+		h[m] = t;
+		i = m;
+	}
+}
+
+struct writer {
+	FILE *f;
+	uint64_t off;
+	struct ct_chunk *dir;
+	int nchunk, dircap;
+
+	/* the chunk being filled */
+	int n, data_sz;
+	uint64_t last;
+	int sorted;
+	uint64_t *time;
+	canid_t *id;
+	uint32_t *doff;
+	uint8_t *len, *flags, *bus;
+	uint8_t *data;
+	uint64_t bloom[CT_BLOOM_WORDS];
+};
+
+static int write_at(struct writer *w, const void *p, size_t n)
+{
+	if (n && fwrite(p, 1, n, w->f) != n) {
+		return -1;
+	}
+	w->off += n;
+	return 0;
+}
+
+static int flush_chunk(struct writer *w)
+{
+	if (!w->n) {
+		return 0;
+	}
+	if (w->nchunk == w->dircap) {
+		w->dircap = w->dircap ? 2 * w->dircap : 64;
+		w->dir = realloc(w->dir, w->dircap * sizeof(*w->dir));
+	}
+	struct ct_chunk *c = &w->dir[w->nchunk++];
+	memset(c, 0, sizeof(*c));
+	c->off = w->off;
+	c->n = w->n;
+	c->sorted = w->sorted;
+	c->tmin = c->tmax = w->time[0];
+	for (int i = 1; i < w->n; i++) {
+		if (w->time[i] < c->tmin) {
+			c->tmin = w->time[i];
+		}
+		if (w->time[i] > c->tmax) {
+			c->tmax = w->time[i];
+		}
+	}
+	memcpy(c->bloom, w->bloom, sizeof(c->bloom));
+
+	static const char zero[8];
+	size_t n = w->n;
+	int err = write_at(w, w->time, 8 * n) || write_at(w, w->id, 4 * n) ||
+		  write_at(w, w->doff, 4 * n) || write_at(w, w->len, n) ||
+		  write_at(w, w->flags, n) || write_at(w, w->bus, n) ||
+		  write_at(w, zero, CT_DATA(n) - 19 * n) ||
+		  write_at(w, w->data, w->data_sz) ||
+		  write_at(w, zero, -w->data_sz & 7);
+
+	w->n = 0;
+	w->data_sz = 0;
+	w->sorted = 1;
+	memset(w->bloom, 0, sizeof(w->bloom));
+	return err;
+}
+
+static int add_frame(struct writer *w, const struct ct_frame *f)
+{
+	if (w->n == CT_CHUNK && flush_chunk(w)) {
+		return -1;
+	}
+	int i = w->n++;
+	if (i && f->ns < w->last) {
+		w->sorted = 0;
+	}
+	w->last = f->ns;
+	w->time[i] = f->ns;
+	w->id[i] = f->id;
+	w->doff[i] = w->data_sz;
+	w->len[i] = f->len;
+	w->flags[i] = f->flags;
+	w->bus[i] = f->bus;
+	memcpy(w->data + w->data_sz, f->data, f->len);
+	w->data_sz += f->len;
+	bloom_add(w->bloom, f->id);
+	return 0;
+}
+
+static int build(const char *out, char **paths, int n)
+{
+	struct input *inputs = calloc(n, sizeof(*inputs));
+	struct input **heap = calloc(n, sizeof(*heap));
+	int nheap = 0;
+	for (int i = 0; i < n; i++) {
+		inputs[i].path = paths[i];
+		inputs[i].f = fopen(paths[i], "r");
+		if (!inputs[i].f) {
+			perror(paths[i]);
+			return 1;
+		}
+		if (next_frame(&inputs[i])) {
+			heap[nheap++] = &inputs[i];
+		}
+	}
+	for (int i = nheap / 2 - 1; i >= 0; i--) {
+		heap_down(heap, nheap, i);
+	}
+
+	struct writer w;
+	memset(&w, 0, sizeof(w));
+	w.f = fopen(out, "wb");
+	if (!w.f) {
+		perror(out);
+		return 1;
+	}
+	w.sorted = 1;
+	w.time = malloc(CT_CHUNK * sizeof(*w.time));
+	w.id = malloc(CT_CHUNK * sizeof(*w.id));
+	w.doff = malloc(CT_CHUNK * sizeof(*w.doff));
+	w.len = malloc(CT_CHUNK);
+	w.flags = malloc(CT_CHUNK);
+	w.bus = malloc(CT_CHUNK);
+	w.data = malloc(CT_CHUNK * CANFD_MAX_DLEN);
+
+	/* the header is rewritten with the bus names at the end */
+	hdr.magic = CT_MAGIC;
+	hdr.version = CT_VERSION;
+	int err = write_at(&w, &hdr, sizeof(hdr));
+
+	uint64_t frames = 0;
+	while (nheap && !err) {
+		struct input *in = heap[0];
+		err = add_frame(&w, &in->cur);
+		frames++;
+		if (!next_frame(in)) {
+			heap[0] = heap[--nheap];
+		}
+		heap_down(heap, nheap, 0);
+	}
+
+	struct ct_trailer t;
+	memset(&t, 0, sizeof(t));
+	err = err || flush_chunk(&w);
+	t.dir = w.off;
+	t.nchunk = w.nchunk;
+	t.magic = CT_MAGIC;
+	err = err || write_at(&w, w.dir, w.nchunk * sizeof(*w.dir)) ||
+	      write_at(&w, &t, sizeof(t)) || fseek(w.f, 0, SEEK_SET) ||
+	      fwrite(&hdr, sizeof(hdr), 1, w.f) != 1;
+	if (fclose(w.f) || err) {
+		perror(out);
+		return 1;
+	}
+	fprintf(stderr, "%llu frames in %d chunks, %u buses\n",
+		(unsigned long long)frames, w.nchunk, hdr.nbus);
+	return 0;
+}
+
+/*
+ * Querying
+ */
+struct trace {
+	const char *path;
+	const char *base;
+	size_t size;
+	const struct ct_header *hdr;
+	const struct ct_chunk *dir;
+	uint32_t nchunk;
+};
+
+static int open_trace(struct trace *t, const char *path)
+{
+	t->path = path;
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(path);
+		return -1;
+	}
+	t->size = st.st_size;
+	t->base = t->size ? mmap(NULL, t->size, PROT_READ, MAP_SHARED, fd, 0) :
+			    MAP_FAILED;
+	close(fd);
+	if (t->base == MAP_FAILED) {
+		fprintf(stderr, "%s: not a trace\n", path);
+		return -1;
+	}
+
+	struct ct_trailer tr;
+	t->hdr = (const struct ct_header *)t->base;
+	if (t->size < sizeof(*t->hdr) + sizeof(tr) ||
+	    t->hdr->magic != CT_MAGIC || t->hdr->version != CT_VERSION) {
+		fprintf(stderr, "%s: not a trace\n", path);
+		return -1;
+	}
+	memcpy(&tr, t->base + t->size - sizeof(tr), sizeof(tr));
+	if (tr.magic != CT_MAGIC || tr.dir > t->size - sizeof(tr) ||
+	    (t->size - sizeof(tr) - tr.dir) / sizeof(*t->dir) < tr.nchunk) {
+		fprintf(stderr, "%s: truncated\n", path);
+		return -1;
+	}
+	t->dir = (const struct ct_chunk *)(t->base + tr.dir);
+	t->nchunk = tr.nchunk;
+	madvise((void *)t->base, t->size, MADV_RANDOM);
+	return 0;
+}
+
+struct query {
+	int nid;
+	canid_t id[64], mask[64];
+	int exact; /* every id has a full mask */
+	int bus;
+	uint64_t from, to;
+	int count;
+};
+
+/* Returns whether c can hold frames matching q */
+static int chunk_matches(const struct query *q, const struct ct_chunk *c)
+{
+	if (c->tmax < q->from || c->tmin > q->to) {
+		return 0;
+	} else if (!q->nid || !q->exact) {
+		return 1;
+	}
+	for (int i = 0; i < q->nid; i++) {
+		if (bloom_has(c->bloom, q->id[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static size_t lower_bound(const uint64_t *t, size_t n, uint64_t v)
+{
+	size_t lo = 0, hi = n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (t[mid] < v) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+struct result {
+	char *buf;
+	size_t sz, cap;
+	uint64_t count;
+	int done;
+};
+
+static char *put(struct result *r, size_t n)
+{
+	if (r->sz + n > r->cap) {
+		r->cap = 2 * (r->sz + n) + 4096;
+		r->buf = realloc(r->buf, r->cap);
+	}
+	char *p = r->buf + r->sz;
+	r->sz += n;
+	return p;
+}
+
+static char *put_hex(char *p, uint32_t v, int digits)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	for (int i = digits - 1; i >= 0; i--) {
+		*p++ = hex[(v >> (4 * i)) & 15];
+	}
+	return p;
+}
+
+static void print_frame(struct result *r, const struct trace *t, uint64_t ns,
+			canid_t id, int len, int flags, int bus,
+			const uint8_t *data)
+{
+	char *p = put(r, 64 + CT_BUS_NAME + 2 * len);
+	p += sprintf(p, "(%010llu.%06llu) %s ",
+		     (unsigned long long)(ns / 1000000000),
+		     (unsigned long long)(ns % 1000000000 / 1000),
+		     t->hdr->bus[bus]);
+	if (id & CAN_ERR_FLAG) {
+		p = put_hex(p, id & (CAN_ERR_MASK | CAN_ERR_FLAG), 8);
+	} else if (id & CAN_EFF_FLAG) {
+		p = put_hex(p, id & CAN_EFF_MASK, 8);
+	} else {
+		p = put_hex(p, id & CAN_SFF_MASK, 3);
+	}
+	*p++ = '#';
+	if (flags & CT_FD) {
+		*p++ = '#';
+		p = put_hex(p, flags & 15, 1);
+	} else if (id & CAN_RTR_FLAG) {
+		*p++ = 'R';
+	}
+	for (int i = 0; i < len; i++) {
+		p = put_hex(p, data[i], 2);
+	}
+	*p++ = '\n';
+	r->sz = p - r->buf;
+}
+
+/* Appends the frames of chunk c matching q to r */
+static void scan_chunk(const struct query *q, const struct trace *t,
+		       const struct ct_chunk *c, struct result *r)
+{
+	size_t n = c->n;
+	const char *base = t->base + c->off;
+	if (c->off + CT_DATA(n) > t->size) {
+		return;
+	}
+	const uint64_t *time = (const uint64_t *)(base + CT_TIME(n));
+	const canid_t *id = (const canid_t *)(base + CT_ID(n));
+	const uint32_t *doff = (const uint32_t *)(base + CT_OFF(n));
+	const uint8_t *len = (const uint8_t *)(base + CT_LEN(n));
+	const uint8_t *flags = (const uint8_t *)(base + CT_FLAGS(n));
+	const uint8_t *bus = (const uint8_t *)(base + CT_BUS(n));
+	const uint8_t *data = (const uint8_t *)(base + CT_DATA(n));
+	size_t data_max = t->size - c->off - CT_DATA(n);
+
+	size_t lo = 0, hi = n;
+	if (c->sorted) {
+		lo = lower_bound(time, n, q->from);
+		hi = q->to == UINT64_MAX ? n : lower_bound(time, n, q->to + 1);
+	}
+
+	for (size_t i = lo; i < hi; i++) {
+		int hit = !q->nid;
+		for (int k = 0; k < q->nid && !hit; k++) {
+			hit = !((id[i] ^ q->id[k]) & q->mask[k]);
+		}
+		if (!hit || time[i] < q->from || time[i] > q->to ||
+		    (q->bus >= 0 && bus[i] != q->bus) ||
+		    doff[i] + len[i] > data_max) {
+			continue;
+		}
+		r->count++;
+		if (!q->count) {
+			print_frame(r, t, time[i], id[i], len[i], flags[i],
+				    bus[i], data + doff[i]);
+		}
+	}
+}
+
+/*
+ * Chunks are handed out in order. Workers stay within a window of the chunk
+ * being printed so the output buffered at any time stays bounded.
+ */
+struct job {
+	const struct query *q;
+	const struct trace *t;
+	int *plan;
+	int nplan;
+	int next, printed, window;
+	struct result *res;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *worker(void *arg)
+{
+	struct job *j = arg;
+	pthread_mutex_lock(&j->lock);
+	for (;;) {
+		while (j->next < j->nplan &&
+		       j->next >= j->printed + j->window) {
+			pthread_cond_wait(&j->cond, &j->lock);
+		}
+		if (j->next == j->nplan) {
+			break;
+		}
+		int i = j->next++;
+		pthread_mutex_unlock(&j->lock);
+
+		struct result r;
+		memset(&r, 0, sizeof(r));
+		scan_chunk(j->q, j->t, &j->t->dir[j->plan[i]], &r);
+
+		pthread_mutex_lock(&j->lock);
+		j->res[i] = r;
+		j->res[i].done = 1;
+		pthread_cond_broadcast(&j->cond);
+	}
+	pthread_mutex_unlock(&j->lock);
+	return NULL;
+}
+
+static uint64_t query_trace(const struct query *q, const struct trace *t,
+			    int nthreads)
+{
+	struct job j;
+	memset(&j, 0, sizeof(j));
+	j.q = q;
+	j.t = t;
+	j.plan = malloc(t->nchunk * sizeof(*j.plan) + 1);
+	for (uint32_t i = 0; i < t->nchunk; i++) {
+		if (chunk_matches(q, &t->dir[i])) {
+			j.plan[j.nplan++] = i;
+		}
+	}
+	j.window = 4 * nthreads;
+	j.res = calloc(j.nplan + 1, sizeof(*j.res));
+	pthread_mutex_init(&j.lock, NULL);
+	pthread_cond_init(&j.cond, NULL);
+
+	pthread_t *th = calloc(nthreads, sizeof(*th));
+	for (int i = 0; i < nthreads; i++) {
+		pthread_create(&th[i], NULL, &worker, &j);
+	}
+
+	uint64_t count = 0;
+	pthread_mutex_lock(&j.lock);
+	while (j.printed < j.nplan) {
+		struct result *r = &j.res[j.printed];
+		while (!r->done) {
+			pthread_cond_wait(&j.cond, &j.lock);
+		}
+		pthread_mutex_unlock(&j.lock);
+		fwrite(r->buf, 1, r->sz, stdout);
+		count += r->count;
+		free(r->buf);
+		pthread_mutex_lock(&j.lock);
+		j.printed++;
+		pthread_cond_broadcast(&j.cond);
+	}
+	pthread_mutex_unlock(&j.lock);
+
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(th[i], NULL);
+	}
+	free(th);
+	free(j.res);
+	free(j.plan);
+	pthread_mutex_destroy(&j.lock);
+	pthread_cond_destroy(&j.cond);
+	return count;
+}
+
+static uint64_t parse_time(const char *s, uint64_t dflt)
+{
+	if (!*s) {
+		return dflt;
+	}
+	char *e;
+	uint64_t sec = strtoull(s, &e, 10);
+	uint64_t ns = 0;
+	if (*e == '.') {
+		uint64_t scale = 100000000;
+		for (e++; *e >= '0' && *e <= '9'; e++, scale /= 10) {
+			ns += (*e - '0') * scale;
+		}
+	}
+	return sec * 1000000000 + ns;
+}
+
+static int query(int argc, char **argv)
+{
+	struct query q;
+	memset(&q, 0, sizeof(q));
+	q.exact = 1;
+	q.bus = -1;
+	q.to = UINT64_MAX;
+	const char *busname = NULL;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	int i = 0;
+	while (i + 1 < argc && argv[i][0] == '-') {
+		const char *arg = argv[i++];
+		if (!strcmp(arg, "-c")) {
+			q.count = 1;
+			continue;
+		}
+		const char *val = argv[i++];
+		if (!strcmp(arg, "-j")) {
+			nthreads = atoi(val);
+		} else if (!strcmp(arg, "-b")) {
+			busname = val;
+		} else if (!strcmp(arg, "-t")) {
+			const char *colon = strchr(val, ':');
+			if (!colon) {
+				return 2;
+			}
+			q.from = parse_time(val, 0);
+			q.to = parse_time(colon + 1, UINT64_MAX);
+		} else if (!strcmp(arg, "-i") && q.nid < 64) {
+			/* ids of more than 3 digits are EFF, as in the logs */
+			char *e;
+			canid_t id = strtoul(val, &e, 16);
+			int eff = e - val > 3 || id > CAN_SFF_MASK;
+			canid_t mask = CAN_EFF_FLAG | CAN_RTR_FLAG |
+				       (eff ? CAN_EFF_MASK : CAN_SFF_MASK);
+			if (eff) {
+				id |= CAN_EFF_FLAG;
+			}
+			if (*e == '/') {
+				mask = strtoul(e + 1, NULL, 16) |
+				       (CAN_EFF_FLAG | CAN_RTR_FLAG);
+				q.exact = 0;
+			}
+			q.id[q.nid] = id;
+			q.mask[q.nid++] = mask;
+		} else {
+			return 2;
+		}
+	}
+	if (i == argc || nthreads < 1) {
+		return 2;
+	}
+
+	uint64_t count = 0;
+	for (; i < argc; i++) {
+		struct trace t;
+		if (open_trace(&t, argv[i])) {
+			return 1;
+		}
+		q.bus = -1;
+		for (int b = 0; busname && b < t.hdr->nbus; b++) {
+			if (!strncmp(t.hdr->bus[b], busname, CT_BUS_NAME)) {
+				q.bus = b;
+			}
+		}
+		if (!busname || q.bus >= 0) {
+			count += query_trace(&q, &t, nthreads);
+		}
+		munmap((void *)t.base, t.size);
+	}
+	if (q.count) {
+		printf("%llu\n", (unsigned long long)count);
+	}
+	return 0;
+}
+
+static int info(int argc, char **argv)
+{
+	for (int i = 0; i < argc; i++) {
+		struct trace t;
+		if (open_trace(&t, argv[i])) {
+			return 1;
+		}
+		uint64_t frames = 0, tmin = UINT64_MAX, tmax = 0;
+		int unsorted = 0;
+		for (uint32_t c = 0; c < t.nchunk; c++) {
+			frames += t.dir[c].n;
+			tmin = t.dir[c].tmin < tmin ? t.dir[c].tmin : tmin;
+			tmax = t.dir[c].tmax > tmax ? t.dir[c].tmax : tmax;
+			unsorted += !t.dir[c].sorted;
+		}
+		printf("%s: %llu frames in %u chunks (%d out of order)",
+		       argv[i], (unsigned long long)frames, t.nchunk, unsorted);
+		if (frames) {
+			printf(", %llu.%06llu to %llu.%06llu",
+			       (unsigned long long)(tmin / 1000000000),
+			       (unsigned long long)(tmin % 1000000000 / 1000),
+			       (unsigned long long)(tmax / 1000000000),
+			       (unsigned long long)(tmax % 1000000000 / 1000));
+		}
+		printf("\n");
+		for (uint32_t b = 0; b < t.hdr->nbus; b++) {
+			printf("  bus %u %.*s\n", b, CT_BUS_NAME,
+			       t.hdr->bus[b]);
+		}
+		munmap((void *)t.base, t.size);
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int err = 2;
+	if (argc > 3 && !strcmp(argv[1], "build")) {
+		err = build(argv[2], argv + 3, argc - 3);
+	} else if (argc > 2 && !strcmp(argv[1], "query")) {
+		err = query(argc - 2, argv + 2);
+	} else if (argc > 2 && !strcmp(argv[1], "info")) {
+		err = info(argc - 2, argv + 2);
+	}
+	if (err == 2) {
+		fputs("usage: cantrace build out.ctr in.log [in.log ...]\n",
+		      stderr);
+		fputs("usage: cantrace query [-j threads] [-c] [-i id[/mask]]..."
+		      "\n                      [-b bus] [-t from:to] file.ctr ..."
+		      "\n",
+		      stderr);
+		fputs("usage: cantrace info file.ctr [file.ctr ...]\n", stderr);
+	}
+	return err;
+}
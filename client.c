@@ -1,108 +1,91 @@
-#include "can.h"
+#include "vcanz.h"
+#include "dbc.h"
+#include "vcan_connect.h"
 #include <stdio.h>
 #include <string.h>
-
-#ifdef _WIN32
-#include <winsock2.h>
-#include <windows.h>
-#include <ws2tcpip.h>
-#pragma comment(lib, "ws2_32.lib")
-static inline void perror(const char *msg)
-{
-	char buf[256];
-	DWORD sz = FormatMessageA(
-		FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-		NULL, GetLastError(), 0, buf, sizeof(buf), NULL);
-	fprintf(stderr, "%s: %.*s\n", msg, (int)sz, buf);
-}
-#else
-#include <netdb.h>
-#include <sys/socket.h>
-#include <sys/un.h>
-#include <unistd.h>
 #include <errno.h>
-static int connect_unix(int *pfd, const char *path)
-{
-	struct sockaddr_un su;
-	memset(&su, 0, sizeof(su));
-	su.sun_family = AF_UNIX;
-
-	size_t len = strlen(path);
-	if (len + 1 > sizeof(su.sun_path)) {
-		fprintf(stderr, "path %s is too long\n", path);
-		return -1;
-	}
-
-	memcpy(su.sun_path, path, len + 1);
 
-	int fd = socket(AF_UNIX, SOCK_STREAM, PF_UNIX);
-	if (fd < 0) {
-		perror("socket");
-		return -1;
-	}
-	socklen_t sulen = (char *)&su.sun_path[len + 1] - (char *)&su;
-	if (connect(fd, (struct sockaddr *)&su, sulen)) {
-		close(fd);
-		perror("connect");
-		return -1;
-	}
-
-	*pfd = fd;
-	return 0;
-}
+static struct vz_table ztx, zrx;
+static struct dbc db;
+#ifdef VCAN_ZLIB
+static z_stream zdeflate, zinflate;
 #endif
 
-static int connect_tcp(int *pfd, const char *host, const char *port)
+static void send_records(int fd, int zflags, char *buf, int n)
 {
-	struct addrinfo *ai, *res;
-	struct addrinfo hints;
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_socktype = SOCK_STREAM;
-	if (getaddrinfo(host, port, &hints, &res)) {
-		perror("getaddrinfo");
-		return -1;
+	char zbuf[VZ_BOUND(sizeof(struct canfd_frame) + 2) + 64];
+	if (zflags) {
+		n = vz_encode(&ztx, buf, n, zbuf);
+		buf = zbuf;
 	}
-	int err = 0;
-
-	for (ai = res; ai != NULL; ai = ai->ai_next) {
-		int fd = (int)socket(ai->ai_family, ai->ai_socktype,
-				     ai->ai_protocol);
-		if (fd < 0) {
-			continue;
-		}
-
-		if (connect(fd, ai->ai_addr, ai->ai_addrlen)) {
-#ifdef _WIN32
-			DWORD err = GetLastError();
-			closesocket(fd);
-			SetLastError(err);
-#else
-			int err = errno;
-			close(fd);
-			errno = err;
-#endif
-			continue;
-		}
-		*pfd = fd;
-		return 0;
+#ifdef VCAN_ZLIB
+	char dbuf[sizeof(zbuf)];
+	if (zflags & VCAN_COMPRESS_DEFLATE) {
+		n = vz_deflate(&zdeflate, buf, n, dbuf, sizeof(dbuf));
+		buf = dbuf;
 	}
+#endif
+	send(fd, buf, n, 0);
+}
 
-	perror("connect");
-	return -1;
+static void send_frame(int fd, int zflags)
+{
+	struct canfd_frame f;
+	memset(&f, 0, sizeof(f));
+	f.can_id = CAN_EFF_FLAG | 0x18EEFFEC;
+	f.len = 4;
+	f.data[0] = 1;
+	f.data[1] = 2;
+	f.data[2] = 3;
+	f.data[3] = 4;
+	char buf[2 + sizeof(f)];
+	uint16_t len = sizeof(f);
+	memcpy(buf, &len, 2);
+	memcpy(buf + 2, &f, sizeof(f));
+	send_records(fd, zflags, buf, sizeof(buf));
 }
 
-static int do_connect(int *pfd, int argc, char **argv)
+static void print_frame(const char *data, int len)
 {
-	switch (argc) {
-#ifndef _WIN32
-	case 2:
-		return connect_unix(pfd, argv[1]);
-#endif
-	case 3:
-		return connect_tcp(pfd, argv[1], argv[2]);
-	default:
-		return -1;
+	if (vcan_is_xl(data, len)) {
+		struct canxl_frame x;
+		memset(&x, 0, sizeof(x));
+		memcpy(&x, data, len < sizeof(x) ? len : sizeof(x));
+		fprintf(stderr, "RX XL 0x%03X VCID %u SDT 0x%02X AF 0x%08X",
+			x.prio & CANXL_PRIO_MASK,
+			(unsigned)((x.prio & CANXL_VCID_MASK) >>
+				   CANXL_VCID_OFFSET),
+			x.sdt, x.af);
+		for (int i = 0; i < x.len && CANXL_HDR_SIZE + i < len; i++) {
+			fprintf(stderr, " %02X", x.data[i]);
+		}
+	} else {
+		struct canfd_frame f;
+		memset(&f, 0, sizeof(f));
+		memcpy(&f, data, len < sizeof(f) ? len : sizeof(f));
+		fprintf(stderr, "RX 0x%08X", f.can_id);
+		for (int i = 0; i < f.len && i < sizeof(f.data); i++) {
+			fprintf(stderr, " %02X", f.data[i]);
+		}
+		const struct dbc_message *m = NULL;
+		if (db.nmsg) {
+			m = dbc_find(&db, f.can_id);
+		}
+		if (m) {
+			double *v = malloc(m->nsig * sizeof(*v));
+			dbc_decode(m, &f, v);
+			fprintf(stderr, " %s", m->name);
+			for (int i = 0; i < m->nsig; i++) {
+				if (!isnan(v[i])) {
+					fprintf(stderr, " %s=%g%s",
+						m->sig[i].name, v[i],
+						m->sig[i].unit);
+				}
+			}
+			free(v);
+		}
 	}
+	fputs("\n", stderr);
 }
 
 int main(int argc, char *argv[])
@@ -112,36 +95,67 @@ int main(int argc, char *argv[])
 	WSAStartup(MAKEWORD(2, 2), &wsa);
 #endif
 
+	if (argc > 2 && !strcmp(argv[1], "-d")) {
+		if (dbc_load(&db, argv[2])) {
+			return 2;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+
+	int want = 0;
+	if (argc > 1 && !strcmp(argv[1], "-z")) {
+		want = VCAN_COMPRESS_DELTA;
+		argc--;
+		argv++;
+	}
+#ifdef VCAN_ZLIB
+	if (argc > 1 && !strcmp(argv[1], "-Z")) {
+		want = VCAN_COMPRESS_DELTA | VCAN_COMPRESS_DEFLATE;
+		deflateInit(&zdeflate, Z_DEFAULT_COMPRESSION);
+		inflateInit(&zinflate);
+		argc--;
+		argv++;
+	}
+#endif
+
 	int fd;
 	if (do_connect(&fd, argc, argv)) {
 #ifndef _WIN32
-		fputs("usage: client unix-socket\n", stderr);
+		fputs("usage: client [-d file.dbc] [-z|-Z] unix-socket\n",
+		      stderr);
 #endif
-		fputs("usage: client host tcp-port\n", stderr);
+		fputs("usage: client [-d file.dbc] [-z|-Z] host tcp-port\n",
+		      stderr);
 		return 2;
 	}
 
-	struct canfd_frame f;
-	f.can_id = CAN_EFF_FLAG | 0x18EEFFEC;
-	f.len = 4;
-	f.data[0] = 1;
-	f.data[1] = 2;
-	f.data[2] = 3;
-	f.data[3] = 4;
-	uint16_t len = sizeof(f);
-	send(fd, (char *)&len, 2, 0);
-	send(fd, (char *)&f, sizeof(f), 0);
+	if (want) {
+		struct vcan_compress req;
+		memset(&req, 0, sizeof(req));
+		req.type = VCAN_COMPRESS;
+		req.flags = want;
+		char buf[2 + sizeof(req)];
+		uint16_t len = VCAN_CTRL | sizeof(req);
+		memcpy(buf, &len, 2);
+		memcpy(buf + 2, &req, sizeof(req));
+		send(fd, buf, sizeof(buf), 0);
+	} else {
+		send_frame(fd, 0);
+	}
 
-	char buf[1024];
+	static char buf[2 + VCAN_LEN_MASK];
+	char rbuf[1024];
+	static char tail[sizeof(buf) + sizeof(rbuf)];
 	int off = 0;
 	int have = 0;
+	int zflags = 0;
+	char *zin = NULL;
+	int zsz = 0;
+	int zcap = 0;
 
 	for (;;) {
-		memmove(buf, buf + off, have - off);
-		have -= off;
-		off = 0;
-
-		int sz = recv(fd, buf + have, sizeof(buf) - have, 0);
+		int sz = recv(fd, rbuf, sizeof(rbuf), 0);
 		if (sz == 0) {
 			fprintf(stderr, "RX EOF\n");
 			return 0;
@@ -153,26 +167,84 @@ int main(int argc, char *argv[])
 			perror("recv");
 			return 2;
 		}
-		have += sz;
 
-		while (off + 2 <= have) {
-			uint16_t len;
-			memcpy(&len, buf + off, 2);
-			if (off + 2 + len > have) {
+		char *in = rbuf;
+		for (;;) {
+			if (zflags) {
+#ifdef VCAN_ZLIB
+				if (zflags & VCAN_COMPRESS_DEFLATE) {
+					vz_inflate(&zinflate, in, sz, &zin, &zsz,
+						   &zcap);
+				} else
+#endif
+				{
+					if (zsz + sz > zcap) {
+						zcap = 2 * (zsz + sz);
+						zin = realloc(zin, zcap);
+					}
+					memcpy(zin + zsz, in, sz);
+					zsz += sz;
+				}
+				sz = 0;
+				int used;
+				int w = vz_decode(&zrx, zin, zsz, &used,
+						  buf + have,
+						  sizeof(buf) - have);
+				if (w < 0) {
+					fprintf(stderr, "corrupt stream\n");
+					return 2;
+				} else if (!w) {
+					break;
+				}
+				memmove(zin, zin + used, zsz - used);
+				zsz -= used;
+				have += w;
+			} else if (sz) {
+				int n = (int)sizeof(buf) - have;
+				if (n > sz) {
+					n = sz;
+				}
+				memcpy(buf + have, in, n);
+				have += n;
+				in += n;
+				sz -= n;
+			} else {
 				break;
 			}
-			char *data = buf + off + 2;
-			off += 2 + len;
-			struct canfd_frame f;
-			if (len > sizeof(f)) {
-				continue;
-			}
-			memcpy(&f, data, len);
-			fprintf(stderr, "RX 0x%08X", f.can_id);
-			for (int i = 0; i < f.len; i++) {
-				fprintf(stderr, " %02X", f.data[i]);
+
+			while (off + 2 <= have) {
+				uint16_t len;
+				memcpy(&len, buf + off, 2);
+				int ctrl = len & VCAN_CTRL;
+				len &= VCAN_LEN_MASK;
+				if (off + 2 + len > have) {
+					break;
+				}
+				char *data = buf + off + 2;
+				off += 2 + len;
+				if (ctrl && want && len >= 2 &&
+				    data[0] == VCAN_COMPRESS) {
+					zflags = (uint8_t)data[1];
+					want = 0;
+					fprintf(stderr, "compression %d\n",
+						zflags);
+					send_frame(fd, zflags);
+					/* the rest of the input is compressed,
+					 * or still plain if vcand declined */
+					memcpy(tail, buf + off, have - off);
+					memcpy(tail + have - off, in, sz);
+					sz += have - off;
+					in = tail;
+					have = off;
+					break;
+				} else if (!ctrl) {
+					print_frame(data, len);
+				}
 			}
-			fputs("\n", stderr);
+
+			memmove(buf, buf + off, have - off);
+			have -= off;
+			off = 0;
 		}
 	}
-}
\ No newline at end of file
+}
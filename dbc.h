@@ -0,0 +1,655 @@
+#pragma once
+
+#include "can.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * DBC signal decoding
+ *
+ * dbc_load reads the messages (BO_), signals (SG_) and float signal types
+ * (SIG_VALTYPE_) of a DBC file and compiles each signal to an extractor: an
+ * 8 byte word loaded from a fixed offset in the data, in intel or motorola
+ * byte order, shifted left to drop the bits above the signal and shifted
+ * right, arithmetically if signed, to drop those below. Signals that do not
+ * fit one word or are floats take a slower path.
+ *
+ * Signals come out as physical values, raw * scale + offset. Multiplexed
+ * signals whose multiplexor does not select them and signals past the end of
+ * the frame come out as NaN.
+ *
+ * Message cycle times are taken from the GenMsgCycleTime attribute (BA_ and
+ * its default in BA_DEF_DEF_), other attributes are ignored.
+ *
+ * dbc_batch_decode appends a batch of frames of any ids to per message
+ * columns. Frames are grouped by message and each signal is then decoded for
+ * all the frames of its message in tight loops over plain arrays, which the
+ * compiler vectorises at -O3.
+ */
+#define DBC_INT 0
+#define DBC_FLOAT 1
+#define DBC_DOUBLE 2
+
+/* dbc_signal.mux */
+#define DBC_PLAIN -1
+#define DBC_MUXER -2
+
+struct dbc_signal {
+	char *name;
+	char *unit;
+	int start, len;
+	int mux;
+	uint8_t motorola, is_signed, type;
+	double scale, offset, min, max;
+
+	/* extractor */
+	uint8_t off, lshift, rshift, last, wide;
+};
+
+struct dbc_message {
+	canid_t id;
+	char *name;
+	int size;
+	int muxer;
+	int cycle; /* ms, 0 if not cyclic */
+	int nsig;
+	struct dbc_signal *sig;
+};
+
+struct dbc {
+	int nmsg;
+	struct dbc_message *msg;
+	int bits;
+	int *index;
+	int cycle; /* default GenMsgCycleTime */
+};
+
+static char *dbc_strndup(const char *s, size_t n)
+{
+	char *p = malloc(n + 1);
+	memcpy(p, s, n);
+	p[n] = 0;
+	return p;
+}
+
+static uint32_t dbc_hash(const struct dbc *db, canid_t id)
+{
+	return (id * 2654435761U) >> (32 - db->bits);
+}
+
+/* Returns the message for the frame id, or NULL if the file has none */
+static inline const struct dbc_message *dbc_find(const struct dbc *db,
+						 canid_t id)
+{
+	if (id & (CAN_RTR_FLAG | CAN_ERR_FLAG)) {
+		return NULL;
+	}
+	uint32_t mask = (1U << db->bits) - 1;
+	for (uint32_t h = dbc_hash(db, id);; h = (h + 1) & mask) {
+		int i = db->index[h];
+		if (!i) {
+			return NULL;
+		} else if (db->msg[i - 1].id == id) {
+			return &db->msg[i - 1];
+		}
+	}
+}
+
+static int dbc_compile(struct dbc_signal *s)
+{
+	int first, last, bit;
+	if (s->len < 1 || s->len > 64 || s->start < 0 ||
+	    s->start >= 8 * CANFD_MAX_DLEN) {
+		return -1;
+	} else if (s->motorola) {
+		/* start is the msb, numbered 7..0 within each byte. bit counts
+		 * from the msb of byte 0 down through the frame. */
+		bit = (s->start / 8) * 8 + 7 - s->start % 8;
+		first = bit / 8;
+		last = (bit + s->len - 1) / 8;
+	} else {
+		bit = s->start;
+		first = bit / 8;
+		last = (bit + s->len - 1) / 8;
+	}
+	if (last >= CANFD_MAX_DLEN) {
+		return -1;
+	}
+
+	/* classic frames all load the word at 0 */
+	int off = last < 8 ? 0 : first < CANFD_MAX_DLEN - 8 ? first :
+							    CANFD_MAX_DLEN - 8;
+	bit -= 8 * off;
+	s->off = off;
+	s->last = last;
+	s->rshift = 64 - s->len;
+	s->lshift = s->motorola ? bit : 64 - bit - s->len;
+	s->wide = bit + s->len > 64;
+	if (s->wide) {
+		s->lshift = 0;
+	}
+	return 0;
+}
+
+static inline uint64_t dbc_word(const uint8_t *p, int motorola)
+{
+	uint64_t v = 0;
+	for (int i = 0; i < 8; i++) {
+		v |= (uint64_t)p[i] << (motorola ? 56 - 8 * i : 8 * i);
+	}
+	return v;
+}
+
+/* Returns the raw bits of s in f, sign extended if signed */
+static inline uint64_t dbc_raw(const struct dbc_signal *s,
+			       const struct canfd_frame *f)
+{
+	uint64_t v = 0;
+	if (!s->wide) {
+		uint64_t w = dbc_word(f->data + s->off, s->motorola);
+		if (s->is_signed && s->type == DBC_INT) {
+			return (uint64_t)((int64_t)(w << s->lshift) >>
+					  s->rshift);
+		} else {
+			return (w << s->lshift) >> s->rshift;
+		}
+	} else if (s->motorola) {
+		int bit = (s->start / 8) * 8 + 7 - s->start % 8;
+		for (int i = 0; i < s->len; i++, bit++) {
+			v = (v << 1) |
+			    ((f->data[bit / 8] >> (7 - bit % 8)) & 1);
+		}
+	} else {
+		for (int i = 0; i < s->len; i++) {
+			int bit = s->start + i;
+			v |= (uint64_t)((f->data[bit / 8] >> (bit % 8)) & 1)
+			     << i;
+		}
+	}
+	if (s->is_signed && s->type == DBC_INT && s->len < 64 &&
+	    (v >> (s->len - 1)) & 1) {
+		v |= ~(uint64_t)0 << s->len;
+	}
+	return v;
+}
+
+static inline double dbc_phys(const struct dbc_signal *s, uint64_t raw)
+{
+	if (s->type == DBC_FLOAT) {
+		uint32_t u = (uint32_t)raw;
+		float v;
+		memcpy(&v, &u, 4);
+		return v * s->scale + s->offset;
+	} else if (s->type == DBC_DOUBLE) {
+		double v;
+		memcpy(&v, &raw, 8);
+		return v * s->scale + s->offset;
+	} else if (s->is_signed) {
+		return (double)(int64_t)raw * s->scale + s->offset;
+	} else {
+		return (double)raw * s->scale + s->offset;
+	}
+}
+
+/* Decodes every signal of m in f to out[m->nsig] */
+static inline void dbc_decode(const struct dbc_message *m,
+			      const struct canfd_frame *f, double *out)
+{
+	uint64_t mux = 0;
+	if (m->muxer >= 0) {
+		mux = dbc_raw(&m->sig[m->muxer], f);
+	}
+	for (int i = 0; i < m->nsig; i++) {
+		const struct dbc_signal *s = &m->sig[i];
+		if (f->len <= s->last || (s->mux >= 0 && (m->muxer < 0 ||
+							   mux != s->mux))) {
+			out[i] = NAN;
+		} else {
+			out[i] = dbc_phys(s, dbc_raw(s, f));
+		}
+	}
+}
+
+static const char *dbc_token(const char *p, const char *e, const char **pend)
+{
+	while (p < e && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+	const char *s = p;
+	while (p < e && *p != ' ' && *p != '\t' && *p != ':') {
+		p++;
+	}
+	*pend = p;
+	return s;
+}
+
+static struct dbc_message *dbc_lookup_raw(struct dbc *db, uint32_t id)
+{
+	for (int i = 0; i < db->nmsg; i++) {
+		if (db->msg[i].id == id) {
+			return &db->msg[i];
+		}
+	}
+	return NULL;
+}
+
+static int dbc_signal(struct dbc_message *m, const char *p, const char *e)
+{
+	const char *name, *end;
+	name = dbc_token(p, e, &end);
+	if (end == name) {
+		return -1;
+	}
+
+	struct dbc_signal s;
+	memset(&s, 0, sizeof(s));
+	s.mux = DBC_PLAIN;
+	const char *t = dbc_token(end, e, &p);
+	if (p > t && *t == 'M') {
+		s.mux = DBC_MUXER;
+	} else if (p > t && *t == 'm') {
+		/* m3M is both multiplexed and a multiplexor for signals
+		 * further down, which we don't support */
+		s.mux = atoi(t + 1);
+	} else {
+		p = end;
+	}
+	while (p < e && *p != ':') {
+		p++;
+	}
+
+	char order, sign;
+	int n = 0;
+	char line[512];
+	size_t sz = e - p < sizeof(line) - 1 ? e - p : sizeof(line) - 1;
+	memcpy(line, p, sz);
+	line[sz] = 0;
+	if (sscanf(line, ": %d|%d@%c%c (%lf,%lf) [%lf|%lf] \"%n", &s.start,
+		   &s.len, &order, &sign, &s.scale, &s.offset, &s.min, &s.max,
+		   &n) != 8 ||
+	    !n || (order != '0' && order != '1') ||
+	    (sign != '+' && sign != '-')) {
+		return -1;
+	}
+	const char *unit = line + n;
+	const char *uend = strchr(unit, '"');
+	if (!uend) {
+		return -1;
+	}
+
+	s.motorola = order == '0';
+	s.is_signed = sign == '-';
+	if (dbc_compile(&s)) {
+		return -1;
+	}
+	s.name = dbc_strndup(name, end - name);
+	s.unit = dbc_strndup(unit, uend - unit);
+
+	if (s.mux == DBC_MUXER) {
+		m->muxer = m->nsig;
+	}
+	m->sig = realloc(m->sig, (m->nsig + 1) * sizeof(*m->sig));
+	m->sig[m->nsig++] = s;
+	return 0;
+}
+
+static int dbc_valtype(struct dbc *db, const char *p, const char *e)
+{
+	unsigned long id;
+	char name[256];
+	int type;
+	char line[512];
+	size_t sz = e - p < sizeof(line) - 1 ? e - p : sizeof(line) - 1;
+	memcpy(line, p, sz);
+	line[sz] = 0;
+	if (sscanf(line, "%lu %255s : %d", &id, name, &type) != 3) {
+		return -1;
+	}
+	struct dbc_message *m = dbc_lookup_raw(db, (uint32_t)id);
+	for (int i = 0; m && i < m->nsig; i++) {
+		struct dbc_signal *s = &m->sig[i];
+		if (!strcmp(s->name, name) && (type == DBC_FLOAT ||
+					       type == DBC_DOUBLE)) {
+			s->type = type;
+			if (s->len != (type == DBC_FLOAT ? 32 : 64) ||
+			    dbc_compile(s)) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static void dbc_attr(struct dbc *db, const char *p, const char *e, int dflt)
+{
+	unsigned long id;
+	int ms;
+	char line[512];
+	size_t sz = e - p < sizeof(line) - 1 ? e - p : sizeof(line) - 1;
+	memcpy(line, p, sz);
+	line[sz] = 0;
+	if (dflt) {
+		if (sscanf(line, " \"GenMsgCycleTime\" %d", &ms) == 1) {
+			db->cycle = ms;
+		}
+	} else if (sscanf(line, " \"GenMsgCycleTime\" BO_ %lu %d", &id,
+			  &ms) == 2) {
+		struct dbc_message *m = dbc_lookup_raw(db, (uint32_t)id);
+		if (m) {
+			m->cycle = ms;
+		}
+	}
+}
+
+static void dbc_free(struct dbc *db)
+{
+	for (int i = 0; i < db->nmsg; i++) {
+		struct dbc_message *m = &db->msg[i];
+		for (int j = 0; j < m->nsig; j++) {
+			free(m->sig[j].name);
+			free(m->sig[j].unit);
+		}
+		free(m->sig);
+		free(m->name);
+	}
+	free(db->msg);
+	free(db->index);
+	memset(db, 0, sizeof(*db));
+}
+
+/* Loads the DBC file at path into db. Returns -1 with a message printed on
+ * error. */
+static int dbc_load(struct dbc *db, const char *path)
+{
+	memset(db, 0, sizeof(*db));
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	char *text = NULL;
+	size_t sz = 0, cap = 0;
+	for (;;) {
+		if (cap - sz < 4096) {
+			cap = 2 * cap + 4096;
+			text = realloc(text, cap);
+		}
+		size_t n = fread(text + sz, 1, cap - sz, f);
+		if (!n) {
+			break;
+		}
+		sz += n;
+	}
+	fclose(f);
+
+	struct dbc_message *m = NULL;
+	int lineno = 0;
+	for (const char *p = text, *e; p < text + sz; p = e + 1) {
+		lineno++;
+		e = memchr(p, '\n', text + sz - p);
+		if (!e) {
+			e = text + sz;
+		}
+		const char *end;
+		const char *kw = dbc_token(p, e, &end);
+		int err = 0;
+		if (end - kw == 3 && !memcmp(kw, "BO_", 3)) {
+			char *idend;
+			unsigned long id = strtoul(end, &idend, 10);
+			const char *name = dbc_token(idend, e, &end);
+			m = NULL;
+			if (end == name || end == e) {
+				err = 1;
+			} else if ((id & ~(unsigned long)CAN_EFF_FLAG) >
+				   CAN_EFF_MASK) {
+				/* VECTOR__INDEPENDENT_SIG_MSG and the like */
+			} else {
+				db->msg = realloc(db->msg, (db->nmsg + 1) *
+								   sizeof(*m));
+				m = &db->msg[db->nmsg++];
+				memset(m, 0, sizeof(*m));
+				m->id = (canid_t)id;
+				m->name = dbc_strndup(name, end - name);
+				m->size = atoi(end + 1);
+				m->muxer = -1;
+				m->cycle = -1;
+			}
+		} else if (end - kw == 3 && !memcmp(kw, "SG_", 3)) {
+			err = m && dbc_signal(m, end, e);
+		} else if (end - kw == 12 && !memcmp(kw, "SIG_VALTYPE_", 12)) {
+			err = dbc_valtype(db, end, e);
+		} else if (end - kw == 3 && !memcmp(kw, "BA_", 3)) {
+			m = NULL;
+			dbc_attr(db, end, e, 0);
+		} else if (end - kw == 11 && !memcmp(kw, "BA_DEF_DEF_", 11)) {
+			m = NULL;
+			dbc_attr(db, end, e, 1);
+		} else if (end > kw) {
+			m = NULL;
+		}
+		if (err) {
+			fprintf(stderr, "%s:%d: invalid %.*s\n", path, lineno,
+				(int)(end - kw), kw);
+			free(text);
+			dbc_free(db);
+			return -1;
+		}
+	}
+	free(text);
+
+	for (int i = 0; i < db->nmsg; i++) {
+		if (db->msg[i].cycle < 0) {
+			db->msg[i].cycle = db->cycle > 0 ? db->cycle : 0;
+		}
+	}
+
+	db->bits = 4;
+	while ((1 << db->bits) < 2 * db->nmsg) {
+		db->bits++;
+	}
+	uint32_t mask = (1U << db->bits) - 1;
+	db->index = calloc(1 << db->bits, sizeof(*db->index));
+	for (int i = 0; i < db->nmsg; i++) {
+		uint32_t h = dbc_hash(db, db->msg[i].id);
+		while (db->index[h]) {
+			h = (h + 1) & mask;
+		}
+		db->index[h] = i + 1;
+	}
+	return 0;
+}
+
+/*
+ * Columnar batches
+ *
+ * cols[i] holds the rows decoded for db->msg[i] so far, signal j of row r at
+ * v[j * cap + r]. dbc_batch_clear empties the columns, keeping the memory.
+ */
+struct dbc_columns {
+	int rows, cap;
+	double *v;
+};
+
+struct dbc_batch {
+	struct dbc_columns *cols;
+	int cap;
+	int *msg;
+	int *start;
+	const struct canfd_frame **frame;
+	uint64_t *word;
+	uint64_t *mux;
+	uint8_t *len;
+};
+
+static inline void dbc_batch_init(struct dbc_batch *b, const struct dbc *db)
+{
+	memset(b, 0, sizeof(*b));
+	b->cols = calloc(db->nmsg + 1, sizeof(*b->cols));
+	b->start = calloc(db->nmsg + 1, sizeof(*b->start));
+}
+
+static inline void dbc_batch_clear(struct dbc_batch *b, const struct dbc *db)
+{
+	for (int i = 0; i < db->nmsg; i++) {
+		b->cols[i].rows = 0;
+	}
+}
+
+static inline void dbc_batch_free(struct dbc_batch *b, const struct dbc *db)
+{
+	for (int i = 0; i < db->nmsg; i++) {
+		free(b->cols[i].v);
+	}
+	free(b->cols);
+	free(b->msg);
+	free(b->start);
+	free(b->frame);
+	free(b->word);
+	free(b->mux);
+	free(b->len);
+}
+
+static void dbc_columns_grow(struct dbc_columns *c, int nsig, int rows)
+{
+	int cap = c->cap ? c->cap : 64;
+	while (cap < rows) {
+		cap *= 2;
+	}
+	if (cap == c->cap) {
+		return;
+	}
+	double *v = malloc((size_t)cap * (nsig ? nsig : 1) * sizeof(*v));
+	for (int j = 0; j < nsig && c->rows; j++) {
+		memcpy(v + (size_t)j * cap, c->v + (size_t)j * c->cap,
+		       c->rows * sizeof(*v));
+	}
+	free(c->v);
+	c->v = v;
+	c->cap = cap;
+}
+
+static void dbc_column(const struct dbc_message *m,
+		       const struct dbc_signal *s, const struct dbc_batch *b,
+		       const struct canfd_frame **f, int k, double *out)
+{
+	uint64_t *w = b->word;
+	if (s->mux >= 0 && m->muxer < 0) {
+		for (int r = 0; r < k; r++) {
+			out[r] = NAN;
+		}
+		return;
+	} else if (s->wide || s->type != DBC_INT) {
+		for (int r = 0; r < k; r++) {
+			out[r] = dbc_phys(s, dbc_raw(s, f[r]));
+		}
+	} else {
+		for (int r = 0; r < k; r++) {
+			w[r] = dbc_word(f[r]->data + s->off, s->motorola);
+		}
+		uint8_t l = s->lshift, rs = s->rshift;
+		double scale = s->scale, offset = s->offset;
+		/* most signals are narrow enough to convert from int32_t, which
+		 * unlike the 64 bit conversions every vector unit can do */
+		int rs32 = 32 - s->len;
+		if (s->len <= 32 && s->is_signed) {
+			for (int r = 0; r < k; r++) {
+				uint32_t x = (uint32_t)((w[r] << l) >> 32);
+				out[r] = ((int32_t)x >> rs32) * scale + offset;
+			}
+		} else if (s->len < 32) {
+			for (int r = 0; r < k; r++) {
+				uint32_t x = (uint32_t)((w[r] << l) >> 32);
+				out[r] = (int32_t)(x >> rs32) * scale + offset;
+			}
+		} else if (s->is_signed) {
+			for (int r = 0; r < k; r++) {
+				out[r] = (double)((int64_t)(w[r] << l) >> rs) *
+						 scale +
+					 offset;
+			}
+		} else {
+			for (int r = 0; r < k; r++) {
+				out[r] = (double)((w[r] << l) >> rs) * scale +
+					 offset;
+			}
+		}
+	}
+
+	const uint8_t *len = b->len;
+	for (int r = 0; r < k; r++) {
+		out[r] = len[r] > s->last ? out[r] : NAN;
+	}
+	if (s->mux >= 0) {
+		const uint64_t *mux = b->mux;
+		uint64_t want = (uint64_t)s->mux;
+		for (int r = 0; r < k; r++) {
+			out[r] = mux[r] == want ? out[r] : NAN;
+		}
+	}
+}
+
+/* Decodes the n frames at f, appending a row to the columns of the message
+ * of each. Returns the number of frames of messages in db. */
+static inline int dbc_batch_decode(struct dbc_batch *b, const struct dbc *db,
+				   const struct canfd_frame *f, int n)
+{
+	if (n > b->cap) {
+		b->cap = n;
+		b->msg = realloc(b->msg, n * sizeof(*b->msg));
+		b->frame = realloc(b->frame, n * sizeof(*b->frame));
+		b->word = realloc(b->word, n * sizeof(*b->word));
+		b->mux = realloc(b->mux, n * sizeof(*b->mux));
+		b->len = realloc(b->len, n * sizeof(*b->len));
+	}
+
+	/* count and then bucket the frames by message */
+	memset(b->start, 0, (db->nmsg + 1) * sizeof(*b->start));
+	for (int i = 0; i < n; i++) {
+		const struct dbc_message *m = dbc_find(db, f[i].can_id);
+		b->msg[i] = m ? (int)(m - db->msg) : db->nmsg;
+		b->start[b->msg[i]]++;
+	}
+	int found = n - b->start[db->nmsg];
+	for (int i = 0, at = 0; i <= db->nmsg; i++) {
+		int k = b->start[i];
+		b->start[i] = at;
+		at += k;
+	}
+	for (int i = 0; i < n; i++) {
+		b->frame[b->start[b->msg[i]]++] = &f[i];
+	}
+
+	for (int i = 0, at = 0; i < db->nmsg; i++) {
+		const struct dbc_message *m = &db->msg[i];
+		const struct canfd_frame **rows = b->frame + at;
+		int k = b->start[i] - at;
+		at = b->start[i];
+		if (!k) {
+			continue;
+		}
+
+		struct dbc_columns *c = &b->cols[i];
+		dbc_columns_grow(c, m->nsig, c->rows + k);
+
+		for (int r = 0; r < k; r++) {
+			b->len[r] = rows[r]->len;
+		}
+		if (m->muxer >= 0) {
+			const struct dbc_signal *s = &m->sig[m->muxer];
+			for (int r = 0; r < k; r++) {
+				b->mux[r] = rows[r]->len > s->last ?
+						    dbc_raw(s, rows[r]) :
+						    ~(uint64_t)0;
+			}
+		}
+		for (int j = 0; j < m->nsig; j++) {
+			dbc_column(m, &m->sig[j], b, rows, k,
+				   c->v + (size_t)j * c->cap + c->rows);
+		}
+		c->rows += k;
+	}
+	return found;
+}
@@ -0,0 +1,837 @@
+#define _GNU_SOURCE
+
+#include "vcan.h"
+#include "vcan_connect.h"
+#include "wheel.h"
+#include "dbc.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+/*
+ * Simulates a pool of ECUs sending their cyclic frames through vcand.
+ *
+ *   ./ecupool [-n nodes] [-c conns | -p] [-j jitter_pct] [-o id_step]
+ *             [-i default_ms] [-t seconds] [-m] -d file.dbc unix-socket
+ *   ./ecupool ... -l trace.log host tcp-port
+ *
+ * Every node sends each message of the schedule. With -d the schedule is the
+ * messages of a DBC file at their GenMsgCycleTime, or default_ms (100) for
+ * those without one, with the data all zero. With -l it is the ids of a
+ * candump -L log at the mean interval between their frames, with the data of
+ * their last one. Node k sends its messages with the ids offset by
+ * k * id_step (default 0), ids that no longer fit 11 bits becoming extended.
+ * Each message starts at a random phase and then keeps to a fixed grid, every
+ * frame displaced from it by up to half of jitter_pct percent of the period
+ * either way.
+ *
+ * All the nodes run off one timer wheel of TICK_NS ticks. The frames that
+ * come due in a tick are batched into one write per connection: the nodes
+ * share conns connections (default 4) round robin, or with -p each has its
+ * own. Once a second and at the end it prints the frames sent against those
+ * scheduled and how late they went out, from the time the schedule gave them
+ * to the write completing. With -m a further connection listens to the bus
+ * and reports how far apart the frames of each id arrive against the period,
+ * for the ids only one message sends.
+ */
+#define TICK_NS 100000
+#define MAX_BUF (1 << 20)
+#define HIST_BUCKETS 976
+
+static uint64_t rand_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rand64(void)
+{
+	/* xorshift64* */
+	rand_state ^= rand_state >> 12;
+	rand_state ^= rand_state << 25;
+	rand_state ^= rand_state >> 27;
+	return rand_state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Log linear histogram: values below 16 have a bucket each, then every power
+ * of two is split in 16, which keeps quantiles within 6%.
+ */
+struct hist {
+	uint64_t n, max;
+	uint64_t b[HIST_BUCKETS];
+};
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+	int i = (int)v;
+	if (v >= 16) {
+		int e = 63 - __builtin_clzll(v);
+		i = (e - 3) * 16 + (int)((v >> (e - 4)) & 15);
+	}
+	h->b[i]++;
+	h->n++;
+	if (v > h->max) {
+		h->max = v;
+	}
+}
+
+static double hist_quantile(const struct hist *h, double q)
+{
+	uint64_t want = (uint64_t)(q * h->n), seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->b[i];
+		if (seen > want) {
+			if (i < 16) {
+				return i;
+			}
+			uint64_t v = (uint64_t)(16 + i % 16) << (i / 16 - 1);
+			return (double)v;
+		}
+	}
+	return h->max;
+}
+
+static void hist_merge(struct hist *to, struct hist *from)
+{
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		to->b[i] += from->b[i];
+	}
+	to->n += from->n;
+	if (from->max > to->max) {
+		to->max = from->max;
+	}
+	memset(from, 0, sizeof(*from));
+}
+
+static void print_hist(const char *what, const struct hist *h)
+{
+	if (h->n) {
+		printf(" %s p50 %.1f p99 %.1f p99.9 %.1f max %.1f us", what,
+		       hist_quantile(h, 0.5) / 1e3,
+		       hist_quantile(h, 0.99) / 1e3,
+		       hist_quantile(h, 0.999) / 1e3, h->max / 1e3);
+	}
+}
+
+/*
+ * Schedule
+ *
+ * A message as read from the DBC or log, with its record encoded once.
+ */
+struct msg {
+	canid_t id;
+	uint64_t period;
+	uint64_t first, last, count;
+	uint16_t reclen;
+	char rec[2 + CANFD_MTU];
+};
+
+static struct msg *msgs;
+static int nmsgs, msgs_cap;
+static int *msg_index;
+static int msg_bits;
+
+static uint32_t id_hash(canid_t id, int bits)
+{
+	return (id * 0x9E3779B1U) >> (32 - bits);
+}
+
+static struct msg *find_msg(canid_t id)
+{
+	uint32_t mask = (1U << msg_bits) - 1;
+	for (uint32_t h = id_hash(id, msg_bits);; h = (h + 1) & mask) {
+		if (!msg_index[h]) {
+			break;
+		} else if (msgs[msg_index[h] - 1].id == id) {
+			return &msgs[msg_index[h] - 1];
+		}
+	}
+	return NULL;
+}
+
+static void reindex(void)
+{
+	msg_bits = 4;
+	while ((1 << msg_bits) < 2 * nmsgs) {
+		msg_bits++;
+	}
+	free(msg_index);
+	msg_index = calloc(1 << msg_bits, sizeof(*msg_index));
+	uint32_t mask = (1U << msg_bits) - 1;
+	for (int i = 0; i < nmsgs; i++) {
+		uint32_t h = id_hash(msgs[i].id, msg_bits);
+		while (msg_index[h]) {
+			h = (h + 1) & mask;
+		}
+		msg_index[h] = i + 1;
+	}
+}
+
+static struct msg *add_msg(canid_t id)
+{
+	if (nmsgs == msgs_cap) {
+		msgs_cap = 2 * msgs_cap + 64;
+		msgs = realloc(msgs, msgs_cap * sizeof(*msgs));
+	}
+	struct msg *m = &msgs[nmsgs++];
+	memset(m, 0, sizeof(*m));
+	m->id = id;
+	if (2 * nmsgs > (1 << msg_bits)) {
+		reindex();
+	} else {
+		uint32_t mask = (1U << msg_bits) - 1;
+		uint32_t h = id_hash(id, msg_bits);
+		while (msg_index[h]) {
+			h = (h + 1) & mask;
+		}
+		msg_index[h] = nmsgs;
+	}
+	return m;
+}
+
+static int fd_len(int len)
+{
+	if (len <= CAN_MAX_DLEN) {
+		return len;
+	}
+	static const uint8_t lens[] = {12, 16, 20, 24, 32, 48, 64};
+	for (int i = 0; i < sizeof(lens); i++) {
+		if (len <= lens[i]) {
+			return lens[i];
+		}
+	}
+	return -1;
+}
+
+static void encode(struct msg *m, const uint8_t *data, int len, int fd)
+{
+	struct canfd_frame f;
+	memset(&f, 0, sizeof(f));
+	f.can_id = m->id;
+	f.len = fd ? fd_len(len) : len;
+	memcpy(f.data, data, len);
+	uint16_t sz = fd ? CANFD_MTU : CAN_MTU;
+	memcpy(m->rec, &sz, 2);
+	memcpy(m->rec + 2, &f, sz);
+	m->reclen = 2 + sz;
+}
+
+static int load_dbc(const char *path, uint64_t dflt)
+{
+	struct dbc db;
+	if (dbc_load(&db, path)) {
+		return -1;
+	}
+	uint8_t zero[CANFD_MAX_DLEN];
+	memset(zero, 0, sizeof(zero));
+	for (int i = 0; i < db.nmsg; i++) {
+		const struct dbc_message *d = &db.msg[i];
+		if (d->size < 0 || fd_len(d->size) < 0 || find_msg(d->id)) {
+			continue;
+		}
+		struct msg *m = add_msg(d->id);
+		m->period = d->cycle ? (uint64_t)d->cycle * 1000000 : dflt;
+		encode(m, zero, d->size, d->size > CAN_MAX_DLEN);
+	}
+	dbc_free(&db);
+	return 0;
+}
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	} else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+/* Reads "(sec.usec) bus id#data" and "id##Fdata" lines of candump -L,
+ * skipping remote and error frames */
+static int load_log(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	char line[512];
+	while (fgets(line, sizeof(line), f)) {
+		char *s = line, *e;
+		if (*s++ != '(') {
+			continue;
+		}
+		uint64_t ns = strtoull(s, &e, 10) * 1000000000;
+		if (*e != '.') {
+			continue;
+		}
+		int digits = 0;
+		uint64_t frac = 0;
+		for (s = e + 1; *s >= '0' && *s <= '9'; s++, digits++) {
+			if (digits < 9) {
+				frac = frac * 10 + (*s - '0');
+			}
+		}
+		for (; digits < 9; digits++) {
+			frac *= 10;
+		}
+		ns += frac;
+		s = strchr(s, ' ');
+		s = s ? strchr(s + 1, ' ') : NULL;
+		if (!s) {
+			continue;
+		}
+		s++;
+
+		canid_t id = 0;
+		int n;
+		for (n = 0; hexval(s[n]) >= 0; n++) {
+			id = (id << 4) | hexval(s[n]);
+		}
+		if (s[n] != '#' || (n != 3 && n != 8) || s[n + 1] == 'R' ||
+		    (id & CAN_ERR_FLAG)) {
+			continue;
+		} else if (n == 8) {
+			id |= CAN_EFF_FLAG;
+		}
+		s += n + 1;
+		int fd = 0, max = CAN_MAX_DLEN;
+		if (*s == '#') {
+			fd = 1;
+			max = CANFD_MAX_DLEN;
+			s += 2;
+		}
+		uint8_t data[CANFD_MAX_DLEN];
+		for (n = 0; n < max; n++, s += 2) {
+			if (*s == '.') {
+				s++;
+			}
+			int hi = hexval(s[0]), lo = hi < 0 ? -1 : hexval(s[1]);
+			if (lo < 0) {
+				break;
+			}
+			data[n] = (uint8_t)(hi << 4 | lo);
+		}
+
+		struct msg *m = find_msg(id);
+		if (!m) {
+			m = add_msg(id);
+			m->first = ns;
+		}
+		m->last = ns;
+		m->count++;
+		encode(m, data, n, fd);
+	}
+	fclose(f);
+
+	/* ids seen once have no period to keep */
+	int n = 0;
+	for (int i = 0; i < nmsgs; i++) {
+		struct msg *m = &msgs[i];
+		if (m->count > 1 && m->last > m->first) {
+			m->period = (m->last - m->first) / (m->count - 1);
+			msgs[n++] = *m;
+		}
+	}
+	nmsgs = n;
+	reindex();
+	return 0;
+}
+
+/*
+ * Connections
+ *
+ * Records are queued as their timers fire and written when the tick is done,
+ * noting the time each was due so that its lateness can be taken once the
+ * write of its last byte has completed.
+ */
+struct conn {
+	int fd, epollout;
+	struct conn *next_dirty;
+	char *buf;
+	size_t sz, off, cap;
+	struct pending {
+		uint64_t due;
+		size_t end;
+	} *pend;
+	int npend, head, pend_cap;
+};
+
+static struct conn *conns;
+static int nconns;
+static struct conn *dirty;
+static int efd;
+
+/* A transmitting message of a node */
+struct tx {
+	struct timer t;
+	struct conn *c;
+	const struct msg *m;
+	canid_t id;
+	uint64_t base, due, n;
+};
+
+static struct wheel wheel;
+static uint64_t start;
+static int jitter;
+static uint64_t scheduled, sent, dropped;
+static struct hist late, late_total;
+
+static uint64_t ns_to_ticks(uint64_t ns)
+{
+	return (ns - start + TICK_NS - 1) / TICK_NS;
+}
+
+static void schedule(struct tx *x)
+{
+	uint64_t p = x->m->period;
+	x->due = x->base + x->n++ * p;
+	if (jitter) {
+		uint64_t span = p * jitter / 100;
+		x->due += rand64() % (span + 1);
+		x->due = x->due > span / 2 ? x->due - span / 2 : 0;
+	}
+	if (x->due < start) {
+		x->due = start;
+	}
+	timer_start(&wheel, &x->t, ns_to_ticks(x->due));
+}
+
+static void tx_fire(struct wheel *w, struct timer *t)
+{
+	struct tx *x = (struct tx *)t;
+	struct conn *c = x->c;
+	scheduled++;
+	if (c->sz - c->off + x->m->reclen > MAX_BUF) {
+		dropped++;
+	} else {
+		if (c->sz + x->m->reclen > c->cap) {
+			c->cap = 2 * c->cap + 4096;
+			c->buf = realloc(c->buf, c->cap);
+		}
+		if (c->npend == c->pend_cap) {
+			c->pend_cap = 2 * c->pend_cap + 64;
+			c->pend = realloc(c->pend,
+					  c->pend_cap * sizeof(*c->pend));
+		}
+		char *p = c->buf + c->sz;
+		memcpy(p, x->m->rec, x->m->reclen);
+		memcpy(p + 2, &x->id, sizeof(x->id));
+		c->sz += x->m->reclen;
+		c->pend[c->npend].due = x->due;
+		c->pend[c->npend++].end = c->sz;
+		if (!c->next_dirty) {
+			c->next_dirty = dirty ? dirty : c;
+			dirty = c;
+		}
+	}
+	schedule(x);
+}
+
+static void set_epollout(struct conn *c, int on)
+{
+	if (c->epollout != on) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+		ev.data.ptr = c;
+		epoll_ctl(efd, EPOLL_CTL_MOD, c->fd, &ev);
+		c->epollout = on;
+	}
+}
+
+/* Drops what has been sent from the front of the buffer so that it only
+ * ever holds the unsent bytes */
+static void compact(struct conn *c)
+{
+	memmove(c->buf, c->buf + c->off, c->sz - c->off);
+	memmove(c->pend, c->pend + c->head,
+		(c->npend - c->head) * sizeof(*c->pend));
+	c->npend -= c->head;
+	for (int i = 0; i < c->npend; i++) {
+		c->pend[i].end -= c->off;
+	}
+	c->sz -= c->off;
+	c->off = 0;
+	c->head = 0;
+}
+
+static int flush(struct conn *c)
+{
+	while (c->off < c->sz) {
+		ssize_t n = send(c->fd, c->buf + c->off, c->sz - c->off,
+				 MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && errno == EAGAIN) {
+			compact(c);
+			set_epollout(c, 1);
+			return 0;
+		} else if (n < 0) {
+			perror("send");
+			return -1;
+		}
+		c->off += n;
+		uint64_t now = now_ns();
+		while (c->head < c->npend && c->pend[c->head].end <= c->off) {
+			uint64_t due = c->pend[c->head++].due;
+			hist_add(&late, now > due ? now - due : 0);
+			sent++;
+		}
+	}
+	c->sz = c->off = 0;
+	c->npend = c->head = 0;
+	set_epollout(c, 0);
+	return 0;
+}
+
+/*
+ * Monitor (-m)
+ *
+ * Frames of ids that a single message sends are timed against the period.
+ */
+struct seen {
+	canid_t id;
+	int owners;
+	uint64_t period, last;
+};
+
+static struct seen *seen;
+static int seen_bits;
+static int mon = -1;
+static uint64_t received;
+static struct hist gap, gap_total;
+
+static struct seen *find_seen(canid_t id)
+{
+	uint32_t mask = (1U << seen_bits) - 1;
+	for (uint32_t h = id_hash(id, seen_bits);; h = (h + 1) & mask) {
+		if (!seen[h].owners || seen[h].id == id) {
+			return &seen[h];
+		}
+	}
+}
+
+static void monitor_frame(canid_t id, uint64_t now)
+{
+	struct seen *s = find_seen(id);
+	received++;
+	if (s->owners == 1) {
+		if (s->last) {
+			uint64_t d = now - s->last;
+			hist_add(&gap, d > s->period ? d - s->period
+						     : s->period - d);
+		}
+		s->last = now;
+	}
+}
+
+static int monitor_read(void)
+{
+	static char buf[65536];
+	static size_t have;
+	ssize_t n = recv(mon, buf + have, sizeof(buf) - have, MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return 0;
+	} else if (n <= 0) {
+		fputs("monitor connection closed\n", stderr);
+		return -1;
+	}
+	have += n;
+	uint64_t now = now_ns();
+	size_t off = 0;
+	while (have - off >= 2) {
+		uint16_t len;
+		memcpy(&len, buf + off, 2);
+		size_t sz = 2 + (len & VCAN_LEN_MASK);
+		if (have - off < sz) {
+			break;
+		}
+		if (!(len & VCAN_CTRL) && len >= sizeof(canid_t) &&
+		    !vcan_is_xl(buf + off + 2, len)) {
+			canid_t id;
+			memcpy(&id, buf + off + 2, sizeof(id));
+			monitor_frame(id, now);
+		}
+		off += sz;
+	}
+	memmove(buf, buf + off, have - off);
+	have -= off;
+	return 0;
+}
+
+static void report(int secs, uint64_t ival)
+{
+	static uint64_t last_sched, last_sent, last_rx;
+	printf("%4ds sent %9.0f/s of %9.0f/s", secs,
+	       (sent - last_sent) * 1e9 / ival,
+	       (scheduled - last_sched) * 1e9 / ival);
+	print_hist("late", &late);
+	if (mon >= 0) {
+		printf(" rx %9.0f/s", (received - last_rx) * 1e9 / ival);
+		print_hist("period error", &gap);
+	}
+	putchar('\n');
+	fflush(stdout);
+	last_sched = scheduled;
+	last_sent = sent;
+	last_rx = received;
+	hist_merge(&late_total, &late);
+	hist_merge(&gap_total, &gap);
+}
+
+/* Subscribes to no frames, the filter matching no id a frame can have */
+static void subscribe_none(int fd)
+{
+	struct vcan_subscribe s;
+	struct vcan_filter f;
+	char buf[2 + sizeof(s) + sizeof(f)];
+	memset(&s, 0, sizeof(s));
+	s.type = VCAN_SUBSCRIBE;
+	s.count = 1;
+	f.id = 0xFFFFFFFFU;
+	f.mask = 0xFFFFFFFFU;
+	uint16_t len = VCAN_CTRL | (sizeof(s) + sizeof(f));
+	memcpy(buf, &len, 2);
+	memcpy(buf + 2, &s, sizeof(s));
+	memcpy(buf + 2 + sizeof(s), &f, sizeof(f));
+	send(fd, buf, sizeof(buf), MSG_NOSIGNAL);
+}
+
+static void add_fd(int fd, void *ptr)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = ptr;
+	epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void usage(void)
+{
+	fputs("usage: ecupool [-n nodes] [-c conns | -p] [-j jitter_pct] "
+	      "[-o id_step]\n"
+	      "               [-i default_ms] [-t seconds] [-m] "
+	      "-d file.dbc | -l trace.log\n"
+	      "               unix-socket | host tcp-port\n",
+	      stderr);
+}
+
+int main(int argc, char *argv[])
+{
+	int nodes = 100, per_node = 0, monitor = 0, secs = 10;
+	uint64_t dflt = 100000000;
+	canid_t step = 0;
+	const char *dbc = NULL, *log = NULL;
+	nconns = 4;
+
+	while (argc > 1 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-p")) {
+			per_node = 1;
+		} else if (!strcmp(argv[1], "-m")) {
+			monitor = 1;
+		} else if (argc < 3) {
+			break;
+		} else if (!strcmp(argv[1], "-n")) {
+			nodes = atoi(argv[2]);
+		} else if (!strcmp(argv[1], "-c")) {
+			nconns = atoi(argv[2]);
+		} else if (!strcmp(argv[1], "-j")) {
+			jitter = atoi(argv[2]);
+		} else if (!strcmp(argv[1], "-o")) {
+			step = strtoul(argv[2], NULL, 0);
+		} else if (!strcmp(argv[1], "-i")) {
+			dflt = strtoull(argv[2], NULL, 10) * 1000000;
+		} else if (!strcmp(argv[1], "-t")) {
+			secs = atoi(argv[2]);
+		} else if (!strcmp(argv[1], "-d")) {
+			dbc = argv[2];
+		} else if (!strcmp(argv[1], "-l")) {
+			log = argv[2];
+		} else {
+			break;
+		}
+		int skip = argv[1][1] == 'p' || argv[1][1] == 'm' ? 1 : 2;
+		argc -= skip;
+		argv += skip;
+	}
+	if (nodes <= 0 || nconns <= 0 || jitter < 0 || jitter > 200 ||
+	    !dflt || secs <= 0 || !dbc == !log || argc < 2 || argc > 3) {
+		usage();
+		return 2;
+	}
+
+	reindex();
+	if (dbc ? load_dbc(dbc, dflt) : load_log(log)) {
+		return 1;
+	}
+	if (!nmsgs) {
+		fputs("no cyclic messages to send\n", stderr);
+		return 1;
+	}
+
+	if (per_node) {
+		nconns = nodes;
+		struct rlimit rl;
+		if (!getrlimit(RLIMIT_NOFILE, &rl) &&
+		    rl.rlim_cur < rl.rlim_max) {
+			rl.rlim_cur = rl.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &rl);
+		}
+	} else if (nconns > nodes) {
+		nconns = nodes;
+	}
+
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	conns = calloc(nconns, sizeof(*conns));
+	for (int i = 0; i < nconns; i++) {
+		if (do_connect(&conns[i].fd, argc, argv)) {
+			return 1;
+		}
+		subscribe_none(conns[i].fd);
+		add_fd(conns[i].fd, &conns[i]);
+	}
+
+	struct tx *txs = calloc((size_t)nodes * nmsgs, sizeof(*txs));
+	double nominal = 0;
+	for (int k = 0; k < nodes; k++) {
+		for (int i = 0; i < nmsgs; i++) {
+			struct tx *x = &txs[(size_t)k * nmsgs + i];
+			x->m = &msgs[i];
+			x->c = &conns[k % nconns];
+			x->id = msgs[i].id + (canid_t)k * step;
+			if (!(x->id & CAN_EFF_FLAG) && x->id > CAN_SFF_MASK) {
+				x->id |= CAN_EFF_FLAG;
+			}
+			nominal += 1e9 / msgs[i].period;
+		}
+	}
+
+	if (monitor) {
+		if (do_connect(&mon, argc, argv)) {
+			return 1;
+		}
+		add_fd(mon, NULL);
+		seen_bits = 4;
+		while ((1 << seen_bits) < 2 * nodes * nmsgs) {
+			seen_bits++;
+		}
+		seen = calloc(1 << seen_bits, sizeof(*seen));
+		for (size_t i = 0; i < (size_t)nodes * nmsgs; i++) {
+			struct seen *s = find_seen(txs[i].id);
+			s->id = txs[i].id;
+			s->period = txs[i].m->period;
+			s->owners++;
+		}
+	}
+
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &tfd;
+	epoll_ctl(efd, EPOLL_CTL_ADD, tfd, &ev);
+
+	/* give vcand a chance to accept everything before we start sending */
+	usleep(100000);
+
+	start = now_ns();
+	wheel_init(&wheel, 0);
+	for (size_t i = 0; i < (size_t)nodes * nmsgs; i++) {
+		struct tx *x = &txs[i];
+		x->t.fn = &tx_fire;
+		x->base = start + rand64() % x->m->period;
+		schedule(x);
+	}
+	printf("%d nodes of %d messages over %d connections, %.0f frames/s\n",
+	       nodes, nmsgs, nconns, nominal);
+
+	uint64_t end = start + (uint64_t)secs * 1000000000;
+	uint64_t next_report = start + 1000000000;
+	int second = 0;
+	for (;;) {
+		uint64_t now = now_ns();
+		wheel_advance(&wheel, (now - start) / TICK_NS);
+		while (dirty) {
+			struct conn *c = dirty;
+			dirty = c->next_dirty == c ? NULL : c->next_dirty;
+			c->next_dirty = NULL;
+			if (flush(c)) {
+				return 1;
+			}
+		}
+
+		now = now_ns();
+		if (now >= next_report) {
+			report(++second, now - (next_report - 1000000000));
+			next_report += 1000000000;
+		}
+		if (now >= end) {
+			break;
+		}
+
+		uint64_t at = start + wheel_next(&wheel) * TICK_NS;
+		if (at > next_report) {
+			at = next_report;
+		}
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = at / 1000000000;
+		its.it_value.tv_nsec = at % 1000000000;
+		timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+
+		struct epoll_event evs[64];
+		int n = epoll_wait(efd, evs, 64, -1);
+		for (int i = 0; i < n; i++) {
+			struct conn *c = evs[i].data.ptr;
+			uint64_t expirations;
+			if (c == (void *)&tfd) {
+				if (read(tfd, &expirations, 8) < 0) {
+					/* spurious wakeup */
+				}
+			} else if (!c) {
+				if (monitor_read()) {
+					return 1;
+				}
+			} else if (evs[i].events & EPOLLOUT) {
+				if (flush(c)) {
+					return 1;
+				}
+			} else {
+				/* the cache of vcand -c, nothing else */
+				char buf[4096];
+				ssize_t r = recv(c->fd, buf, sizeof(buf),
+						 MSG_DONTWAIT);
+				if (!r || (r < 0 && errno != EAGAIN &&
+					   errno != EINTR)) {
+					fputs("connection closed\n", stderr);
+					return 1;
+				}
+			}
+		}
+	}
+
+	hist_merge(&late_total, &late);
+	hist_merge(&gap_total, &gap);
+	printf("total scheduled %llu sent %llu dropped %llu unsent %llu, "
+	       "%.0f/s of %.0f/s nominal\n",
+	       (unsigned long long)scheduled, (unsigned long long)sent,
+	       (unsigned long long)dropped,
+	       (unsigned long long)(scheduled - sent - dropped),
+	       sent * 1e9 / (now_ns() - start), nominal);
+	print_hist("late", &late_total);
+	if (mon >= 0) {
+		printf(" rx %llu", (unsigned long long)received);
+		print_hist("period error", &gap_total);
+	}
+	putchar('\n');
+	return 0;
+}
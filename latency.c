@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+
+#include "vcan.h"
+#include "vcan_connect.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+
+/*
+ * Measures the time for a frame to get through vcand. Two connections are
+ * opened to the daemon. Frames carrying a send timestamp are written on one
+ * and timed as they come out of the other, one frame in flight at a time.
+ * -c pins the tool to CPU, which should not be the one vcand -b spins on.
+ *
+ *   ./latency [-n count] [-i interval_us] [-c cpu] unix-socket
+ *   ./latency [-n count] [-i interval_us] [-c cpu] host tcp-port
+ */
+
+static int read_frame(int fd, struct can_frame *f)
+{
+	char buf[2 + sizeof(*f)];
+	int have = 0;
+	while (have < sizeof(buf)) {
+		int n = recv(fd, buf + have, sizeof(buf) - have, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return -1;
+		}
+		have += n;
+	}
+	memcpy(f, buf + 2, sizeof(*f));
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+	int count = 10000;
+	uint64_t interval = 1000;
+
+	while (argc > 2 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-n")) {
+			count = atoi(argv[2]);
+		} else if (!strcmp(argv[1], "-i")) {
+			interval = strtoull(argv[2], NULL, 10);
+		} else if (!strcmp(argv[1], "-c")) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(atoi(argv[2]), &set);
+			if (sched_setaffinity(0, sizeof(set), &set)) {
+				perror("sched_setaffinity");
+				return 2;
+			}
+		} else {
+			break;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+
+	int tx, rx;
+	if (count <= 0 || do_connect(&tx, argc, argv) ||
+	    do_connect(&rx, argc, argv)) {
+		fputs("usage: latency [-n count] [-i interval_us] [-c cpu] "
+		      "unix-socket\n",
+		      stderr);
+		fputs("usage: latency [-n count] [-i interval_us] [-c cpu] "
+		      "host tcp-port\n",
+		      stderr);
+		return 2;
+	}
+
+	/* give vcand a chance to accept both before we start sending */
+	usleep(100000);
+
+	uint64_t *samples = malloc(count * sizeof(*samples));
+	uint64_t next = now_ns();
+
+	for (int i = 0; i < count; i++) {
+		while (now_ns() < next) {
+		}
+		next += interval * 1000;
+
+		struct can_frame f;
+		memset(&f, 0, sizeof(f));
+		f.can_id = 0x123;
+		f.can_dlc = 8;
+		uint64_t sent = now_ns();
+		memcpy(f.data, &sent, sizeof(sent));
+
+		char buf[2 + sizeof(f)];
+		uint16_t len = sizeof(f);
+		memcpy(buf, &len, 2);
+		memcpy(buf + 2, &f, sizeof(f));
+		if (send(tx, buf, sizeof(buf), MSG_NOSIGNAL) != sizeof(buf) ||
+		    read_frame(rx, &f)) {
+			perror("transfer");
+			return 1;
+		}
+
+		memcpy(&sent, f.data, sizeof(sent));
+		samples[i] = now_ns() - sent;
+	}
+
+	qsort(samples, count, sizeof(*samples), &cmp_u64);
+	printf("frames %d min %.1f p50 %.1f p99 %.1f p99.9 %.1f max %.1f us\n",
+	       count, samples[0] / 1e3, samples[count / 2] / 1e3,
+	       samples[(int)(count * 0.99)] / 1e3,
+	       samples[(int)(count * 0.999)] / 1e3, samples[count - 1] / 1e3);
+	return 0;
+}
@@ -0,0 +1,115 @@
+#include "vcand_plugin.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Example vcand plugin simulating a node on the bus.
+ *
+ *   cc -shared -fPIC -o nodesim.so nodesim.c
+ *   ./vcand -P ./nodesim.so:ID[:PERIOD_MS[:worker]] ...
+ *
+ * Every PERIOD_MS (default 10) the node sends frame ID with an alive counter
+ * in byte 0 and the number of frames it has seen since the last one in
+ * bytes 4 to 7. It answers a frame of ID + 1 at once with a frame of ID + 2
+ * carrying the same data, and reports connections coming and going on
+ * stderr. With "worker" it runs on a vcand worker thread.
+ */
+struct node {
+	struct vcand_host *h;
+	const struct vcand_host_api *api;
+	canid_t id;
+	uint64_t period, next;
+	uint8_t alive;
+	uint32_t seen;
+};
+
+static void send_frame(struct node *n, canid_t id, const uint8_t *data)
+{
+	char rec[2 + CAN_MTU];
+	struct can_frame f;
+	uint16_t len = CAN_MTU;
+	memset(&f, 0, sizeof(f));
+	f.can_id = id;
+	f.len = CAN_MAX_DLEN;
+	memcpy(f.data, data, CAN_MAX_DLEN);
+	memcpy(rec, &len, 2);
+	memcpy(rec + 2, &f, sizeof(f));
+	n->api->send(n->h, rec, sizeof(rec));
+}
+
+static void node_recv(void *ctx, uint64_t ns, const void *recs, int sz)
+{
+	struct node *n = ctx;
+	const char *p = recs;
+	const char *e = p + sz;
+	while (p < e) {
+		uint16_t len;
+		memcpy(&len, p, 2);
+		struct can_frame f;
+		if (!(len & VCAN_CTRL) && len == CAN_MTU) {
+			memcpy(&f, p + 2, sizeof(f));
+			n->seen++;
+			if (f.can_id == n->id + 1) {
+				send_frame(n, n->id + 2, f.data);
+			}
+		}
+		p += 2 + (len & VCAN_LEN_MASK);
+	}
+}
+
+static void node_timer(void *ctx, uint64_t ns)
+{
+	struct node *n = ctx;
+	uint8_t data[CAN_MAX_DLEN];
+	memset(data, 0, sizeof(data));
+	data[0] = n->alive++;
+	memcpy(data + 4, &n->seen, 4);
+	n->seen = 0;
+	send_frame(n, n->id, data);
+
+	/* stay on the grid rather than drift by the tick rounding */
+	n->next += n->period;
+	if (n->next <= ns) {
+		n->next = ns + n->period;
+	}
+	n->api->set_timer(n->h, n->next);
+}
+
+static void node_member(void *ctx, unsigned id, int joined)
+{
+	struct node *n = ctx;
+	fprintf(stderr, "nodesim %x: connection %u %s\n", n->id, id,
+		joined ? "joined" : "left");
+}
+
+int vcand_plugin_init(struct vcand_host *h, const struct vcand_host_api *api,
+		      const char *arg, struct vcand_plugin *p)
+{
+	if (api->abi != VCAND_PLUGIN_ABI) {
+		return -1;
+	}
+	char *end;
+	unsigned long id = strtoul(arg, &end, 0);
+	unsigned long ms = *end == ':' ? strtoul(end + 1, &end, 0) : 10;
+	if (end == arg || !ms || id > CAN_SFF_MASK - 2) {
+		fputs("nodesim: usage ID[:PERIOD_MS[:worker]]\n", stderr);
+		return -1;
+	}
+
+	struct node *n = calloc(1, sizeof(*n));
+	n->h = h;
+	n->api = api;
+	n->id = id;
+	n->period = ms * 1000000;
+	n->next = api->now(h) + n->period;
+	api->set_timer(h, n->next);
+
+	p->abi = VCAND_PLUGIN_ABI;
+	p->flags = strstr(end, ":worker") ? VCAND_PLUGIN_WORKER : 0;
+	p->ctx = n;
+	p->recv = &node_recv;
+	p->timer = &node_timer;
+	p->member = &node_member;
+	return 0;
+}
@@ -0,0 +1,388 @@
+#pragma once
+
+#include "can.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * vcand wire protocol
+ *
+ * The stream is a sequence of records. Each record is a native endian
+ * uint16_t length followed by that many bytes. Plain records hold a struct
+ * can_frame, a struct canfd_frame or a struct canxl_frame cut short after its
+ * len bytes of data, and are forwarded to the other clients as is. XL frames
+ * are told apart by CANXL_XLF, which falls in the length byte of the others.
+ * Records with VCAN_CTRL set in the length are control messages to or from
+ * vcand. They start with a uint8_t type and are never forwarded.
+ */
+#define VCAN_CTRL 0x8000U
+#define VCAN_LEN_MASK 0x7FFFU
+
+/* Returns whether the plain record of len bytes at p is a CAN XL frame */
+static inline int vcan_is_xl(const void *p, uint16_t len)
+{
+	return len >= CANXL_HDR_SIZE && (((const uint8_t *)p)[4] & CANXL_XLF);
+}
+
+enum vcan_ctrl_type {
+	/* struct vcan_join, client -> vcand: join the lockstep clock */
+	VCAN_JOIN = 1,
+	/* struct vcan_time, client -> vcand: virtual time of frames sent
+	 * after this */
+	VCAN_TIME = 2,
+	/* struct vcan_time, client -> vcand: done with everything before ns */
+	VCAN_BARRIER = 3,
+	/* struct vcan_time, vcand -> client: the clock has advanced to ns */
+	VCAN_TICK = 4,
+	/* struct vcan_compress, both ways: request and accept compression */
+	VCAN_COMPRESS = 5,
+	/* struct vcan_subscribe, client -> vcand: set the frames to receive */
+	VCAN_SUBSCRIBE = 6,
+	/* struct vcan_snapshot, client -> vcand: send the cached bus state,
+	 * vcand -> client: end of the cached bus state */
+	VCAN_SNAPSHOT = 7,
+	/* struct vcan_tx_setup, client -> vcand: set up a cyclic frame */
+	VCAN_TX_SETUP = 8,
+	/* struct vcan_tx_id, client -> vcand: remove a cyclic frame */
+	VCAN_TX_DELETE = 9,
+	/* struct vcan_tx_id, vcand -> client: count ran out */
+	VCAN_TX_EXPIRED = 10,
+	/* struct vcan_peer, vcand -> vcand: make this connection a trunk */
+	VCAN_PEER = 11,
+	/* struct vcan_interest, vcand -> vcand: set the frames to forward */
+	VCAN_INTEREST = 12,
+	/* struct vcan_trunk, vcand -> vcand: a batch of frames */
+	VCAN_TRUNK = 13,
+	/* struct vcan_rx_setup, client -> vcand: only deliver changes */
+	VCAN_RX_SETUP = 14,
+	/* struct vcan_tx_id, client -> vcand: remove a change filter */
+	VCAN_RX_DELETE = 15,
+	/* struct vcan_tx_id, vcand -> client: a frame stopped arriving */
+	VCAN_RX_TIMEOUT = 16,
+	/* struct vcan_session, both ways: start or resume a session */
+	VCAN_SESSION = 17,
+	/* struct vcan_seq, vcand -> client: frames accounted for so far */
+	VCAN_SEQ = 18,
+	/* struct vcan_rate, client -> vcand: limit the rate of some ids */
+	VCAN_RATE = 19,
+	/* struct vcan_tap, client -> vcand: tap the bus,
+	 * vcand -> client: frames on the bus */
+	VCAN_TAP = 20,
+};
+
+/*
+ * Lockstep clock (vcand -l)
+ *
+ * Participants send VCAN_JOIN with a node id unique to the simulation. The
+ * node id breaks ties in the release order so that runs are reproducible
+ * regardless of connection order. Each participant then runs its model up to
+ * some virtual time and sends VCAN_BARRIER with that time. Once every
+ * participant is at a barrier, vcand advances the clock to the earliest
+ * barrier, releases every queued frame stamped at or before it ordered by
+ * (time, CAN arbitration, node, send order) and sends VCAN_TICK to the
+ * participants. Participants whose barrier was reached run again. Frames are
+ * stamped with the current clock, or a later time set with VCAN_TIME.
+ */
+struct vcan_join {
+	uint8_t type;
+	uint8_t __pad[3];
+	uint32_t node;
+};
+
+struct vcan_time {
+	uint8_t type;
+	uint8_t __pad[7];
+	uint64_t ns;
+};
+
+/*
+ * Link compression
+ *
+ * The client sends VCAN_COMPRESS with the codings it wants and waits for the
+ * reply, which carries the subset vcand accepted. Everything after the
+ * request from the client and after the reply from vcand is then coded as
+ * described in vcanz.h.
+ */
+#define VCAN_COMPRESS_DELTA 0x01
+#define VCAN_COMPRESS_DEFLATE 0x02
+
+struct vcan_compress {
+	uint8_t type;
+	uint8_t flags;
+	uint8_t __pad[2];
+};
+
+/*
+ * Subscriptions
+ *
+ * VCAN_SUBSCRIBE is followed by count filters and replaces any earlier set.
+ * A frame is delivered if (can_id & mask) == (id & mask) for any filter. No
+ * filters, the default, delivers everything.
+ *
+ * With vcand -c the last frame of each CAN id is cached. New connections are
+ * sent the whole cache, and VCAN_SNAPSHOT or VCAN_SUB_SNAPSHOT sends the part
+ * matching the client's filters. Either way VCAN_SNAPSHOT follows the cached
+ * frames.
+ */
+#define VCAN_SUB_SNAPSHOT 0x01
+
+struct vcan_filter {
+	canid_t id;
+	canid_t mask;
+};
+
+struct vcan_subscribe {
+	uint8_t type;
+	uint8_t flags;
+	uint16_t count;
+	/* struct vcan_filter filters[count]; */
+};
+
+struct vcan_snapshot {
+	uint8_t type;
+	uint8_t __pad[3];
+};
+
+/*
+ * Cyclic transmission, after CAN_BCM TX_SETUP
+ *
+ * VCAN_TX_SETUP is followed by a frame as in a plain record and
+ * creates or updates the job for that CAN id on this connection. vcand then
+ * sends the frame as if from the client: count times every ival1_ns and
+ * every ival2_ns after that. Intervals are rounded up to vcand's 1 ms tick.
+ *
+ * VCAN_TX_SETTIMER	take count and the intervals from this message,
+ *			otherwise only the frame data is updated
+ * VCAN_TX_STARTTIMER	(re)start the timer
+ * VCAN_TX_ANNOUNCE	send the frame once immediately
+ * VCAN_TX_COUNTEVT	send VCAN_TX_EXPIRED once count runs out
+ *
+ * Jobs are removed with VCAN_TX_DELETE or when the connection closes. In
+ * lockstep mode they run on the virtual clock.
+ */
+#define VCAN_TX_SETTIMER 0x01
+#define VCAN_TX_STARTTIMER 0x02
+#define VCAN_TX_ANNOUNCE 0x04
+#define VCAN_TX_COUNTEVT 0x08
+
+struct vcan_tx_setup {
+	uint8_t type;
+	uint8_t flags;
+	uint8_t __pad[2];
+	uint32_t count;
+	uint64_t ival1_ns;
+	uint64_t ival2_ns;
+	/* the frame follows */
+};
+
+struct vcan_tx_id {
+	uint8_t type;
+	uint8_t __pad[3];
+	canid_t can_id;
+};
+
+/*
+ * Change filters, after CAN_BCM RX_SETUP with RX_CHECK_DLC
+ *
+ * VCAN_RX_SETUP is followed by a frame as in a plain record whose data is a
+ * mask of the relevant bits, and creates or replaces the filter for that CAN
+ * id on this connection. Frames of the id that the subscription delivers are
+ * then dropped unless their length or masked data differ from the last one
+ * delivered. An empty mask only lets length changes through.
+ *
+ * With timeout_ns set, VCAN_RX_TIMEOUT is sent when no frame of the id has
+ * arrived for that long, after which the next frame is delivered whether it
+ * changed or not. The timeout is rounded up to vcand's 1 ms tick and rearms
+ * with the next frame.
+ *
+ * VCAN_RX_DELETE removes the filter. Filters are also removed when the
+ * connection closes.
+ */
+struct vcan_rx_setup {
+	uint8_t type;
+	uint8_t __pad[7];
+	uint64_t timeout_ns;
+	/* the mask frame follows */
+};
+
+/*
+ * Downsampling
+ *
+ * VCAN_RATE limits the frames the subscription delivers of each id matching
+ * filter to one every ival_ns, and replaces any earlier VCAN_RATE with the
+ * same filter. An ival_ns of zero removes it. A frame goes by the first of
+ * the connection's filters that matches, in the order they were set. vcand
+ * holds the frames and every ival_ns, on a timer shared by the ids of the
+ * filter, sends the newest of each id that arrived meanwhile. Values are
+ * thus at most ival_ns old when sent. Snapshot frames are held likewise.
+ *
+ * With VCAN_RATE_MINMAX it sends instead the frames in which the field of
+ * len bits at start was lowest and highest, in the order they arrived, or
+ * just one if that is the same frame. The field is laid out as a DBC signal:
+ * little endian with start its lowest bit or, with VCAN_RATE_MOTOROLA, big
+ * endian with start its highest. VCAN_RATE_SIGNED compares it as signed.
+ * Missing data bytes count as zero.
+ */
+#define VCAN_RATE_MINMAX 0x01
+#define VCAN_RATE_MOTOROLA 0x02
+#define VCAN_RATE_SIGNED 0x04
+
+struct vcan_rate {
+	uint8_t type;
+	uint8_t flags;
+	uint16_t start;
+	uint8_t len;
+	uint8_t __pad[3];
+	struct vcan_filter filter;
+	uint64_t ival_ns;
+};
+
+/*
+ * Taps
+ *
+ * VCAN_TAP with VCAN_TAP_ON makes the connection a tap and without it a
+ * plain connection again. A tap gets every frame on the bus, its own
+ * included and whatever its subscription, as VCAN_TAP messages each followed
+ * by records that connection from sent, or in the case of a trunk passed on,
+ * at ns. That is vcand's monotonic clock, or the virtual time with vcand -l.
+ * A tap gets no plain frames.
+ */
+#define VCAN_TAP_ON 0x01
+
+struct vcan_tap {
+	uint8_t type;
+	uint8_t flags;
+	uint8_t __pad[2];
+	uint32_t from;
+	uint64_t ns;
+	/* records follow */
+};
+
+/*
+ * Session resume
+ *
+ * vcand numbers the frames it passes on in the order it does so. A client
+ * sends VCAN_SESSION with token 0 to start a session and the reply carries
+ * the token and the number of the next frame. From then on VCAN_SEQ follows
+ * the frames sent to the client with the number of the next frame, meaning
+ * that every frame before it was either delivered or filtered out.
+ *
+ * After reconnecting the client sets up its subscription and filters again
+ * and sends VCAN_SESSION with the token and the seq of the last VCAN_SEQ it
+ * got. vcand replays the frames from seq on that the subscription delivers,
+ * other than those the client sent itself, and carries on with live frames.
+ * Frames vcand no longer has (vcand -r sets how many it keeps) are skipped
+ * and reported with VCAN_SEQ_GAP in a VCAN_SEQ whose seq is the next frame
+ * that is still there. A connection still holding the session is closed.
+ *
+ * Sessions are dropped a minute after their connection goes away. If the
+ * token is not known, such as after vcand was restarted without -u, the
+ * reply carries a new token and is followed by VCAN_SEQ_GAP. Tokens only tell
+ * sessions apart and are no protection against other clients.
+ */
+#define VCAN_SEQ_GAP 0x01
+
+struct vcan_session {
+	uint8_t type;
+	uint8_t __pad[7];
+	uint64_t token;
+	uint64_t seq;
+};
+
+struct vcan_seq {
+	uint8_t type;
+	uint8_t flags;
+	uint8_t __pad[6];
+	uint64_t seq;
+};
+
+/*
+ * Datagram framing (vcand -s)
+ *
+ * On a SOCK_SEQPACKET connection each message is one record without the
+ * length, which is that of the message. A control message is preceded by
+ * VCAN_SEQPACKET_CTRL in place of a can_id, which no frame has. Messages are
+ * best sent and received many at a time with sendmmsg and recvmmsg.
+ *
+ * A message may instead be VCAN_SEQPACKET_BATCH followed by whole records as
+ * on the stream, at most 65536 bytes of them. Once a client has sent one,
+ * vcand sends it batches too. VCAN_COMPRESS and VCAN_PEER are ignored on
+ * these connections.
+ */
+#define VCAN_SEQPACKET_CTRL 0xFFFFFFFFU
+#define VCAN_SEQPACKET_BATCH 0xFFFFFFFEU
+
+/*
+ * Federation (vcand -p)
+ *
+ * A daemon dials each of its peers and sends VCAN_PEER with its daemon id, a
+ * random id picked at startup. The peer answers with its own and from then
+ * on the connection is a trunk carrying only the messages below.
+ *
+ * VCAN_INTEREST is followed by count filters, the union of those of every
+ * client and other trunk on the sender's side, and replaces any earlier set.
+ * With VCAN_INTEREST_ALL the sender wants everything, as it is assumed to
+ * until the first VCAN_INTEREST arrives.
+ *
+ * VCAN_TRUNK is followed by records that entered the federation at daemon
+ * origin, which numbered the batch seq. The receiver drops batches it has
+ * already seen via another path and passes the rest on to its other trunks
+ * with hops decremented, until hops reaches zero.
+ */
+#define VCAN_INTEREST_ALL 0x01
+
+struct vcan_peer {
+	uint8_t type;
+	uint8_t __pad[3];
+	uint32_t daemon;
+};
+
+struct vcan_interest {
+	uint8_t type;
+	uint8_t flags;
+	uint16_t count;
+	/* struct vcan_filter filters[count]; */
+};
+
+struct vcan_trunk {
+	uint8_t type;
+	uint8_t hops;
+	uint8_t __pad[2];
+	uint32_t origin;
+	uint32_t seq;
+	/* records follow */
+};
+
+/*
+ * Multicast bus (vcand -m)
+ *
+ * Datagrams between vcand daemons start with struct vcan_mcast. sender is
+ * the daemon that sent the datagram and source the daemon whose sequence
+ * numbers seq and count refer to. Both are random ids picked at startup.
+ *
+ * VCAN_MC_DATA		records as on the stream, numbered seq
+ * VCAN_MC_NACK		sender asks source to resend [seq, seq + count)
+ * VCAN_MC_LOST		source no longer has [seq, seq + count)
+ * VCAN_MC_HEARTBEAT	source's next data will be numbered seq
+ *
+ * The header and records are in the sender's byte order, like the stream. A
+ * daemon of the other byte order sees the magic reversed and drops them.
+ */
+#define VCAN_MC_MAGIC 0x434D4356U /* "VCMC" on little endian */
+
+enum vcan_mcast_type {
+	VCAN_MC_DATA = 1,
+	VCAN_MC_NACK = 2,
+	VCAN_MC_LOST = 3,
+	VCAN_MC_HEARTBEAT = 4,
+};
+
+struct vcan_mcast {
+	uint32_t magic;
+	uint8_t type;
+	uint8_t __pad[3];
+	uint32_t sender;
+	uint32_t source;
+	uint32_t seq;
+	uint32_t count;
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+static inline void perror(const char *msg)
+{
+	char buf[256];
+	DWORD sz = FormatMessageA(
+		FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+		NULL, GetLastError(), 0, buf, sizeof(buf), NULL);
+	fprintf(stderr, "%s: %.*s\n", msg, (int)sz, buf);
+}
+#else
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#endif
+
+/*
+ * Connecting the vcand tools to the daemon
+ *
+ * do_connect takes the tool's trailing arguments, argv[0] being whatever
+ * precedes them: one names a unix socket, not on Windows, and two a TCP
+ * host and port. TCP connections have Nagle switched off as the tools send
+ * small records. now_ns is CLOCK_MONOTONIC, as vcand uses, or the
+ * performance counter on Windows.
+ */
+#ifndef _WIN32
+static inline int connect_unix(int *pfd, const char *path)
+{
+	struct sockaddr_un su;
+	memset(&su, 0, sizeof(su));
+	su.sun_family = AF_UNIX;
+
+	size_t len = strlen(path);
+	if (len + 1 > sizeof(su.sun_path)) {
+		fprintf(stderr, "path %s is too long\n", path);
+		return -1;
+	}
+
+	memcpy(su.sun_path, path, len + 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, PF_UNIX);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	socklen_t sulen = (char *)&su.sun_path[len + 1] - (char *)&su;
+	if (connect(fd, (struct sockaddr *)&su, sulen)) {
+		close(fd);
+		perror("connect");
+		return -1;
+	}
+
+	*pfd = fd;
+	return 0;
+}
+#endif
+
+static inline int connect_tcp(int *pfd, const char *host, const char *port)
+{
+	struct addrinfo *ai, *res;
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res)) {
+		perror("getaddrinfo");
+		return -1;
+	}
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		int fd = (int)socket(ai->ai_family, ai->ai_socktype,
+				     ai->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+#ifdef _WIN32
+			DWORD err = GetLastError();
+			closesocket(fd);
+			SetLastError(err);
+#else
+			int err = errno;
+			close(fd);
+			errno = err;
+#endif
+			continue;
+		}
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&one,
+			   sizeof(one));
+		*pfd = fd;
+		freeaddrinfo(res);
+		return 0;
+	}
+
+	freeaddrinfo(res);
+	perror("connect");
+	return -1;
+}
+
+static inline int do_connect(int *pfd, int argc, char **argv)
+{
+	switch (argc) {
+#ifndef _WIN32
+	case 2:
+		return connect_unix(pfd, argv[1]);
+#endif
+	case 3:
+		return connect_tcp(pfd, argv[1], argv[2]);
+	default:
+		return -1;
+	}
+}
+
+static inline uint64_t now_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER t, f;
+	QueryPerformanceCounter(&t);
+	QueryPerformanceFrequency(&f);
+	return (uint64_t)(t.QuadPart / f.QuadPart) * 1000000000 +
+	       (uint64_t)(t.QuadPart % f.QuadPart) * 1000000000 / f.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
@@ -1,8 +1,21 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include "vcan.h"
+#include "vcanz.h"
+#include "wheel.h"
+
+/*
+ * Busy poll mode (-b CPU[:IDLE_US]), not on Windows
+ *
+ * Pins the loop to CPU and polls epoll without sleeping so that a frame is
+ * picked up as soon as it lands rather than after a wakeup. Once nothing has
+ * arrived for IDLE_US the loop goes back to blocking until the next event.
+ */
+static int busy_poll;
+static uint64_t busy_idle_ns = 1000000;
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -19,6 +32,18 @@ static inline void perror(const char *msg)
 	fprintf(stderr, "%s: %.*s\n", msg, (int)sz, buf);
 }
 typedef SOCKET fd_t;
+#define sched_yield() SwitchToThread()
+#define getpid() GetCurrentProcessId()
+/* there is no SIGUSR1 to ask for the trace with */
+static int trace_dump;
+
+static uint64_t trace_now(void)
+{
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+}
 #else
 #include <sys/epoll.h>
 #include <sys/types.h>
@@ -29,20 +54,84 @@ typedef SOCKET fd_t;
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <net/if.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include "vcand_plugin.h"
 #define closesocket(FD) close(FD)
 typedef int fd_t;
 #define INVALID_SOCKET -1
-static const char *term_unlink_path;
+static const char *term_unlink_path, *term_unlink_seq;
+static volatile sig_atomic_t trace_dump;
+
+static void on_sigusr1(int sig)
+{
+	trace_dump = 1;
+}
+
+static uint64_t trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
 static void on_sigterm(int sig)
 {
 	if (term_unlink_path) {
 		unlink(term_unlink_path);
 	}
+	if (term_unlink_seq) {
+		unlink(term_unlink_seq);
+	}
 	_exit(0);
 }
 
-static int bind_unix(fd_t *pfd, const char *path)
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+static int set_busy_poll(int cpu, const char *idle)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		perror("sched_setaffinity");
+		return -1;
+	}
+	if (idle) {
+		busy_idle_ns = strtoull(idle, NULL, 10) * 1000;
+	}
+	busy_poll = 1;
+	return 0;
+}
+
+static void busy_poll_socket(int fd)
+{
+	static int warned;
+	int usec = 50;
+	int one = 1;
+	if ((setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) ||
+	     setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one,
+			sizeof(one))) &&
+	    !warned) {
+		/* raising either needs CAP_NET_ADMIN */
+		perror("vcand: socket busy polling");
+		warned = 1;
+	}
+}
+
+static int listen_unix(fd_t *pfd, const char *path, int type)
 {
 	struct sockaddr_un su;
 	memset(&su, 0, sizeof(su));
@@ -56,7 +145,7 @@ static int bind_unix(fd_t *pfd, const char *path)
 
 	memcpy(su.sun_path, path, len + 1);
 
-	fd_t fd = socket(AF_UNIX, SOCK_STREAM, PF_UNIX);
+	fd_t fd = socket(AF_UNIX, type, PF_UNIX);
 	if (fd < 0 || fcntl(fd, F_SETFL, O_NONBLOCK)) {
 		perror("socket");
 		return -1;
@@ -68,11 +157,121 @@ static int bind_unix(fd_t *pfd, const char *path)
 	}
 
 	*pfd = fd;
+	return 0;
+}
+
+static int bind_unix(fd_t *pfd, const char *path)
+{
+	if (listen_unix(pfd, path, SOCK_STREAM)) {
+		return -1;
+	}
 	term_unlink_path = path;
 	return 0;
 }
 #endif
 
+/*
+ * Tracing
+ *
+ * Build with -DVCAND_SDT to get USDT probes in the vcand provider, e.g.
+ *
+ *   bpftrace -e 'usdt:./vcand:vcand:send { @[arg1] = hist(nsecs - arg4); }'
+ *
+ * Each probe takes (remote id, a, b, monotonic ns). Probe arguments are only
+ * evaluated while a tracer has the probe semaphore set. Independently, -t N
+ * records every Nth received batch into a ring which SIGUSR1 dumps to stderr.
+ *
+ *   accept	remote, fd
+ *   recv	remote, bytes
+ *   frame	remote, can_id, record length
+ *   send	source remote, target remote, bytes
+ *   queue	remote, can_id, virtual time
+ *   backlog	remote, bytes waiting in its output queue
+ *   close	remote
+ */
+#if defined(VCAND_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define SDT_SEMAPHORE(name)                     \
+	unsigned short vcand_##name##_semaphore \
+		__attribute__((unused, section(".probes")))
+SDT_SEMAPHORE(accept);
+SDT_SEMAPHORE(recv);
+SDT_SEMAPHORE(frame);
+SDT_SEMAPHORE(send);
+SDT_SEMAPHORE(queue);
+SDT_SEMAPHORE(backlog);
+SDT_SEMAPHORE(close);
+#define SDT_ENABLED(name) __builtin_expect(vcand_##name##_semaphore, 0)
+#define SDT_PROBE(name, ...) STAP_PROBEV(vcand, name, __VA_ARGS__)
+#endif
+#endif
+
+#ifndef SDT_PROBE
+#define SDT_ENABLED(name) 0
+#define SDT_PROBE(name, ...) \
+	do {                 \
+	} while (0)
+#endif
+
+#define TRACE_IF(cond, name, id, a, b)                                   \
+	do {                                                             \
+		if ((cond) || SDT_ENABLED(name)) {                       \
+			uint64_t ns_ = trace_now();                      \
+			SDT_PROBE(name, (id), (uint64_t)(a), (uint64_t)(b), \
+				  ns_);                                  \
+			trace_record(#name, ns_, (id), (a), (b));        \
+		}                                                        \
+	} while (0)
+
+#define TRACE(name, id, a, b) TRACE_IF(trace_sampled, name, id, a, b)
+
+struct trace_entry {
+	uint64_t ns;
+	const char *ev;
+	unsigned id;
+	uint64_t a, b;
+};
+
+#define TRACE_RING 4096
+
+static unsigned trace_every;
+static unsigned trace_count;
+static int trace_sampled;
+static struct trace_entry *trace_ring;
+static unsigned trace_head;
+
+static void trace_record(const char *ev, uint64_t ns, unsigned id, uint64_t a,
+			 uint64_t b)
+{
+	if (trace_ring) {
+		struct trace_entry *t = &trace_ring[trace_head++ % TRACE_RING];
+		t->ns = ns;
+		t->ev = ev;
+		t->id = id;
+		t->a = a;
+		t->b = b;
+	}
+}
+
+static void trace_sample(void)
+{
+	trace_sampled = trace_every && ++trace_count % trace_every == 0;
+}
+
+static void dump_trace(void)
+{
+	unsigned n = trace_head < TRACE_RING ? trace_head : TRACE_RING;
+	for (unsigned i = trace_head - n; i != trace_head; i++) {
+		struct trace_entry *t = &trace_ring[i % TRACE_RING];
+		fprintf(stderr, "%llu %s %u %llu %llu\n",
+			(unsigned long long)t->ns, t->ev, t->id,
+			(unsigned long long)t->a, (unsigned long long)t->b);
+	}
+	fflush(stderr);
+}
+
 static int bind_tcp(fd_t *pfd, const char *host, const char *port)
 {
 	struct addrinfo *ai, *res;
@@ -113,6 +312,135 @@ static int bind_tcp(fd_t *pfd, const char *host, const char *port)
 	return -1;
 }
 
+static int lockstep;
+static int cache;
+static size_t hist_cap;
+#ifndef _WIN32
+static const char *mc_addr, *mc_port, *mc_ifname;
+
+/* Outgoing trunks (-p HOST PORT), redialed while they are down */
+#define MAX_LINKS 16
+
+struct trunk_link {
+	struct timer timer;
+	const char *host, *port;
+};
+
+static struct trunk_link links[MAX_LINKS];
+static int nlinks;
+static const char *handoff_path;
+static const char *seq_path;
+
+/* Plugins (-P PATH[:ARG]), loaded once the loop is set up */
+#define MAX_PLUGINS 32
+#define MAX_WORKERS 64
+
+static const char *plugin_paths[MAX_PLUGINS], *plugin_args[MAX_PLUGINS];
+static int nplugins;
+static int nworkers = 1;
+#endif
+
+/* Bytes read from a connection per pass of the loop (-q KIB), 0 unlimited */
+static int read_quota = 16 * 1024;
+
+/* Clients and thousands of frames of the in-memory benchmark (-B N[:K]) */
+static int loop_clients, loop_kframes = 10000;
+static uint64_t loop_bytes;
+
+static const char usage_options[] =
+	"  -l               lockstep virtual clock\n"
+	"  -c               cache the last frame of each id for late joiners\n"
+	"  -r KIB           keep KIB of frames for clients resuming a session\n"
+	"  -t N             trace every Nth batch, dumped on SIGUSR1\n"
+	"  -B N[:K]         route K thousand frames among N in-memory clients,\n"
+	"                   default 10000, print the rate and exit\n"
+	"  -q KIB           read KIB per connection per pass, default 16\n"
+#ifndef _WIN32
+	"  -b CPU[:IDLE_US] pin to CPU and busy poll until idle\n"
+	"  -m GROUP PORT    join the multicast bus on GROUP and PORT\n"
+	"  -i IFNAME        multicast interface\n"
+	"  -p HOST PORT     peer with the vcand at HOST and PORT\n"
+	"  -u PATH          hand over to a vcand later started with -u PATH\n"
+	"  -s PATH          also take SOCK_SEQPACKET clients on PATH\n"
+	"  -P PATH[:ARG]    load the plugin PATH, passing it ARG\n"
+	"  -W N             run worker plugins on N threads, default 1\n"
+#endif
+	;
+
+static int parse_options(int argc, char **argv)
+{
+	int i = 1;
+	while (i < argc && argv[i][0] == '-') {
+		const char *arg = argv[i++];
+		if (!strcmp(arg, "-l")) {
+			lockstep = 1;
+		} else if (!strcmp(arg, "-c")) {
+			cache = 1;
+		} else if (!strcmp(arg, "-r") && i < argc) {
+			hist_cap = (size_t)atoi(argv[i++]) * 1024;
+		} else if (!strcmp(arg, "-t") && i < argc) {
+			trace_every = atoi(argv[i++]);
+			if (trace_every) {
+				trace_ring = calloc(TRACE_RING,
+						    sizeof(*trace_ring));
+			}
+		} else if (!strcmp(arg, "-B") && i < argc) {
+			char *k = strchr(argv[i], ':');
+			loop_clients = atoi(argv[i++]);
+			if (k) {
+				loop_kframes = atoi(k + 1);
+			}
+		} else if (!strcmp(arg, "-q") && i < argc) {
+			read_quota = atoi(argv[i++]) * 1024;
+			if (read_quota < 0) {
+				return -1;
+			}
+#ifndef _WIN32
+		} else if (!strcmp(arg, "-b") && i < argc) {
+			char *idle = strchr(argv[i], ':');
+			if (set_busy_poll(atoi(argv[i++]), idle ? idle + 1 : NULL)) {
+				return -1;
+			}
+		} else if (!strcmp(arg, "-m") && i + 1 < argc) {
+			mc_addr = argv[i++];
+			mc_port = argv[i++];
+		} else if (!strcmp(arg, "-i") && i < argc) {
+			mc_ifname = argv[i++];
+		} else if (!strcmp(arg, "-p") && i + 1 < argc &&
+			   nlinks < MAX_LINKS) {
+			links[nlinks].host = argv[i++];
+			links[nlinks++].port = argv[i++];
+		} else if (!strcmp(arg, "-u") && i < argc) {
+			handoff_path = argv[i++];
+		} else if (!strcmp(arg, "-s") && i < argc) {
+			seq_path = argv[i++];
+		} else if (!strcmp(arg, "-P") && i < argc &&
+			   nplugins < MAX_PLUGINS) {
+			char *colon = strchr(argv[i], ':');
+			plugin_paths[nplugins] = argv[i++];
+			plugin_args[nplugins++] = colon ? colon + 1 : "";
+			if (colon) {
+				*colon = 0;
+			}
+		} else if (!strcmp(arg, "-W") && i < argc) {
+			nworkers = atoi(argv[i++]);
+			if (nworkers < 1 || nworkers > MAX_WORKERS) {
+				return -1;
+			}
+#endif
+		} else {
+			return -1;
+		}
+	}
+#ifndef _WIN32
+	if ((mc_addr || nlinks) && lockstep) {
+		/* the virtual clock cannot span hosts */
+		return -1;
+	}
+#endif
+	return i - 1;
+}
+
 static int do_bind(fd_t *pfd, int argc, char **argv)
 {
 	switch (argc) {
@@ -127,34 +455,169 @@ static int do_bind(fd_t *pfd, int argc, char **argv)
 	}
 }
 
+struct zlink {
+	int flags;
+	struct vz_table tx, rx;
+	char *in;
+	int in_sz, in_cap;
+#ifdef VCAN_ZLIB
+	z_stream deflate, inflate;
+#endif
+};
+
+/* Something the back end reports, with IO_IN and IO_OUT for what it is
+ * ready for */
+struct source {
+	void (*ready)(struct source *s, int events);
+};
+
+/* A listening socket, whose connections take seqpacket */
+struct listener {
+	struct source src;
+	fd_t fd;
+	int seqpacket;
+};
+
 struct remote {
+	/* first, as connections are reported as their source */
+	struct source src;
 	struct remote *next, *prev;
 	fd_t fd;
+	unsigned id;
 	int sz;
+	int joined, waiting;
+	uint32_t node;
+	uint64_t vtime, barrier;
+	int nfilter;
+	struct vcan_filter *filter;
+	struct tx_job *jobs;
+	struct rx_filter **rx;
+	int rx_num, rx_cap;
+	struct rate_rule *rates;
+	struct rate_slot **rate_slots;
+	int rate_num, rate_cap;
+	struct session *session;
+	int replaying;
+	struct plugin *plugin;
+	struct remote *ready_next;
+	int ready;
+	int seqpacket;
+	int tap;
+	int loop, loop_room;
+	/* hands whole records to the connection, write_output unless it is
+	 * compressed, a plugin or the multicast bus */
+	int (*send)(struct remote *t, const char *buf, int n);
+	/* writes queued bytes out, returning how many were taken */
+	int (*write)(struct remote *t, const char *buf, int n);
+	struct zlink *z;
+	struct trunk *trunk;
+	char *out;
+	int out_sz, out_cap;
 #ifdef _WIN32
-	OVERLAPPED ol;
+	struct io_conn *io;
 #endif
-	char buf[1024];
+	char *buf;
+	int cap;
 };
 
+/* clients further behind than this are dropped */
+#define MAX_QUEUE (1 << 20)
+
+/* input buffers start at this and grow to fit the records that arrive */
+#define INPUT_BUF 1024
+
 static struct remote *remotes;
 static struct remote *free_list;
+static unsigned next_id;
+static uint32_t daemon_id;
+static int ntrunks, interest_dirty;
+static int ntaps;
+
+#ifndef _WIN32
+static struct remote *mc_remote;
+static int mc_send(struct remote *t, const char *buf, int n);
+static int plugin_recv(struct remote *t, const char *buf, int n);
+static void plugin_member(struct remote *r, int joined);
+#endif
+
+static void ready_remove(struct remote *r);
+static void conn_ready(struct source *s, int events);
+static int write_output(struct remote *t, const char *buf, int n);
+static int sock_send(struct remote *t, const char *buf, int n);
+static void io_close(struct remote *r);
 
 static struct remote *new_remote(fd_t fd)
 {
 	struct remote *r = malloc(sizeof(*r));
+	r->src.ready = &conn_ready;
 	r->fd = fd;
+	r->id = ++next_id;
 	r->sz = 0;
+	r->cap = INPUT_BUF;
+	r->buf = malloc(r->cap);
+	r->joined = 0;
+	r->waiting = 0;
+	r->nfilter = 0;
+	r->filter = NULL;
+	r->jobs = NULL;
+	r->rx = NULL;
+	r->rx_num = 0;
+	r->rx_cap = 0;
+	r->rates = NULL;
+	r->rate_slots = NULL;
+	r->rate_num = 0;
+	r->rate_cap = 0;
+	r->session = NULL;
+	r->replaying = 0;
+	r->plugin = NULL;
+	r->ready_next = NULL;
+	r->ready = 0;
+	r->seqpacket = 0;
+	r->tap = 0;
+	r->loop = 0;
+	r->loop_room = 0;
+	r->send = &write_output;
+	r->write = &sock_send;
+	r->z = NULL;
+	r->trunk = NULL;
+	r->out = NULL;
+	r->out_sz = 0;
+	r->out_cap = 0;
 	r->next = NULL;
 	r->prev = NULL;
 #ifdef _WIN32
-	memset(&r->ol, 0, sizeof(r->ol));
+	r->io = NULL;
 #endif
 	return r;
 }
 
+static void input_room(struct remote *r, int n)
+{
+	if (n > r->cap) {
+		r->cap = n;
+		r->buf = realloc(r->buf, n);
+	}
+}
+
+/* Grows the input buffer to fit the record at its start, with room to spare
+ * for the next, so that a stream of large frames is still read in batches */
+static void fit_record(struct remote *r)
+{
+	if (r->sz >= 2) {
+		uint16_t len;
+		memcpy(&len, r->buf, 2);
+		input_room(r, 2 * (2 + (len & VCAN_LEN_MASK)));
+	}
+}
+
 static void add_remote(struct remote *r)
 {
+#ifndef _WIN32
+	if (nplugins) {
+		plugin_member(r, 1);
+	}
+#endif
+	interest_dirty = 1;
 	if (remotes) {
 		r->next = remotes;
 		r->prev = remotes->prev;
@@ -167,8 +630,40 @@ static void add_remote(struct remote *r)
 	}
 }
 
+static void stop_jobs(struct remote *r);
+static void free_jobs(struct remote *r);
+static void stop_rx(struct remote *r);
+static void free_rx(struct remote *r);
+static void stop_rates(struct remote *r);
+static void free_rates(struct remote *r);
+static void trunk_closed(struct remote *r);
+static void free_trunk(struct remote *r);
+static void session_detach(struct remote *r);
+
 static void close_remote(struct remote *r)
 {
+	TRACE_IF(trace_every, close, r->id, 0, 0);
+	stop_jobs(r);
+	stop_rx(r);
+	stop_rates(r);
+	if (r->session) {
+		session_detach(r);
+	}
+	if (r->tap) {
+		ntaps--;
+	}
+#ifndef _WIN32
+	if (nplugins) {
+		plugin_member(r, 0);
+	}
+#endif
+	if (r->trunk) {
+		trunk_closed(r);
+	}
+	if (r->ready) {
+		ready_remove(r);
+	}
+	interest_dirty = 1;
 	if (r->next == r) {
 		remotes = NULL;
 	} else {
@@ -187,13 +682,91 @@ static void free_remotes(void)
 {
 	for (struct remote *r = free_list; r != NULL;) {
 		struct remote *n = r->next;
-		closesocket(r->fd);
+		io_close(r);
+		if (r->z) {
+#ifdef VCAN_ZLIB
+			if (r->z->flags & VCAN_COMPRESS_DEFLATE) {
+				deflateEnd(&r->z->deflate);
+				inflateEnd(&r->z->inflate);
+			}
+#endif
+			free(r->z->in);
+			free(r->z);
+		}
+		free_jobs(r);
+		free_rx(r);
+		free_rates(r);
+		free_trunk(r);
+		free(r->filter);
+		free(r->out);
+		free(r->buf);
 		free(r);
 		r = n;
 	}
 	free_list = NULL;
 }
 
+static canid_t record_id(const char *p, uint16_t len)
+{
+	canid_t id = 0;
+	if (len >= sizeof(id)) {
+		memcpy(&id, p + 2, sizeof(id));
+	}
+	return id;
+}
+
+/* Returns the id the frame of len bytes at f is told apart by. XL
+ * priorities are kept apart from SFF ids under the EFF error frame ids,
+ * which are never cached or filtered on. */
+static canid_t frame_key(const char *f, uint16_t len)
+{
+	canid_t id = 0;
+	if (len >= sizeof(id)) {
+		memcpy(&id, f, sizeof(id));
+	}
+	if (vcan_is_xl(f, len)) {
+		id |= CAN_EFF_FLAG | CAN_ERR_FLAG;
+	}
+	return id;
+}
+
+/* Returns the payload of the frame of len bytes at f with its length in
+ * *dlen, clipped to the record */
+static const uint8_t *frame_data(const char *f, uint16_t len, int *dlen)
+{
+	const uint8_t *u = (const uint8_t *)f;
+	int off, n;
+	if (vcan_is_xl(f, len)) {
+		uint16_t xlen;
+		memcpy(&xlen, f + offsetof(struct canxl_frame, len), 2);
+		off = CANXL_HDR_SIZE;
+		n = xlen;
+	} else if (len >= offsetof(struct canfd_frame, data)) {
+		off = offsetof(struct canfd_frame, data);
+		n = u[offsetof(struct canfd_frame, len)];
+	} else {
+		off = len;
+		n = 0;
+	}
+	*dlen = n < len - off ? n : len - off;
+	return u + off;
+}
+
+/* Checks that buf holds whole frame records and nothing else */
+static int valid_records(const char *buf, int n)
+{
+	int off = 0;
+	while (off + 2 <= n) {
+		uint16_t len;
+		memcpy(&len, buf + off, 2);
+		if ((len & VCAN_CTRL) || off + 2 + len > n) {
+			break;
+		}
+		off += 2 + len;
+	}
+	return off == n;
+}
+
 static int frame_bytes(struct remote *b)
 {
 	char *p = b->buf;
@@ -201,256 +774,4741 @@ static int frame_bytes(struct remote *b)
 	while (p + 2 <= e) {
 		uint16_t len;
 		memcpy(&len, p, 2);
+		len &= VCAN_LEN_MASK;
 		if (p + 2 + len > e) {
 			break;
 		}
+		TRACE(frame, b->id, record_id(p, len), len);
 		p += 2 + len;
 	}
 	return p - b->buf;
 }
 
-static int nonblock_send(struct remote *t, char *buf, int n);
-
-static void distribute_data(struct remote *r)
+static int queue_output(struct remote *t, const char *buf, int n)
 {
-	int n = frame_bytes(r);
-	if (!n) {
-		return;
+	if (t->out_sz + n > MAX_QUEUE) {
+		return -1;
+	} else if (t->out_sz + n > t->out_cap) {
+		t->out_cap = 2 * (t->out_sz + n);
+		t->out = realloc(t->out, t->out_cap);
 	}
+	memcpy(t->out + t->out_sz, buf, n);
+	t->out_sz += n;
+	TRACE(backlog, t->id, t->out_sz, 0);
+	return 0;
+}
 
-	for (struct remote *t = r->next; t != r;) {
-		struct remote *next = t->next;
-		if (nonblock_send(t, r->buf, n)) {
-			close_remote(t);
+static int write_output(struct remote *t, const char *buf, int n)
+{
+	int sent = 0;
+	if (!t->out_sz) {
+		sent = t->write(t, buf, n);
+		if (sent < 0) {
+			return -1;
 		}
-		t = next;
 	}
+	return sent < n ? queue_output(t, buf + sent, n - sent) : 0;
+}
 
-	if (n < r->sz) {
-		memmove(r->buf, r->buf + n, r->sz - n);
+static int flush_output(struct remote *t)
+{
+	if (!t->out_sz) {
+		return 0;
 	}
-	r->sz -= n;
+	int sent = t->write(t, t->out, t->out_sz);
+	if (sent < 0) {
+		return -1;
+	}
+	memmove(t->out, t->out + sent, t->out_sz - sent);
+	t->out_sz -= sent;
+	return 0;
 }
 
-#ifdef _WIN32
+struct scratch {
+	char *p;
+	int cap;
+};
 
-static int nonblock_send(struct remote *t, char *buf, int n)
+static char *reserve(struct scratch *s, int n)
 {
-	DWORD written;
-	OVERLAPPED ol;
-	memset(&ol, 0, sizeof(ol));
-	return !WriteFile((HANDLE)t->fd, buf, n, &written, &ol) || written != n;
+	if (n > s->cap) {
+		s->cap = 2 * n;
+		s->p = realloc(s->p, s->cap);
+	}
+	return s->p;
 }
 
-static void read_more(struct remote *r)
+static struct scratch zscratch;
+
+static int z_send(struct remote *t, const char *buf, int n)
 {
-	DWORD read;
-	while (ReadFile((HANDLE)r->fd, r->buf + r->sz, sizeof(r->buf) - r->sz,
-			&read, &r->ol)) {
-		r->sz += read;
-		distribute_data(r);
-	}
-	if (GetLastError() != ERROR_IO_PENDING) {
-		perror("read file");
-		close_remote(r);
+	char *zbuf = reserve(&zscratch, 2 * VZ_BOUND(n) + 64);
+	int zn = vz_encode(&t->z->tx, buf, n, zbuf);
+#ifdef VCAN_ZLIB
+	if (t->z->flags & VCAN_COMPRESS_DEFLATE) {
+		char *dbuf = zbuf + VZ_BOUND(n);
+		zn = vz_deflate(&t->z->deflate, zbuf, zn, dbuf,
+				VZ_BOUND(n) + 64);
+		if (zn < 0) {
+			return -1;
+		}
+		zbuf = dbuf;
 	}
+#endif
+	return write_output(t, zbuf, zn);
 }
 
-static struct remote *accept_more(HANDLE iocp, LPFN_ACCEPTEX acceptex,
-				  SOCKET lfd)
+static int nonblock_send(struct remote *t, char *buf, int n)
 {
-	for (;;) {
-		SOCKET cfd = WSASocket(AF_INET6, SOCK_STREAM, IPPROTO_TCP, NULL,
-				       0, WSA_FLAG_OVERLAPPED);
+	return t->send(t, buf, n);
+}
 
-		struct remote *r = new_remote(cfd);
-		if (CreateIoCompletionPort((HANDLE)cfd, iocp, (ULONG_PTR)r,
-					   0) == NULL) {
-			perror("add to iocp");
-		}
-		if (!SetFileCompletionNotificationModes(
-			    (HANDLE)cfd,
-			    FILE_SKIP_COMPLETION_PORT_ON_SUCCESS)) {
-			perror("set skip on success");
-		}
+static void send_ctrl(struct remote *t, const void *msg, uint16_t n)
+{
+	char buf[64];
+	uint16_t len = VCAN_CTRL | n;
+	memcpy(buf, &len, 2);
+	memcpy(buf + 2, msg, n);
+	if (nonblock_send(t, buf, 2 + n)) {
+		close_remote(t);
+	}
+}
 
-		DWORD addrsz;
-		BOOL ret = acceptex(lfd, cfd, r->buf, 0,
-				    16 + sizeof(struct sockaddr_in6),
-				    16 + sizeof(struct sockaddr_in6), &addrsz,
-				    &r->ol);
-		if (ret) {
-			add_remote(r);
-			read_more(r);
-			continue;
-		} else if (WSAGetLastError() == WSA_IO_PENDING) {
-			return r;
-		} else {
-			perror("acceptex");
-			exit(1);
+static int wants(const struct remote *t, canid_t id)
+{
+	if (!t->nfilter) {
+		return 1;
+	}
+	for (int i = 0; i < t->nfilter; i++) {
+		if (!((id ^ t->filter[i].id) & t->filter[i].mask)) {
+			return 1;
 		}
 	}
+	return 0;
 }
 
-int main(int argc, char *argv[])
+static int rx_changed(struct remote *t, const char *p, uint16_t len);
+static int rate_hold(struct remote *t, const char *p, uint16_t len);
+
+/* Returns whether the record at p is to be delivered to t now */
+static int delivers(struct remote *t, const char *p, uint16_t len)
 {
-	WSADATA wsa;
-	WSAStartup(MAKEWORD(2, 2), &wsa);
+	return !t->tap && wants(t, record_id(p, len)) &&
+	       (!t->rx_num || rx_changed(t, p, len)) &&
+	       (!t->rates || !rate_hold(t, p, len));
+}
 
-	SOCKET fd;
-	if (do_bind(&fd, argc, argv)) {
-		fputs("usage ./vcand host tcp-port\n", stderr);
-		return 2;
+static struct scratch fscratch;
+
+/* Sends the records in buf that t subscribed to */
+static int send_filtered(struct remote *t, char *buf, int n)
+{
+	if (t->replaying || t->tap) {
+		/* the replay picks these up from the history, and taps get
+		 * them all in VCAN_TAP */
+		return 0;
+	} else if (!t->nfilter && !t->rx_num && !t->rates) {
+		return nonblock_send(t, buf, n);
 	}
 
-	HANDLE iocp = CreateIoCompletionPort((HANDLE)fd, NULL, 0, 1);
-	if (iocp == INVALID_HANDLE_VALUE) {
-		perror("CreateIoCompletionPort");
-		return 1;
+	char *out = reserve(&fscratch, n);
+	char *p = buf;
+	char *e = buf + n;
+	int sz = 0;
+	while (p < e) {
+		uint16_t len;
+		memcpy(&len, p, 2);
+		if (delivers(t, p, len)) {
+			memcpy(out + sz, p, 2 + len);
+			sz += 2 + len;
+		}
+		p += 2 + len;
 	}
+	return sz ? nonblock_send(t, out, sz) : 0;
+}
 
-	DWORD dwBytes;
-	GUID GuidAcceptEx = WSAID_ACCEPTEX;
-	LPFN_ACCEPTEX lpfnAcceptEx;
-	int res = WSAIoctl(fd, SIO_GET_EXTENSION_FUNCTION_POINTER,
-			   &GuidAcceptEx, sizeof(GuidAcceptEx), &lpfnAcceptEx,
-			   sizeof(lpfnAcceptEx), &dwBytes, NULL, NULL);
-	if (res == SOCKET_ERROR) {
-		perror("get acceptex");
-		return 1;
+/*
+ * Last value cache (-c)
+ *
+ * Keeps the last data frame seen for each CAN id so that clients can be
+ * brought up to date without waiting for the next cycle. SFF ids index a
+ * dense table and EFF ids go in an open addressed hash.
+ */
+struct last_value {
+	canid_t id; /* cache key */
+	uint16_t len;
+	uint16_t cap;
+	char rec[];
+};
+
+static struct last_value *lv_sff[CAN_SFF_MASK + 1];
+static struct last_value **lv_eff;
+static int lv_eff_num, lv_eff_cap;
+
+static struct last_value **lv_eff_slot(canid_t id)
+{
+	uint32_t h = id * 2654435761U;
+	for (uint32_t i = 0;; i++) {
+		struct last_value **v = &lv_eff[(h + i) & (lv_eff_cap - 1)];
+		if (!*v || (*v)->id == id) {
+			return v;
+		}
+	}
+}
+
+static struct last_value **lv_slot(canid_t id)
+{
+	if (!(id & CAN_EFF_FLAG)) {
+		return &lv_sff[id & CAN_SFF_MASK];
 	}
 
-	struct remote *next = accept_more(iocp, lpfnAcceptEx, fd);
-
-	OVERLAPPED_ENTRY ev[16];
-	DWORD num;
-	while (GetQueuedCompletionStatusEx(iocp, ev, sizeof(ev) / sizeof(ev[0]),
-					   &num, INFINITE, TRUE)) {
-		for (int i = 0; i < num; i++) {
-			struct remote *r = (void *)ev[i].lpCompletionKey;
-			if (!r) {
-				add_remote(next);
-				read_more(next);
-				next = accept_more(iocp, lpfnAcceptEx, fd);
-			} else if (r->prev) {
-				DWORD rcvd;
-				if (GetOverlappedResult((HANDLE)r->fd, &r->ol,
-							&rcvd, FALSE)) {
-					r->sz += rcvd;
-					distribute_data(r);
-					read_more(r);
-				} else {
-					close_remote(r);
-				}
+	if (2 * (lv_eff_num + 1) > lv_eff_cap) {
+		struct last_value **old = lv_eff;
+		int oldcap = lv_eff_cap;
+		lv_eff_cap = oldcap ? 2 * oldcap : 1024;
+		lv_eff = calloc(lv_eff_cap, sizeof(*lv_eff));
+		for (int i = 0; i < oldcap; i++) {
+			if (old[i]) {
+				*lv_eff_slot(old[i]->id) = old[i];
 			}
 		}
+		free(old);
+	}
 
-		free_remotes();
+	struct last_value **v = lv_eff_slot(id);
+	if (!*v) {
+		lv_eff_num++;
 	}
-	return 1;
+	return v;
 }
-#else
-static int nonblock_send(struct remote *t, char *buf, int n)
+
+static void cache_frames(char *p, int n)
 {
-	int r;
-	do {
-		r = send(t->fd, buf, n, MSG_NOSIGNAL);
-	} while (r < 0 && errno == EINTR);
-	return r != n;
+	char *e = p + n;
+	while (p < e) {
+		uint16_t len;
+		memcpy(&len, p, 2);
+		canid_t id = record_id(p, len);
+		if (len >= sizeof(id) && !(id & (CAN_RTR_FLAG | CAN_ERR_FLAG))) {
+			id = frame_key(p + 2, len);
+			struct last_value **pv = lv_slot(id);
+			struct last_value *v = *pv;
+			if (!v || v->cap < 2 + len) {
+				v = realloc(v, sizeof(*v) + 2 + len);
+				v->cap = 2 + len;
+				*pv = v;
+			}
+			v->id = id;
+			v->len = 2 + len;
+			memcpy(v->rec, p, 2 + len);
+		}
+		p += 2 + len;
+	}
 }
-static void read_more(struct remote *r)
+
+static void append_value(struct scratch *s, int *sz, struct remote *t,
+			 struct last_value *v)
 {
-	int sz;
-	for (;;) {
-		int n = recv(r->fd, r->buf + r->sz, sizeof(r->buf) - r->sz,
-			     MSG_NOSIGNAL);
-		if (n < 0 && errno == EINTR) {
-			continue;
-		} else if (n < 0 && errno == EAGAIN) {
-			break;
-		} else if (n < 0) {
-			perror("recv");
-			close_remote(r);
-			return;
-		} else if (!n) {
-			close_remote(r);
-			return;
-		}
-		r->sz += n;
-		distribute_data(r);
+	if (v && delivers(t, v->rec, v->len - 2)) {
+		char *p = reserve(s, *sz + v->len);
+		memcpy(p + *sz, v->rec, v->len);
+		*sz += v->len;
 	}
 }
 
-static void accept_more(int efd, int lfd)
+/* Sends the cached frames t is subscribed to followed by VCAN_SNAPSHOT */
+static void send_snapshot(struct remote *t)
 {
+	static struct scratch snap;
+	int sz = 0;
+	for (int i = 0; i <= CAN_SFF_MASK; i++) {
+		append_value(&snap, &sz, t, lv_sff[i]);
+	}
+	for (int i = 0; i < lv_eff_cap; i++) {
+		append_value(&snap, &sz, t, lv_eff[i]);
+	}
+	if (sz && nonblock_send(t, snap.p, sz)) {
+		close_remote(t);
+		return;
+	}
+
+	struct vcan_snapshot done;
+	memset(&done, 0, sizeof(done));
+	done.type = VCAN_SNAPSHOT;
+	send_ctrl(t, &done, sizeof(done));
+}
+
+static void subscribe(struct remote *r, char *p, int n)
+{
+	struct vcan_subscribe sub;
+	if (n < sizeof(sub)) {
+		return;
+	}
+	memcpy(&sub, p, sizeof(sub));
+	if (n < sizeof(sub) + sub.count * sizeof(struct vcan_filter)) {
+		return;
+	}
+
+	r->nfilter = sub.count;
+	r->filter = realloc(r->filter, sub.count * sizeof(*r->filter));
+	memcpy(r->filter, p + sizeof(sub), sub.count * sizeof(*r->filter));
+	interest_dirty = 1;
+
+	if (cache && (sub.flags & VCAN_SUB_SNAPSHOT)) {
+		send_snapshot(r);
+	}
+}
+
+struct pending {
+	uint64_t time;
+	uint32_t key;
+	uint32_t node;
+	uint32_t seq;
+	unsigned from;
+	int off, len;
+};
+
+static uint64_t vclock;
+static struct pending *pending;
+static int pending_num, pending_cap;
+static char *pending_buf;
+static int pending_sz, pending_bufcap;
+static uint32_t pending_seq;
+
+/* CAN arbitration order: base id, then SFF before EFF, then extended bits */
+static uint32_t arb_key(canid_t id)
+{
+	if (id & CAN_EFF_FLAG) {
+		id &= CAN_EFF_MASK;
+		return ((id >> 18) << 19) | (1U << 18) | (id & 0x3FFFF);
+	}
+	return (id & CAN_SFF_MASK) << 19;
+}
+
+static void queue_frames(struct remote *r, char *p, int n, uint64_t time)
+{
+	if (pending_sz + n > pending_bufcap) {
+		pending_bufcap = 2 * (pending_sz + n);
+		pending_buf = realloc(pending_buf, pending_bufcap);
+	}
+
+	char *e = p + n;
+	while (p < e) {
+		uint16_t len;
+		memcpy(&len, p, 2);
+		canid_t id = record_id(p, len);
+
+		if (pending_num == pending_cap) {
+			pending_cap = pending_cap ? 2 * pending_cap : 64;
+			pending = realloc(pending, pending_cap * sizeof(*pending));
+		}
+		struct pending *q = &pending[pending_num++];
+		q->time = time;
+		TRACE(queue, r->id, id, q->time);
+		q->key = arb_key(id);
+		q->node = r->joined ? r->node : UINT32_MAX;
+		q->seq = pending_seq++;
+		q->from = r->id;
+		q->off = pending_sz;
+		q->len = 2 + len;
+		memcpy(pending_buf + pending_sz, p, 2 + len);
+		pending_sz += 2 + len;
+		p += 2 + len;
+	}
+}
+
+static void history_append(unsigned from, const char *p, int n);
+static void tap_frames(unsigned from, const char *p, int n, uint64_t ns);
+
+static int cmp_pending(const void *a, const void *b)
+{
+	const struct pending *x = a;
+	const struct pending *y = b;
+	if (x->time != y->time) {
+		return x->time < y->time ? -1 : 1;
+	} else if (x->key != y->key) {
+		return x->key < y->key ? -1 : 1;
+	} else if (x->node != y->node) {
+		return x->node < y->node ? -1 : 1;
+	} else {
+		return (int32_t)(x->seq - y->seq) < 0 ? -1 : 1;
+	}
+}
+
+static void release_frames(uint64_t until)
+{
+	qsort(pending, pending_num, sizeof(*pending), &cmp_pending);
+	int n = 0;
+	while (n < pending_num && pending[n].time <= until) {
+		n++;
+	}
+	if (!n) {
+		return;
+	}
+
+	char *buf = malloc(pending_bufcap);
+
+	for (int i = 0; i < n; i++) {
+		char *rec = pending_buf + pending[i].off;
+		if (cache) {
+			cache_frames(rec, pending[i].len);
+		}
+		history_append(pending[i].from, rec, pending[i].len);
+		tap_frames(pending[i].from, rec, pending[i].len,
+			   pending[i].time);
+	}
+
+	for (struct remote *t = remotes, *last = t ? t->prev : NULL; t;) {
+		struct remote *next = t->next;
+		int done = t == last;
+		int sz = 0;
+		for (int i = 0; i < n && !t->replaying; i++) {
+			struct pending *q = &pending[i];
+			char *rec = pending_buf + q->off;
+			if (q->from != t->id && delivers(t, rec, q->len - 2)) {
+				memcpy(buf + sz, pending_buf + q->off, q->len);
+				sz += q->len;
+			}
+		}
+		if (!sz) {
+			t = done ? NULL : next;
+			continue;
+		}
+		TRACE(send, 0, t->id, sz);
+		if (nonblock_send(t, buf, sz)) {
+			close_remote(t);
+		}
+		t = done ? NULL : next;
+	}
+
+	int sz = 0;
+	for (int i = n; i < pending_num; i++) {
+		struct pending *q = &pending[i];
+		memcpy(buf + sz, pending_buf + q->off, q->len);
+		q->off = sz;
+		sz += q->len;
+		pending[i - n] = *q;
+	}
+	free(pending_buf);
+	pending_buf = buf;
+	pending_sz = sz;
+	pending_num -= n;
+}
+
+static void run_timers(void);
+
+static void lockstep_step(void)
+{
+	int joined = 0;
+	uint64_t until = UINT64_MAX;
+	for (struct remote *t = remotes, *last = t ? t->prev : NULL; t;) {
+		if (t->joined && !t->waiting) {
+			return;
+		} else if (t->joined) {
+			joined++;
+			if (t->barrier < until) {
+				until = t->barrier;
+			}
+		}
+		t = (t == last) ? NULL : t->next;
+	}
+
+	if (!joined) {
+		/* nobody is driving the clock, release in order as we go */
+		release_frames(UINT64_MAX);
+		return;
+	}
+
+	vclock = until;
+	run_timers();
+	release_frames(vclock);
+
+	struct vcan_time tick;
+	memset(&tick, 0, sizeof(tick));
+	tick.type = VCAN_TICK;
+	tick.ns = vclock;
+
+	for (struct remote *t = remotes, *last = t ? t->prev : NULL; t;) {
+		struct remote *next = t->next;
+		int done = t == last;
+		if (t->joined) {
+			if (t->barrier <= vclock) {
+				t->waiting = 0;
+				t->vtime = vclock;
+			}
+			send_ctrl(t, &tick, sizeof(tick));
+		}
+		t = done ? NULL : next;
+	}
+}
+
+static void start_compression(struct remote *r, char *p, int n)
+{
+	struct vcan_compress req;
+	if (n < sizeof(req) || r->z) {
+		return;
+	}
+	memcpy(&req, p, sizeof(req));
+
+	int flags = req.flags & VCAN_COMPRESS_DELTA;
+	if (r->plugin || r->seqpacket) {
+		/* records to and from plugins are never on the wire, and
+		 * datagrams are not a stream to code */
+		flags = 0;
+	}
+	struct zlink *z = NULL;
+	if (flags) {
+		z = calloc(1, sizeof(*z));
+#ifdef VCAN_ZLIB
+		if ((req.flags & VCAN_COMPRESS_DEFLATE) &&
+		    deflateInit(&z->deflate, Z_DEFAULT_COMPRESSION) == Z_OK) {
+			if (inflateInit(&z->inflate) == Z_OK) {
+				flags |= VCAN_COMPRESS_DEFLATE;
+			} else {
+				deflateEnd(&z->deflate);
+			}
+		}
+#endif
+		z->flags = flags;
+	}
+
+	struct vcan_compress reply;
+	memset(&reply, 0, sizeof(reply));
+	reply.type = VCAN_COMPRESS;
+	reply.flags = flags;
+	send_ctrl(r, &reply, sizeof(reply));
+	r->z = z;
+	if (z) {
+		r->send = &z_send;
+	}
+}
+
+static void trunk_append(const char *buf, int n);
+
+static void forward_frames(struct remote *r, char *buf, int n)
+{
+	if (!n || r->trunk) {
+		/* peers only send frames in VCAN_TRUNK, anything else is the
+		 * snapshot sent on accept */
+		return;
+	} else if (lockstep) {
+		uint64_t time = vclock;
+		if (r->joined && r->vtime > vclock) {
+			time = r->vtime;
+		}
+		queue_frames(r, buf, n, time);
+		return;
+	} else if (cache) {
+		cache_frames(buf, n);
+	}
+	history_append(r->id, buf, n);
+	tap_frames(r->id, buf, n, trace_now());
+
+	for (struct remote *t = r->next; t != r;) {
+		struct remote *next = t->next;
+		if (!t->trunk) {
+			TRACE(send, r->id, t->id, n);
+			if (send_filtered(t, buf, n)) {
+				close_remote(t);
+			}
+		}
+		t = next;
+	}
+
+	if (ntrunks) {
+		trunk_append(buf, n);
+	}
+}
+
+/*
+ * Cyclic transmission (VCAN_TX_SETUP)
+ *
+ * Jobs belong to the connection that set them up and send as if from it.
+ * They all share one wheel ticking every TICK_NS. The wheel is driven by a
+ * timerfd armed for the next tick with work, or by the virtual clock in
+ * lockstep mode.
+ */
+#define TICK_NS 1000000
+
+struct tx_job {
+	struct timer timer;
+	struct tx_job *next;
+	struct remote *owner;
+	canid_t id;
+	int flags;
+	uint32_t count;
+	uint64_t ival1, ival2;
+	uint16_t len;
+	char rec[2 + CANXL_MTU];
+};
+
+static struct wheel wheel;
+
+static uint64_t wheel_clock(void)
+{
+	return (lockstep ? vclock : trace_now()) / TICK_NS;
+}
+
+static uint64_t ns_to_ticks(uint64_t ns)
+{
+	return (ns + TICK_NS - 1) / TICK_NS;
+}
+
+static void run_timers(void)
+{
+	wheel_advance(&wheel, wheel_clock());
+}
+
+static void tx_emit(struct tx_job *j, uint64_t ns)
+{
+	if (lockstep) {
+		queue_frames(j->owner, j->rec, j->len, ns);
+	} else {
+		forward_frames(j->owner, j->rec, j->len);
+	}
+}
+
+static void tx_fire(struct wheel *w, struct timer *t)
+{
+	struct tx_job *j = (struct tx_job *)t;
+	tx_emit(j, t->expires * TICK_NS);
+
+	int expired = j->count && !--j->count &&
+		      (j->flags & VCAN_TX_COUNTEVT);
+	uint64_t ival = j->count ? j->ival1 : j->ival2;
+	if (ival) {
+		timer_start(w, t, t->expires + ival);
+	}
+
+	if (expired) {
+		struct vcan_tx_id ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.type = VCAN_TX_EXPIRED;
+		ev.can_id = j->id;
+		send_ctrl(j->owner, &ev, sizeof(ev));
+	}
+}
+
+static void stop_jobs(struct remote *r)
+{
+	for (struct tx_job *j = r->jobs; j != NULL; j = j->next) {
+		timer_stop(&wheel, &j->timer);
+	}
+}
+
+static void free_jobs(struct remote *r)
+{
+	while (r->jobs) {
+		struct tx_job *j = r->jobs;
+		r->jobs = j->next;
+		free(j);
+	}
+}
+
+static void tx_setup(struct remote *r, char *p, int n)
+{
+	struct vcan_tx_setup s;
+	if (n < sizeof(s)) {
+		return;
+	}
+	memcpy(&s, p, sizeof(s));
+	uint16_t len = n - sizeof(s);
+	if (len != CAN_MTU && len != CANFD_MTU &&
+	    !(vcan_is_xl(p + sizeof(s), len) && len <= CANXL_MTU)) {
+		return;
+	}
+	canid_t id;
+	memcpy(&id, p + sizeof(s), sizeof(id));
+
+	struct tx_job *j = r->jobs;
+	while (j && j->id != id) {
+		j = j->next;
+	}
+	if (!j) {
+		j = calloc(1, sizeof(*j));
+		j->timer.fn = &tx_fire;
+		j->owner = r;
+		j->id = id;
+		j->next = r->jobs;
+		r->jobs = j;
+	}
+
+	/* without VCAN_TX_SETTIMER this only updates the data in place */
+	j->len = 2 + len;
+	memcpy(j->rec, &len, 2);
+	memcpy(j->rec + 2, p + sizeof(s), len);
+
+	if (s.flags & VCAN_TX_SETTIMER) {
+		j->flags = s.flags;
+		j->count = s.count;
+		j->ival1 = ns_to_ticks(s.ival1_ns);
+		j->ival2 = ns_to_ticks(s.ival2_ns);
+	}
+
+	if (!wheel.count) {
+		wheel.now = wheel_clock();
+	}
+
+	if (s.flags & VCAN_TX_ANNOUNCE) {
+		tx_emit(j, vclock);
+	}
+
+	if (s.flags & VCAN_TX_STARTTIMER) {
+		uint64_t ival = j->count ? j->ival1 : j->ival2;
+		if (ival) {
+			timer_start(&wheel, &j->timer, wheel.now + ival);
+		} else {
+			timer_stop(&wheel, &j->timer);
+		}
+	}
+}
+
+static void tx_delete(struct remote *r, char *p, int n)
+{
+	struct vcan_tx_id del;
+	if (n < sizeof(del)) {
+		return;
+	}
+	memcpy(&del, p, sizeof(del));
+
+	for (struct tx_job **pj = &r->jobs; *pj; pj = &(*pj)->next) {
+		struct tx_job *j = *pj;
+		if (j->id == del.can_id) {
+			timer_stop(&wheel, &j->timer);
+			*pj = j->next;
+			free(j);
+			return;
+		}
+	}
+}
+
+/*
+ * Change filters (VCAN_RX_SETUP)
+ *
+ * Each connection keeps its filters in an open addressed hash on the frame
+ * key, looked up for every frame it would be sent. The timeout timer is not
+ * restarted per frame. Instead the frame time is noted and a timer that
+ * fires early is pushed back to the last frame plus the timeout.
+ */
+struct rx_filter {
+	struct timer timer;
+	struct remote *owner;
+	canid_t id, key;
+	uint64_t timeout, seen;
+	int primed, last_len, mask_len;
+	uint8_t mask_last[]; /* mask_len bytes of mask then of the last data */
+};
+
+static struct rx_filter **rx_slot(struct remote *r, canid_t key)
+{
+	uint32_t h = key * 2654435761U;
+	for (uint32_t i = 0;; i++) {
+		struct rx_filter **f = &r->rx[(h + i) & (r->rx_cap - 1)];
+		if (!*f || (*f)->key == key) {
+			return f;
+		}
+	}
+}
+
+static void rx_rehash(struct remote *r, int cap)
+{
+	struct rx_filter **old = r->rx;
+	int oldcap = r->rx_cap;
+	r->rx_cap = cap;
+	r->rx = calloc(cap, sizeof(*r->rx));
+	for (int i = 0; i < oldcap; i++) {
+		if (old[i]) {
+			*rx_slot(r, old[i]->key) = old[i];
+		}
+	}
+	free(old);
+}
+
+static void rx_fire(struct wheel *w, struct timer *t)
+{
+	struct rx_filter *f = (struct rx_filter *)t;
+	if (f->seen + f->timeout > w->now) {
+		timer_start(w, t, f->seen + f->timeout);
+		return;
+	}
+
+	f->primed = 0;
+	struct vcan_tx_id ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = VCAN_RX_TIMEOUT;
+	ev.can_id = f->id;
+	send_ctrl(f->owner, &ev, sizeof(ev));
+}
+
+static void rx_arm(struct rx_filter *f)
+{
+	if (!f->timeout) {
+		return;
+	} else if (!wheel.count) {
+		wheel.now = wheel_clock();
+	}
+	f->seen = wheel.now;
+	if (f->timeout && !timer_active(&f->timer)) {
+		timer_start(&wheel, &f->timer, wheel.now + f->timeout);
+	}
+}
+
+/* Returns whether the record at p differs from the last of its id delivered
+ * to t in the bits t cares about, noting it as delivered if so */
+static int rx_changed(struct remote *t, const char *p, uint16_t len)
+{
+	struct rx_filter *f = *rx_slot(t, frame_key(p + 2, len));
+	if (!f) {
+		return 1;
+	}
+	rx_arm(f);
+
+	int dlen;
+	const uint8_t *data = frame_data(p + 2, len, &dlen);
+	int n = dlen < f->mask_len ? dlen : f->mask_len;
+	const uint8_t *mask = f->mask_last;
+	uint8_t *last = f->mask_last + f->mask_len;
+	int changed = !f->primed || dlen != f->last_len;
+	for (int i = 0; i < n && !changed; i++) {
+		changed = ((data[i] ^ last[i]) & mask[i]) != 0;
+	}
+	if (changed) {
+		f->primed = 1;
+		f->last_len = dlen;
+		memcpy(last, data, n);
+	}
+	return changed;
+}
+
+static void stop_rx(struct remote *r)
+{
+	for (int i = 0; i < r->rx_cap; i++) {
+		if (r->rx[i]) {
+			timer_stop(&wheel, &r->rx[i]->timer);
+		}
+	}
+}
+
+static void free_rx(struct remote *r)
+{
+	for (int i = 0; i < r->rx_cap; i++) {
+		free(r->rx[i]);
+	}
+	free(r->rx);
+}
+
+static struct rx_filter *rx_add(struct remote *r, canid_t id, canid_t key,
+				int mask_len)
+{
+	if (2 * (r->rx_num + 1) > r->rx_cap) {
+		rx_rehash(r, r->rx_cap ? 2 * r->rx_cap : 16);
+	}
+	struct rx_filter **pf = rx_slot(r, key);
+	struct rx_filter *f = *pf;
+	if (f) {
+		timer_stop(&wheel, &f->timer);
+	} else {
+		r->rx_num++;
+	}
+	f = realloc(f, sizeof(*f) + 2 * mask_len);
+	memset(f, 0, sizeof(*f));
+	f->timer.fn = &rx_fire;
+	f->owner = r;
+	f->id = id;
+	f->key = key;
+	f->mask_len = mask_len;
+	*pf = f;
+	return f;
+}
+
+static void rx_setup(struct remote *r, char *p, int n)
+{
+	struct vcan_rx_setup s;
+	if (n < sizeof(s)) {
+		return;
+	}
+	memcpy(&s, p, sizeof(s));
+	const char *frame = p + sizeof(s);
+	uint16_t len = n - sizeof(s);
+	if (len != CAN_MTU && len != CANFD_MTU &&
+	    !(vcan_is_xl(frame, len) && len <= CANXL_MTU)) {
+		return;
+	}
+	canid_t id;
+	memcpy(&id, frame, sizeof(id));
+
+	int mask_len;
+	const uint8_t *mask = frame_data(frame, len, &mask_len);
+	struct rx_filter *f = rx_add(r, id, frame_key(frame, len), mask_len);
+	memcpy(f->mask_last, mask, mask_len);
+	f->timeout = ns_to_ticks(s.timeout_ns);
+	rx_arm(f);
+}
+
+static void rx_delete(struct remote *r, char *p, int n)
+{
+	struct vcan_tx_id del;
+	if (n < sizeof(del)) {
+		return;
+	}
+	memcpy(&del, p, sizeof(del));
+
+	/* the id alone cannot tell an XL filter from another, drop both */
+	int found = 0;
+	for (int i = 0; i < r->rx_cap; i++) {
+		struct rx_filter *f = r->rx[i];
+		if (f && f->id == del.can_id) {
+			timer_stop(&wheel, &f->timer);
+			free(f);
+			r->rx[i] = NULL;
+			r->rx_num--;
+			found = 1;
+		}
+	}
+	if (found) {
+		rx_rehash(r, r->rx_cap);
+	}
+}
+
+/*
+ * Downsampling (VCAN_RATE)
+ *
+ * Each rule keeps a timer and a list of the ids with frames held since it
+ * last fired. The per id state lives in a per connection hash on the frame
+ * key, which also notes ids that no rule matches so that the rules are only
+ * searched once per id. The timer keeps ticking while the ticks find frames
+ * to send, and otherwise waits for the next held frame.
+ */
+struct rate_rule {
+	struct timer timer;
+	struct rate_rule *next;
+	struct remote *owner;
+	struct vcan_filter filter;
+	int flags, start, len;
+	uint64_t ival;
+	struct rate_slot *dirty, **dirty_tail;
+};
+
+struct rate_slot {
+	struct rate_slot *next_dirty;
+	struct rate_rule *rule; /* NULL when no rule matches */
+	canid_t key;
+	int held;
+	uint64_t lo, hi; /* the field, biased to compare as unsigned */
+	uint32_t order[2];
+	uint16_t len[2];
+	struct scratch rec[2]; /* the newest, or lowest and highest */
+};
+
+static uint32_t rate_order;
+
+static struct rate_slot **rate_slot(struct remote *r, canid_t key)
+{
+	uint32_t h = key * 2654435761U;
+	for (uint32_t i = 0;; i++) {
+		struct rate_slot **s =
+			&r->rate_slots[(h + i) & (r->rate_cap - 1)];
+		if (!*s || (*s)->key == key) {
+			return s;
+		}
+	}
+}
+
+static void rate_rehash(struct remote *r, int cap)
+{
+	struct rate_slot **old = r->rate_slots;
+	int oldcap = r->rate_cap;
+	r->rate_cap = cap;
+	r->rate_slots = calloc(cap, sizeof(*r->rate_slots));
+	for (int i = 0; i < oldcap; i++) {
+		if (old[i]) {
+			*rate_slot(r, old[i]->key) = old[i];
+		}
+	}
+	free(old);
+}
+
+/* Reads the field of rule u from the frame data */
+static uint64_t rate_field(const struct rate_rule *u, const uint8_t *data,
+			   int dlen)
+{
+	uint8_t b[9];
+	int first = u->start / 8;
+	for (int i = 0; i < 9; i++) {
+		b[i] = first + i < dlen ? data[first + i] : 0;
+	}
+
+	uint64_t v = 0;
+	if (u->flags & VCAN_RATE_MOTOROLA) {
+		int skip = 7 - u->start % 8;
+		for (int i = 0; i < 8; i++) {
+			v = v << 8 | b[i];
+		}
+		v = (v << skip | (uint64_t)b[8] >> (8 - skip)) >> (64 - u->len);
+	} else {
+		int skip = u->start % 8;
+		for (int i = 7; i >= 0; i--) {
+			v = v << 8 | b[i];
+		}
+		v >>= skip;
+		if (skip) {
+			v |= (uint64_t)b[8] << (64 - skip);
+		}
+		if (u->len < 64) {
+			v &= ((uint64_t)1 << u->len) - 1;
+		}
+	}
+
+	if (u->flags & VCAN_RATE_SIGNED) {
+		/* sign extend, then flip the sign bit to order as unsigned */
+		v = (uint64_t)((int64_t)(v << (64 - u->len)) >> (64 - u->len));
+		v ^= (uint64_t)1 << 63;
+	}
+	return v;
+}
+
+static void rate_keep(struct rate_slot *s, int i, const char *p, uint16_t len,
+		      uint32_t order)
+{
+	memcpy(reserve(&s->rec[i], 2 + len), p, 2 + len);
+	s->len[i] = 2 + len;
+	s->order[i] = order;
+}
+
+/* Holds the record at p for t if a rule covers it. Returns whether it did. */
+static int rate_hold(struct remote *t, const char *p, uint16_t len)
+{
+	if (2 * (t->rate_num + 1) > t->rate_cap) {
+		rate_rehash(t, t->rate_cap ? 2 * t->rate_cap : 16);
+	}
+	canid_t key = frame_key(p + 2, len);
+	struct rate_slot **ps = rate_slot(t, key);
+	struct rate_slot *s = *ps;
+	if (!s) {
+		canid_t id = record_id(p, len);
+		s = calloc(1, sizeof(*s));
+		s->key = key;
+		s->rule = t->rates;
+		while (s->rule && ((id ^ s->rule->filter.id) &
+				   s->rule->filter.mask)) {
+			s->rule = s->rule->next;
+		}
+		*ps = s;
+		t->rate_num++;
+	}
+	struct rate_rule *u = s->rule;
+	if (!u) {
+		return 0;
+	}
+
+	uint32_t order = rate_order++;
+	if (!(u->flags & VCAN_RATE_MINMAX)) {
+		rate_keep(s, 0, p, len, order);
+	} else {
+		int dlen;
+		const uint8_t *data = frame_data(p + 2, len, &dlen);
+		uint64_t v = rate_field(u, data, dlen);
+		if (!s->held || v < s->lo) {
+			s->lo = v;
+			rate_keep(s, 0, p, len, order);
+		}
+		if (!s->held || v > s->hi) {
+			s->hi = v;
+			rate_keep(s, 1, p, len, order);
+		}
+	}
+
+	if (!s->held) {
+		s->held = 1;
+		s->next_dirty = NULL;
+		*u->dirty_tail = s;
+		u->dirty_tail = &s->next_dirty;
+		if (!timer_active(&u->timer)) {
+			if (!wheel.count) {
+				wheel.now = wheel_clock();
+			}
+			timer_start(&wheel, &u->timer, wheel.now + u->ival);
+		}
+	}
+	return 1;
+}
+
+/* Sends the frames held for u. Returns -1 if the owner had to be closed. */
+static int rate_send(struct rate_rule *u)
+{
+	static struct scratch out;
+	int sz = 0;
+	for (struct rate_slot *s = u->dirty; s != NULL; s = s->next_dirty) {
+		int minmax = (u->flags & VCAN_RATE_MINMAX) &&
+			     s->order[0] != s->order[1];
+		int first = minmax && (int32_t)(s->order[1] - s->order[0]) < 0;
+		for (int i = 0; i <= minmax; i++) {
+			int k = i ^ first;
+			char *o = reserve(&out, sz + s->len[k]);
+			memcpy(o + sz, s->rec[k].p, s->len[k]);
+			sz += s->len[k];
+		}
+		s->held = 0;
+	}
+	u->dirty = NULL;
+	u->dirty_tail = &u->dirty;
+	if (sz && nonblock_send(u->owner, out.p, sz)) {
+		close_remote(u->owner);
+		return -1;
+	}
+	return sz ? 1 : 0;
+}
+
+static void rate_fire(struct wheel *w, struct timer *t)
+{
+	struct rate_rule *u = (struct rate_rule *)t;
+	if (rate_send(u) > 0) {
+		timer_start(w, t, t->expires + u->ival);
+	}
+}
+
+static void stop_rates(struct remote *r)
+{
+	for (struct rate_rule *u = r->rates; u != NULL; u = u->next) {
+		timer_stop(&wheel, &u->timer);
+	}
+}
+
+static void free_rate_slots(struct remote *r)
+{
+	for (int i = 0; i < r->rate_cap; i++) {
+		struct rate_slot *s = r->rate_slots[i];
+		if (s) {
+			free(s->rec[0].p);
+			free(s->rec[1].p);
+			free(s);
+		}
+	}
+	free(r->rate_slots);
+	r->rate_slots = NULL;
+	r->rate_num = 0;
+	r->rate_cap = 0;
+}
+
+static void free_rates(struct remote *r)
+{
+	free_rate_slots(r);
+	while (r->rates) {
+		struct rate_rule *u = r->rates;
+		r->rates = u->next;
+		free(u);
+	}
+}
+
+/* Sends whatever is held for r early. Returns -1 if r had to be closed. */
+static int rate_flush(struct remote *r)
+{
+	for (struct rate_rule *u = r->rates; u != NULL; u = u->next) {
+		if (rate_send(u) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void rate_add(struct remote *r, const struct vcan_rate *m)
+{
+	/* which rule an id goes by may change, start afresh */
+	if (rate_flush(r)) {
+		return;
+	}
+	free_rate_slots(r);
+
+	struct rate_rule **pu = &r->rates;
+	while (*pu && memcmp(&(*pu)->filter, &m->filter, sizeof(m->filter))) {
+		pu = &(*pu)->next;
+	}
+	struct rate_rule *u = *pu;
+	if (!m->ival_ns) {
+		if (u) {
+			timer_stop(&wheel, &u->timer);
+			*pu = u->next;
+			free(u);
+		}
+		return;
+	} else if (!u) {
+		u = calloc(1, sizeof(*u));
+		u->timer.fn = &rate_fire;
+		u->owner = r;
+		u->filter = m->filter;
+		*pu = u;
+	}
+	u->flags = m->flags;
+	u->start = m->start;
+	u->len = m->len;
+	u->ival = ns_to_ticks(m->ival_ns);
+	u->dirty = NULL;
+	u->dirty_tail = &u->dirty;
+}
+
+static void rate_setup(struct remote *r, char *p, int n)
+{
+	struct vcan_rate m;
+	if (n < sizeof(m)) {
+		return;
+	}
+	memcpy(&m, p, sizeof(m));
+	if ((m.flags & VCAN_RATE_MINMAX) &&
+	    (!m.len || m.len > 64 || m.start >= 8 * CANXL_MAX_DLEN)) {
+		return;
+	}
+	rate_add(r, &m);
+}
+
+/*
+ * Taps (VCAN_TAP)
+ *
+ * Frames are passed to taps as they enter the bus, in batches of no more
+ * than a control message holds.
+ */
+static struct scratch tap_scratch;
+
+static void tap_send(const struct vcan_tap *h, const char *recs, int sz)
+{
+	char *out = reserve(&tap_scratch, 2 + sizeof(*h) + sz);
+	uint16_t len = VCAN_CTRL | (sizeof(*h) + sz);
+	memcpy(out, &len, 2);
+	memcpy(out + 2, h, sizeof(*h));
+	memcpy(out + 2 + sizeof(*h), recs, sz);
+	for (struct remote *t = remotes, *last = t ? t->prev : NULL; t;) {
+		struct remote *next = t->next;
+		int done = t == last;
+		if (t->tap && nonblock_send(t, out, 2 + sizeof(*h) + sz)) {
+			close_remote(t);
+		}
+		t = done ? NULL : next;
+	}
+}
+
+static void tap_frames(unsigned from, const char *p, int n, uint64_t ns)
+{
+	if (!ntaps) {
+		return;
+	}
+	struct vcan_tap h;
+	memset(&h, 0, sizeof(h));
+	h.type = VCAN_TAP;
+	h.from = from;
+	h.ns = ns;
+	const char *run = p;
+	const char *e = p + n;
+	while (p < e) {
+		uint16_t len;
+		memcpy(&len, p, 2);
+		if (p > run &&
+		    p + 2 + len - run > VCAN_LEN_MASK - (int)sizeof(h)) {
+			tap_send(&h, run, p - run);
+			run = p;
+		}
+		p += 2 + len;
+	}
+	if (p > run) {
+		tap_send(&h, run, p - run);
+	}
+}
+
+static void tap_setup(struct remote *r, char *p, int n)
+{
+	struct vcan_tap m;
+	if (n < sizeof(m)) {
+		return;
+	}
+	memcpy(&m, p, sizeof(m));
+	int on = (m.flags & VCAN_TAP_ON) != 0;
+	if (on != r->tap) {
+		r->tap = on;
+		ntaps += on ? 1 : -1;
+	}
+}
+
+/*
+ * Session resume (VCAN_SESSION)
+ *
+ * Frames are numbered as they enter the fanout and with -r copied into a
+ * history ring. The ring is a byte buffer addressed by a position that only
+ * grows, with records that would straddle the end moved to the start, and
+ * an index of power of two size from sequence number to position. Adding a
+ * record drops the oldest ones until it fits. Without -r or any sessions the
+ * frames are not even counted.
+ *
+ * A resumed connection is left out of the live fanout until the replay has
+ * caught up with the newest frame, so that frames arriving meanwhile are
+ * sent in order from the history. The replay sends as much as fits in half
+ * the connection's queue each loop and carries on as it drains.
+ */
+#define SESSION_LINGER_TICKS 60000
+#define REPLAY_BATCH 65536
+
+struct hist_entry {
+	uint64_t pos;
+	unsigned from;
+	uint16_t len;
+};
+
+struct session {
+	struct timer linger;
+	struct session *next;
+	struct remote *r;
+	uint64_t token;
+	uint64_t seq; /* the next frame for r */
+	uint64_t sent; /* seq of the last VCAN_SEQ or reply */
+	unsigned last_id; /* the connection before r */
+};
+
+static char *hist_buf;
+static struct hist_entry *hist;
+static uint64_t hist_slots, hist_pos;
+static uint64_t hist_first, hist_seq; /* [hist_first, hist_seq) are held */
+static struct session *sessions;
+
+static void hist_put(unsigned from, const char *rec, int n)
+{
+	if (!hist_buf) {
+		/* room for a few of the largest records at least */
+		if (hist_cap < 4 * (2 + VCAN_LEN_MASK)) {
+			hist_cap = 4 * (2 + VCAN_LEN_MASK);
+		}
+		hist_slots = 64;
+		while (hist_slots < hist_cap / 16) {
+			hist_slots *= 2;
+		}
+		hist_buf = malloc(hist_cap);
+		hist = malloc(hist_slots * sizeof(*hist));
+	}
+
+	uint64_t pos = hist_pos;
+	if (pos % hist_cap + n > hist_cap) {
+		pos += hist_cap - pos % hist_cap;
+	}
+	while (hist_first < hist_seq &&
+	       (hist_seq - hist_first == hist_slots ||
+		hist[hist_first & (hist_slots - 1)].pos + hist_cap < pos + n)) {
+		hist_first++;
+	}
+
+	struct hist_entry *h = &hist[hist_seq & (hist_slots - 1)];
+	h->pos = pos;
+	h->from = from;
+	h->len = n;
+	memcpy(hist_buf + pos % hist_cap, rec, n);
+	hist_pos = pos + n;
+}
+
+static void history_append(unsigned from, const char *p, int n)
+{
+	if (!hist_cap && !sessions) {
+		return;
+	}
+	const char *e = p + n;
+	while (p < e) {
+		uint16_t len;
+		memcpy(&len, p, 2);
+		if (hist_cap) {
+			hist_put(from, p, 2 + len);
+		}
+		hist_seq++;
+		p += 2 + len;
+	}
+	if (!hist_cap) {
+		hist_first = hist_seq;
+	}
+}
+
+static void send_seq(struct session *s, int flags)
+{
+	struct vcan_seq m;
+	memset(&m, 0, sizeof(m));
+	m.type = VCAN_SEQ;
+	m.flags = flags;
+	m.seq = s->seq;
+	s->sent = s->seq;
+	send_ctrl(s->r, &m, sizeof(m));
+}
+
+/* Sends the history from s->seq on until it catches up or the queue fills */
+static void replay_more(struct session *s)
+{
+	static struct scratch rs;
+	struct remote *r = s->r;
+	if (s->seq < hist_first) {
+		s->seq = hist_first;
+		send_seq(s, VCAN_SEQ_GAP);
+		if (!r->prev) {
+			return;
+		}
+	}
+
+	while (s->seq < hist_seq && r->out_sz < MAX_QUEUE / 2) {
+		int sz = 0;
+		while (s->seq < hist_seq && sz < REPLAY_BATCH) {
+			struct hist_entry *h = &hist[s->seq++ & (hist_slots - 1)];
+			const char *rec = hist_buf + h->pos % hist_cap;
+			if (h->from != r->id && h->from != s->last_id &&
+			    delivers(r, rec, h->len - 2)) {
+				memcpy(reserve(&rs, sz + h->len) + sz, rec, h->len);
+				sz += h->len;
+			}
+		}
+		if (sz && nonblock_send(r, rs.p, sz)) {
+			close_remote(r);
+			return;
+		}
+	}
+
+	if (s->seq == hist_seq) {
+		r->replaying = 0;
+	}
+	if (s->sent != s->seq) {
+		send_seq(s, 0);
+	}
+}
+
+static void session_flush(void)
+{
+	for (struct session *s = sessions; s != NULL; s = s->next) {
+		if (!s->r) {
+			continue;
+		} else if (s->r->replaying) {
+			replay_more(s);
+		} else if (s->sent != hist_seq) {
+			s->seq = hist_seq;
+			send_seq(s, 0);
+		}
+	}
+}
+
+static void session_expire(struct wheel *w, struct timer *t)
+{
+	struct session **ps = &sessions;
+	while (*ps != (struct session *)t) {
+		ps = &(*ps)->next;
+	}
+	*ps = (*ps)->next;
+	free(t);
+}
+
+static void session_detach(struct remote *r)
+{
+	struct session *s = r->session;
+	s->r = NULL;
+	s->last_id = r->id;
+	r->session = NULL;
+	r->replaying = 0;
+	if (!wheel.count) {
+		wheel.now = wheel_clock();
+	}
+	timer_start(&wheel, &s->linger, wheel.now + SESSION_LINGER_TICKS);
+}
+
+static struct session *find_session(uint64_t token)
+{
+	struct session *s = sessions;
+	while (s && s->token != token) {
+		s = s->next;
+	}
+	return s;
+}
+
+static struct session *new_session(uint64_t token)
+{
+	static uint64_t counter;
+	while (!token || find_session(token)) {
+		/* splitmix64 over the time, daemon and a counter */
+		uint64_t x = trace_now() ^ ((uint64_t)daemon_id << 32) ^
+			     ++counter * 0x9E3779B97F4A7C15ULL;
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+		token = x ^ (x >> 31);
+	}
+	struct session *s = calloc(1, sizeof(*s));
+	s->linger.fn = &session_expire;
+	s->token = token;
+	s->next = sessions;
+	sessions = s;
+	return s;
+}
+
+static void session_start(struct remote *r, char *p, int n)
+{
+	struct vcan_session req;
+	if (n < sizeof(req)) {
+		return;
+	}
+	memcpy(&req, p, sizeof(req));
+
+	struct session *s = req.token ? find_session(req.token) : NULL;
+	if (s && s->r && s->r != r) {
+		/* the old connection is dead and does not know it yet */
+		close_remote(s->r);
+	}
+	if (r->session && r->session != s) {
+		session_detach(r);
+	}
+
+	int gap = 0;
+	if (s) {
+		timer_stop(&wheel, &s->linger);
+		s->seq = req.seq < hist_seq ? req.seq : hist_seq;
+	} else {
+		s = new_session(0);
+		s->seq = hist_seq;
+		gap = req.token != 0;
+	}
+	s->r = r;
+	r->session = s;
+
+	struct vcan_session reply;
+	memset(&reply, 0, sizeof(reply));
+	reply.type = VCAN_SESSION;
+	reply.token = s->token;
+	reply.seq = s->seq;
+	s->sent = s->seq;
+	send_ctrl(r, &reply, sizeof(reply));
+	if (!r->prev) {
+		return;
+	} else if (gap) {
+		send_seq(s, VCAN_SEQ_GAP);
+	} else if (s->seq != hist_seq) {
+		r->replaying = 1;
+		replay_more(s);
+	}
+}
+
+/*
+ * Federation (VCAN_PEER)
+ *
+ * Trunks to other daemons get frames from local clients batched per loop in
+ * one shared batch. Every trunk is sent the part of each batch it is
+ * interested in, all under the same sequence number, so that the first copy
+ * to reach a daemon is the one it keeps whichever path it took. Batches from
+ * a trunk go to the local clients and on to the other trunks as they are.
+ *
+ * The interest sent over a trunk is recomputed whenever a subscription or
+ * the set of connections changes. In a mesh with loops interest can outlive
+ * its subscriber by going round the loop, which costs bandwidth but never
+ * frames.
+ */
+#define TRUNK_HOPS 8
+#define TRUNK_ORIGINS 256
+#define TRUNK_REDIAL_TICKS 1000
+
+/* records in a trunk batch */
+#define TRUNK_BATCH ((int)VCAN_LEN_MASK - (int)sizeof(struct vcan_trunk))
+
+struct trunk {
+	uint32_t daemon;
+	int quiet;
+	struct timer *redial;
+	char *adv;
+	int adv_sz;
+};
+
+struct origin {
+	uint32_t id;
+	uint32_t high;
+	uint64_t seen;
+	uint64_t heard;
+};
+
+static char trunk_batch[TRUNK_BATCH];
+static int trunk_batch_sz;
+static uint32_t trunk_seq;
+static struct origin origins[TRUNK_ORIGINS];
+static struct scratch tscratch;
+
+/* Returns whether batch seq from origin has been seen before */
+static int trunk_dup(uint32_t id, uint32_t seq)
+{
+	struct origin *o = NULL;
+	for (int i = 0; i < TRUNK_ORIGINS; i++) {
+		struct origin *x = &origins[i];
+		if (x->heard && x->id == id) {
+			o = x;
+			break;
+		} else if (!o || (o->heard && x->heard < o->heard)) {
+			o = x;
+		}
+	}
+
+	int32_t d = (int32_t)(seq - o->high);
+	if (!o->heard || o->id != id) {
+		o->id = id;
+		o->high = seq;
+		o->seen = 1;
+	} else if (d > 0) {
+		o->seen = d < 64 ? (o->seen << d) | 1 : 1;
+		o->high = seq;
+	} else if (d <= -64 || (o->seen & ((uint64_t)1 << -d))) {
+		return 1;
+	} else {
+		o->seen |= (uint64_t)1 << -d;
+	}
+	o->heard = trace_now();
+	return 0;
+}
+
+/* Sends the records in buf that t is interested in as one VCAN_TRUNK */
+static void trunk_send(struct remote *t, const struct vcan_trunk *h,
+		       const char *buf, int n)
+{
+	if (t->trunk->quiet) {
+		return;
+	}
+
+	char *out = reserve(&tscratch, 2 + sizeof(*h) + n);
+	int sz = 2 + sizeof(*h);
+	const char *e = buf + n;
+	while (buf < e) {
+		uint16_t len;
+		memcpy(&len, buf, 2);
+		if (wants(t, record_id(buf, len))) {
+			memcpy(out + sz, buf, 2 + len);
+			sz += 2 + len;
+		}
+		buf += 2 + len;
+	}
+	if (sz == 2 + sizeof(*h)) {
+		return;
+	}
+
+	uint16_t len = VCAN_CTRL | (sz - 2);
+	memcpy(out, &len, 2);
+	memcpy(out + 2, h, sizeof(*h));
+	TRACE(send, 0, t->id, sz);
+	if (nonblock_send(t, out, sz)) {
+		close_remote(t);
+	}
+}
+
+static void trunk_send_batch(void)
+{
+	struct vcan_trunk h;
+	memset(&h, 0, sizeof(h));
+	h.type = VCAN_TRUNK;
+	h.hops = TRUNK_HOPS;
+	h.origin = daemon_id;
+	h.seq = trunk_seq++;
+
+	for (struct remote *t = remotes, *last = t ? t->prev : NULL; t;) {
+		struct remote *next = t->next;
+		int done = t == last;
+		if (t->trunk) {
+			trunk_send(t, &h, trunk_batch, trunk_batch_sz);
+		}
+		t = done ? NULL : next;
+	}
+	trunk_batch_sz = 0;
+}
+
+static void trunk_append(const char *buf, int n)
+{
+	const char *e = buf + n;
+	while (buf < e) {
+		uint16_t len;
+		memcpy(&len, buf, 2);
+		if (trunk_batch_sz + 2 + len > TRUNK_BATCH) {
+			trunk_send_batch();
+		}
+		if (2 + len <= TRUNK_BATCH) {
+			memcpy(trunk_batch + trunk_batch_sz, buf, 2 + len);
+			trunk_batch_sz += 2 + len;
+		}
+		buf += 2 + len;
+	}
+}
+
+static int has_filter(const struct vcan_filter *f, int n,
+		      const struct vcan_filter *x)
+{
+	for (int i = 0; i < n; i++) {
+		if (f[i].id == x->id && f[i].mask == x->mask) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Sends t the union of the interest on this side if it has changed */
+static void advertise(struct remote *t)
+{
+	int max = (TRUNK_BATCH - (int)sizeof(struct vcan_interest)) /
+		  (int)sizeof(struct vcan_filter);
+	char *out = reserve(&tscratch, 2 + sizeof(struct vcan_interest) +
+					       max * sizeof(struct vcan_filter));
+	struct vcan_filter *f =
+		(struct vcan_filter *)(out + 2 + sizeof(struct vcan_interest));
+	struct vcan_interest in;
+	memset(&in, 0, sizeof(in));
+	in.type = VCAN_INTEREST;
+
+	for (struct remote *s = t->next; s != t && !in.flags; s = s->next) {
+		if (s->trunk && s->trunk->quiet) {
+			continue;
+		} else if (!s->nfilter) {
+			in.flags = VCAN_INTEREST_ALL;
+		}
+		for (int i = 0; i < s->nfilter && !in.flags; i++) {
+			if (has_filter(f, in.count, &s->filter[i])) {
+				continue;
+			} else if (in.count == max) {
+				/* too many to list, ask for everything */
+				in.flags = VCAN_INTEREST_ALL;
+			} else {
+				f[in.count++] = s->filter[i];
+			}
+		}
+	}
+	if (in.flags) {
+		in.count = 0;
+	}
+
+	int sz = 2 + sizeof(in) + in.count * sizeof(*f);
+	uint16_t len = VCAN_CTRL | (sz - 2);
+	memcpy(out, &len, 2);
+	memcpy(out + 2, &in, sizeof(in));
+
+	struct trunk *k = t->trunk;
+	if (k->adv && k->adv_sz == sz && !memcmp(k->adv, out, sz)) {
+		return;
+	}
+	k->adv = realloc(k->adv, sz);
+	k->adv_sz = sz;
+	memcpy(k->adv, out, sz);
+	if (nonblock_send(t, out, sz)) {
+		close_remote(t);
+	}
+}
+
+/* Sends the batch so far and any change in interest to every trunk */
+static void trunk_flush(void)
+{
+	if (trunk_batch_sz) {
+		trunk_send_batch();
+	}
+	if (!interest_dirty) {
+		return;
+	}
+	interest_dirty = 0;
+	for (struct remote *t = remotes, *last = t ? t->prev : NULL; t;) {
+		struct remote *next = t->next;
+		int done = t == last;
+		if (t->trunk) {
+			advertise(t);
+		}
+		t = done ? NULL : next;
+	}
+}
+
+static void trunk_open(struct remote *r, struct timer *redial)
+{
+	r->trunk = calloc(1, sizeof(*r->trunk));
+	r->trunk->redial = redial;
+	ntrunks++;
+	interest_dirty = 1;
+
+	struct vcan_peer peer;
+	memset(&peer, 0, sizeof(peer));
+	peer.type = VCAN_PEER;
+	peer.daemon = daemon_id;
+	send_ctrl(r, &peer, sizeof(peer));
+}
+
+static void trunk_closed(struct remote *r)
+{
+	ntrunks--;
+	if (r->trunk->redial) {
+		timer_start(&wheel, r->trunk->redial,
+			    wheel.now + TRUNK_REDIAL_TICKS);
+	}
+}
+
+static void free_trunk(struct remote *r)
+{
+	if (r->trunk) {
+		free(r->trunk->adv);
+		free(r->trunk);
+	}
+}
+
+static void trunk_peer(struct remote *r, char *p, int n)
+{
+	struct vcan_peer peer;
+	if (n < sizeof(peer)) {
+		return;
+	}
+	memcpy(&peer, p, sizeof(peer));
+	if (!r->trunk) {
+		trunk_open(r, NULL);
+	}
+	r->trunk->daemon = peer.daemon;
+	if (peer.daemon == daemon_id) {
+		fputs("vcand: not peering with self\n", stderr);
+		r->trunk->redial = NULL;
+		close_remote(r);
+	}
+}
+
+static void trunk_interest(struct remote *r, char *p, int n)
+{
+	struct vcan_interest in;
+	if (n < sizeof(in)) {
+		return;
+	}
+	memcpy(&in, p, sizeof(in));
+	if (n < sizeof(in) + in.count * sizeof(struct vcan_filter)) {
+		return;
+	}
+
+	int all = in.flags & VCAN_INTEREST_ALL;
+	r->trunk->quiet = !all && !in.count;
+	r->nfilter = all ? 0 : in.count;
+	r->filter = realloc(r->filter, r->nfilter * sizeof(*r->filter));
+	memcpy(r->filter, p + sizeof(in), r->nfilter * sizeof(*r->filter));
+	interest_dirty = 1;
+}
+
+static void trunk_input(struct remote *r, char *p, int n)
+{
+	struct vcan_trunk h;
+	if (n < sizeof(h)) {
+		return;
+	}
+	memcpy(&h, p, sizeof(h));
+	char *recs = p + sizeof(h);
+	int sz = n - sizeof(h);
+	if (!valid_records(recs, sz) || h.origin == daemon_id || !h.hops ||
+	    trunk_dup(h.origin, h.seq)) {
+		return;
+	} else if (cache) {
+		cache_frames(recs, sz);
+	}
+	history_append(r->id, recs, sz);
+	tap_frames(r->id, recs, sz, trace_now());
+
+	h.hops--;
+	for (struct remote *t = r->next; t != r;) {
+		struct remote *next = t->next;
+		if (!t->trunk) {
+			TRACE(send, r->id, t->id, sz);
+			if (send_filtered(t, recs, sz)) {
+				close_remote(t);
+			}
+		} else if (h.hops) {
+			trunk_send(t, &h, recs, sz);
+		}
+		t = next;
+	}
+}
+
+static void trunk_ctrl(struct remote *r, char *p, int n)
+{
+	switch ((uint8_t)p[0]) {
+	case VCAN_PEER:
+		trunk_peer(r, p, n);
+		break;
+	case VCAN_INTEREST:
+		trunk_interest(r, p, n);
+		break;
+	case VCAN_TRUNK:
+		trunk_input(r, p, n);
+		break;
+	}
+}
+
+static void handle_ctrl(struct remote *r, char *p, int n)
+{
+	struct vcan_join join;
+	struct vcan_time tm;
+	if (!n) {
+		return;
+	} else if (r->trunk) {
+		trunk_ctrl(r, p, n);
+		return;
+	} else if ((uint8_t)p[0] == VCAN_PEER && !lockstep && !r->plugin &&
+		   !r->seqpacket) {
+		trunk_peer(r, p, n);
+		return;
+	} else if ((uint8_t)p[0] == VCAN_COMPRESS) {
+		start_compression(r, p, n);
+		return;
+	} else if ((uint8_t)p[0] == VCAN_SUBSCRIBE) {
+		subscribe(r, p, n);
+		return;
+	} else if ((uint8_t)p[0] == VCAN_SNAPSHOT) {
+		if (cache) {
+			send_snapshot(r);
+		}
+		return;
+	} else if ((uint8_t)p[0] == VCAN_TX_SETUP) {
+		tx_setup(r, p, n);
+		return;
+	} else if ((uint8_t)p[0] == VCAN_TX_DELETE) {
+		tx_delete(r, p, n);
+		return;
+	} else if ((uint8_t)p[0] == VCAN_RX_SETUP) {
+		rx_setup(r, p, n);
+		return;
+	} else if ((uint8_t)p[0] == VCAN_RX_DELETE) {
+		rx_delete(r, p, n);
+		return;
+	} else if ((uint8_t)p[0] == VCAN_SESSION) {
+		session_start(r, p, n);
+		return;
+	} else if ((uint8_t)p[0] == VCAN_RATE) {
+		rate_setup(r, p, n);
+		return;
+	} else if ((uint8_t)p[0] == VCAN_TAP) {
+		tap_setup(r, p, n);
+		return;
+	} else if (!lockstep) {
+		return;
+	}
+
+	switch ((uint8_t)p[0]) {
+	case VCAN_JOIN:
+		if (n >= sizeof(join)) {
+			memcpy(&join, p, sizeof(join));
+			r->joined = 1;
+			r->waiting = 0;
+			r->node = join.node;
+			r->vtime = vclock;
+		}
+		break;
+	case VCAN_TIME:
+	case VCAN_BARRIER:
+		if (n >= sizeof(tm) && r->joined) {
+			memcpy(&tm, p, sizeof(tm));
+			uint64_t ns = tm.ns > vclock ? tm.ns : vclock;
+			if (tm.type == VCAN_TIME) {
+				r->vtime = ns;
+			} else {
+				r->waiting = 1;
+				r->barrier = ns;
+			}
+		}
+		break;
+	}
+}
+
+static int compressed_input(struct remote *r, const char *buf, int n);
+
+static void distribute_data(struct remote *r)
+{
+	int n = frame_bytes(r);
+	if (!n) {
+		return;
+	}
+
+	struct zlink *z = r->z;
+	char *p = r->buf;
+	char *e = r->buf + n;
+	char *run = p;
+	while (p < e) {
+		uint16_t len;
+		memcpy(&len, p, 2);
+		char *next = p + 2 + (len & VCAN_LEN_MASK);
+		if (len & VCAN_CTRL) {
+			forward_frames(r, run, p - run);
+			handle_ctrl(r, p + 2, len & VCAN_LEN_MASK);
+			run = next;
+			if (!r->prev) {
+				return;
+			} else if (r->z != z) {
+				/* the rest of the buffer is compressed */
+				e = next;
+				n = next - r->buf;
+			}
+		}
+		p = next;
+	}
+	forward_frames(r, run, e - run);
+
+	if (n < r->sz) {
+		memmove(r->buf, r->buf + n, r->sz - n);
+	}
+	r->sz -= n;
+
+	if (r->z != z) {
+		/* decoded records land whole in the buffer, which could not
+		 * move while it was being walked */
+		input_room(r, 2 + VCAN_LEN_MASK);
+	}
+	if (r->z != z && r->sz) {
+		static struct scratch rest;
+		int sz = r->sz;
+		memcpy(reserve(&rest, sz), r->buf, sz);
+		r->sz = 0;
+		if (compressed_input(r, rest.p, sz)) {
+			close_remote(r);
+		}
+	}
+}
+
+static int compressed_input(struct remote *r, const char *buf, int n)
+{
+	struct zlink *z = r->z;
+#ifdef VCAN_ZLIB
+	if (z->flags & VCAN_COMPRESS_DEFLATE) {
+		if (vz_inflate(&z->inflate, buf, n, &z->in, &z->in_sz,
+			       &z->in_cap)) {
+			return -1;
+		}
+	} else
+#endif
+	{
+		if (z->in_sz + n > z->in_cap) {
+			z->in_cap = 2 * (z->in_sz + n);
+			z->in = realloc(z->in, z->in_cap);
+		}
+		memcpy(z->in + z->in_sz, buf, n);
+		z->in_sz += n;
+	}
+
+	int off = 0;
+	for (;;) {
+		int used;
+		int w = vz_decode(&z->rx, z->in + off, z->in_sz - off, &used,
+				  r->buf + r->sz, r->cap - r->sz);
+		if (w < 0) {
+			return -1;
+		} else if (!w) {
+			break;
+		}
+		off += used;
+		r->sz += w;
+		distribute_data(r);
+		if (!r->prev) {
+			return 0;
+		}
+	}
+
+	memmove(z->in, z->in + off, z->in_sz - off);
+	z->in_sz -= off;
+	return 0;
+}
+
+/*
+ * Transports
+ *
+ * The routing core above only sees a connection through took_input, fed the
+ * bytes read from it, and its send and write hooks. send takes whole records
+ * and is where plugins, the multicast bus and compression differ. write
+ * takes what write_output and flush_output have for the transport and
+ * returns how much of it went, the rest staying queued. Sockets are read and
+ * written through the back ends further down.
+ *
+ * The in-memory loopback (-B N[:K]) is a transport of its own whose clients
+ * are just buffers. It routes K thousand frames among N of them with no
+ * sockets or polling, each handing in LOOP_BATCH frames in turn as the loop
+ * would read them, LOOP_EVENTS of them a pass as epoll reports. Each
+ * client takes up to LOOP_WINDOW bytes a pass, as a socket buffer would,
+ * and what does not fit is queued and drained at the end of the pass. The
+ * frames are the same every run, so it measures the routing core, queueing
+ * included, by itself on any platform.
+ */
+#define LOOP_BATCH 64
+#define LOOP_EVENTS 16
+#define LOOP_WINDOW (16 * 1024)
+
+static uint64_t loop_queued;
+
+static int loop_write(struct remote *t, const char *buf, int n)
+{
+	int took = n < t->loop_room ? n : t->loop_room;
+	t->loop_room -= took;
+	loop_bytes += took;
+	return took;
+}
+
+/* The clients read all that was sent to them */
+static void loop_drain(void)
+{
+	for (struct remote *r = remotes, *last = r ? r->prev : NULL; r;) {
+		if (r->loop) {
+			loop_queued += r->out_sz;
+			do {
+				r->loop_room = LOOP_WINDOW;
+			} while (r->out_sz && !flush_output(r));
+		}
+		r = (r == last) ? NULL : r->next;
+	}
+}
+
+static void read_more(struct remote *r);
+
+/* Routes the n bytes just read from r to p, the end of r->buf unless r is
+ * compressed. p is only read for compressed links and may be NULL. */
+static void took_input(struct remote *r, const char *p, int n)
+{
+	trace_sample();
+	TRACE(recv, r->id, n, 0);
+	if (!r->z) {
+		r->sz += n;
+		distribute_data(r);
+	} else if (compressed_input(r, p, n)) {
+		close_remote(r);
+	}
+	trace_sampled = 0;
+}
+
+static void accepted(struct remote *r)
+{
+	TRACE_IF(trace_every, accept, r->id, r->fd, 0);
+	add_remote(r);
+	if (cache) {
+		send_snapshot(r);
+	}
+	if (r->prev && !r->loop) {
+		read_more(r);
+	}
+}
+
+static void end_pass(void)
+{
+	if (loop_clients) {
+		loop_drain();
+	}
+	session_flush();
+	trunk_flush();
+	free_remotes();
+}
+
+static int loop_bench(void)
+{
+	if (lockstep || loop_clients < 2) {
+		fputs("vcand: -B needs 2 or more clients and no -l\n", stderr);
+		return 2;
+	}
+	struct remote **c = calloc(loop_clients, sizeof(*c));
+	for (int i = 0; i < loop_clients; i++) {
+		c[i] = new_remote((fd_t)-1);
+		c[i]->loop = 1;
+		c[i]->loop_room = LOOP_WINDOW;
+		c[i]->write = &loop_write;
+		accepted(c[i]);
+	}
+
+	enum { REC = 2 + sizeof(struct can_frame) };
+	static char batch[LOOP_BATCH * REC];
+	uint64_t frames = (uint64_t)loop_kframes * 1000;
+	uint64_t sent = 0, start = trace_now();
+	for (uint32_t seq = 0, i = 0; sent < frames;) {
+		for (int ev = 0; ev < LOOP_EVENTS && sent < frames; ev++) {
+			struct remote *r = c[i];
+			for (int k = 0; k < LOOP_BATCH; k++, seq++) {
+				uint16_t len = sizeof(struct can_frame);
+				struct can_frame f;
+				memset(&f, 0, sizeof(f));
+				f.can_id = (canid_t)(i << 4 | k % 16);
+				f.can_dlc = 8;
+				memcpy(f.data, &seq, sizeof(seq));
+				memcpy(batch + k * REC, &len, 2);
+				memcpy(batch + k * REC + 2, &f, sizeof(f));
+			}
+			input_room(r, r->sz + sizeof(batch));
+			memcpy(r->buf + r->sz, batch, sizeof(batch));
+			took_input(r, r->buf + r->sz, sizeof(batch));
+			sent += LOOP_BATCH;
+			i = (i + 1) % loop_clients;
+		}
+		end_pass();
+	}
+	double secs = (trace_now() - start) / 1e9;
+	uint64_t got = loop_bytes / REC;
+	printf("%llu frames to %d clients in %.3f s, %.1f ns a frame, "
+	       "%.2f M deliveries/s, %.0f%% queued\n",
+	       (unsigned long long)sent, loop_clients, secs, secs * 1e9 / sent,
+	       got / secs / 1e6,
+	       loop_bytes ? 100.0 * loop_queued / loop_bytes : 0.0);
+	for (int i = 0; i < loop_clients; i++) {
+		close_remote(c[i]);
+	}
+	free_remotes();
+	free(c);
+	return 0;
+}
+
+/*
+ * Back ends
+ *
+ * main and read_more run the same loop on every platform through a back end
+ * that knows how to wait, read and write: IOCP on Windows and epoll
+ * elsewhere. There is no io_uring back end.
+ *
+ *   io_open()          sets the back end up
+ *   io_listen(l)       reports l while connections wait on it
+ *   io_accept(l)       takes one, INVALID_SOCKET once there are none
+ *   io_add(r)          reports the connection r readable and writable
+ *   io_read(r, p, n)   reads up to n bytes to p, returning how many, 0 at the
+ *                      end, IO_AGAIN once there are none for now, or -1
+ *   sock_send          the write hook of connections
+ *   io_timer(due)      has io_wait return by tick due, or not if 0
+ *   io_wait(ev, n, t)  waits t ms, -1 for ever, for up to n events
+ *   io_close(r)        closes and forgets the connection r
+ *
+ * A connection is reported again once io_read has returned IO_AGAIN or
+ * sock_send took less than it was given, and not before. On Linux io_watch
+ * reports the other fds, such as timers and eventfds, that only the Linux
+ * features use.
+ */
+struct io_event {
+	struct source *s;
+	int events;
+};
+
+#define IO_IN 1
+#define IO_OUT 2
+#define IO_AGAIN (-2)
+#define IO_EVENTS 16
+
+#ifdef _WIN32
+/*
+ * IOCP back end
+ *
+ * Sockets are non-blocking and read and written directly, completions only
+ * telling the loop when to go on. Once a read would block a zero byte
+ * WSARecv is left pending, and once a write would block a copy of what was
+ * offered goes out as an overlapped WSASend. Their completions report the
+ * connection readable and writable. The OVERLAPPEDs live apart from the
+ * remote, so that a connection closed with I/O pending is freed once that
+ * completes. The listening socket is reported as its AcceptEx completes.
+ */
+#define IO_WRITE (64 * 1024)
+
+struct io_op {
+	OVERLAPPED ol;
+	struct io_conn *c;
+	int events;
+	int busy;
+};
+
+struct io_conn {
+	struct io_op rd, wr;
+	struct remote *r; /* NULL once closed */
+	char *wbuf;
+};
+
+static HANDLE iocp;
+static uint64_t io_due;
+static LPFN_ACCEPTEX acceptex;
+static SOCKET accept_fd = INVALID_SOCKET;
+static int accept_family, accept_done;
+static OVERLAPPED accept_ol;
+static char accept_addrs[2 * (16 + sizeof(struct sockaddr_in6))];
+
+/* timers run on every pass, this only wakes the loop */
+static void io_timer_ready(struct source *s, int events)
+{
+}
+
+static struct source io_timer_src = {&io_timer_ready};
+
+static int io_open(void)
+{
+	WSADATA wsa;
+	WSAStartup(MAKEWORD(2, 2), &wsa);
+	iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (!iocp) {
+		perror("CreateIoCompletionPort");
+		return -1;
+	}
+	return 0;
+}
+
+static int io_listen(struct listener *l)
+{
+	struct sockaddr_storage ss;
+	int len = sizeof(ss);
+	GUID guid = WSAID_ACCEPTEX;
+	DWORD sz;
+	if (getsockname(l->fd, (struct sockaddr *)&ss, &len) ||
+	    WSAIoctl(l->fd, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid,
+		     sizeof(guid), &acceptex, sizeof(acceptex), &sz, NULL,
+		     NULL) == SOCKET_ERROR) {
+		perror("get acceptex");
+		return -1;
+	}
+	if (!CreateIoCompletionPort((HANDLE)l->fd, iocp, (ULONG_PTR)&l->src,
+				    0) ||
+	    !SetFileCompletionNotificationModes(
+		    (HANDLE)l->fd, FILE_SKIP_COMPLETION_PORT_ON_SUCCESS)) {
+		perror("add to iocp");
+		return -1;
+	}
+	accept_family = ss.ss_family;
+	return 0;
+}
+
+static fd_t io_accept(struct listener *l)
+{
+	for (;;) {
+		if (accept_done) {
+			SOCKET fd = accept_fd;
+			accept_fd = INVALID_SOCKET;
+			accept_done = 0;
+			setsockopt(fd, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT,
+				   (char *)&l->fd, sizeof(l->fd));
+			return fd;
+		} else if (accept_fd != INVALID_SOCKET) {
+			/* still pending */
+			return INVALID_SOCKET;
+		}
+
+		accept_fd = WSASocket(accept_family, SOCK_STREAM, IPPROTO_TCP,
+				      NULL, 0, WSA_FLAG_OVERLAPPED);
+		if (accept_fd == INVALID_SOCKET) {
+			perror("accept");
+			exit(1);
+		}
+		DWORD addrsz;
+		memset(&accept_ol, 0, sizeof(accept_ol));
+		if (acceptex(l->fd, accept_fd, accept_addrs, 0,
+			     16 + sizeof(struct sockaddr_in6),
+			     16 + sizeof(struct sockaddr_in6), &addrsz,
+			     &accept_ol)) {
+			accept_done = 1;
+		} else if (WSAGetLastError() != WSA_IO_PENDING) {
+			perror("acceptex");
+			exit(1);
+		}
+	}
+}
+
+static void io_add(struct remote *r)
+{
+	struct io_conn *c = calloc(1, sizeof(*c));
+	c->rd.c = c;
+	c->rd.events = IO_IN;
+	c->wr.c = c;
+	c->wr.events = IO_OUT;
+	c->r = r;
+	r->io = c;
+
+	u_long one = 1;
+	if (ioctlsocket(r->fd, FIONBIO, &one) ||
+	    !CreateIoCompletionPort((HANDLE)r->fd, iocp, 0, 0) ||
+	    !SetFileCompletionNotificationModes(
+		    (HANDLE)r->fd, FILE_SKIP_COMPLETION_PORT_ON_SUCCESS)) {
+		perror("add to iocp");
+	}
+}
+
+static int io_read(struct remote *r, char *p, int n)
+{
+	struct io_conn *c = r->io;
+	for (;;) {
+		int got = recv(r->fd, p, n, 0);
+		if (got != SOCKET_ERROR) {
+			return got;
+		} else if (WSAGetLastError() != WSAEWOULDBLOCK) {
+			return -1;
+		} else if (c->rd.busy) {
+			return IO_AGAIN;
+		}
+
+		/* completes once there is something to read */
+		WSABUF b = {0, NULL};
+		DWORD flags = 0;
+		memset(&c->rd.ol, 0, sizeof(c->rd.ol));
+		if (!WSARecv(r->fd, &b, 1, NULL, &flags, &c->rd.ol, NULL)) {
+			continue;
+		} else if (WSAGetLastError() != WSA_IO_PENDING) {
+			return -1;
+		}
+		c->rd.busy = 1;
+		return IO_AGAIN;
+	}
+}
+
+static int sock_send(struct remote *t, const char *buf, int n)
+{
+	struct io_conn *c = t->io;
+	int done = 0;
+	if (c->wr.busy) {
+		return 0;
+	}
+	while (done < n) {
+		int sent = send(t->fd, buf + done, n - done, 0);
+		if (sent != SOCKET_ERROR) {
+			done += sent;
+			continue;
+		} else if (WSAGetLastError() != WSAEWOULDBLOCK) {
+			return -1;
+		}
+
+		/* full, a copy goes out once there is room */
+		int take = n - done < IO_WRITE ? n - done : IO_WRITE;
+		if (!c->wbuf) {
+			c->wbuf = malloc(IO_WRITE);
+		}
+		memcpy(c->wbuf, buf + done, take);
+		WSABUF b = {(ULONG)take, c->wbuf};
+		memset(&c->wr.ol, 0, sizeof(c->wr.ol));
+		if (WSASend(t->fd, &b, 1, NULL, 0, &c->wr.ol, NULL)) {
+			if (WSAGetLastError() != WSA_IO_PENDING) {
+				return -1;
+			}
+			c->wr.busy = 1;
+			return done + take;
+		}
+		done += take;
+	}
+	return done;
+}
+
+static void io_timer(uint64_t due)
+{
+	io_due = due;
+}
+
+static int io_wait(struct io_event *ev, int n, int timeout)
+{
+	OVERLAPPED_ENTRY oe[IO_EVENTS];
+	ULONG num;
+	DWORD ms = timeout < 0 ? INFINITE : (DWORD)timeout;
+	if (io_due) {
+		uint64_t now = wheel_clock();
+		uint64_t left = io_due > now ? io_due - now : 0;
+		ms = left < ms ? (DWORD)left : ms;
+	}
+	if (!GetQueuedCompletionStatusEx(iocp, oe,
+					 n < IO_EVENTS ? n : IO_EVENTS, &num,
+					 ms, FALSE)) {
+		if (GetLastError() != WAIT_TIMEOUT) {
+			return -1;
+		}
+		num = 0;
+	}
+
+	int got = 0;
+	for (ULONG i = 0; i < num; i++) {
+		if (oe[i].lpCompletionKey) {
+			/* the AcceptEx on a listening socket */
+			accept_done = 1;
+			ev[got].s = (struct source *)oe[i].lpCompletionKey;
+			ev[got++].events = IO_IN;
+			continue;
+		}
+		struct io_op *op = (struct io_op *)oe[i].lpOverlapped;
+		struct io_conn *c = op->c;
+		op->busy = 0;
+		if (c->r) {
+			ev[got].s = &c->r->src;
+			ev[got++].events = op->events;
+		} else if (!c->rd.busy && !c->wr.busy) {
+			free(c->wbuf);
+			free(c);
+		}
+	}
+	if (!got && io_due && wheel_clock() >= io_due) {
+		ev[got].s = &io_timer_src;
+		ev[got++].events = IO_IN;
+	}
+	return got;
+}
+
+static void io_close(struct remote *r)
+{
+	struct io_conn *c = r->io;
+	closesocket(r->fd);
+	if (c && (c->rd.busy || c->wr.busy)) {
+		/* the I/O cancelled by the close still completes */
+		c->r = NULL;
+	} else if (c) {
+		free(c->wbuf);
+		free(c);
+	}
+}
+#else
+/*
+ * SOCK_SEQPACKET clients (-s PATH)
+ *
+ * Every message costs the kernel a buffer of its own, so besides single
+ * records a client may send batches, and once it has it gets batches back.
+ * Single records go out up to SEQ_BATCH per sendmmsg, batches as messages of
+ * up to SEQ_CHUNK bytes. Buffers handed to sock_send hold whole records, so
+ * what is left queued after a short send always starts on a record. Input
+ * is taken up to SEQ_BATCH messages at a time with recvmmsg into a shared
+ * area and copied to the input buffer as records, leaving nothing partial
+ * behind.
+ */
+#define SEQ_BATCH 32
+#define SEQ_CHUNK 65536
+#define SEQ_MSG (4 + SEQ_CHUNK)
+/* batches going out are cut once past this, a record short of SEQ_CHUNK */
+#define SEQ_FILL (SEQ_CHUNK - 2 - VCAN_LEN_MASK)
+
+/* remote.seqpacket */
+#define SEQ_RECORDS 1
+#define SEQ_BATCHES 2
+
+static int seq_lfd = -1;
+
+static int seq_send(struct remote *t, const char *buf, int n)
+{
+	static const uint32_t ctrl = VCAN_SEQPACKET_CTRL;
+	static const uint32_t batch = VCAN_SEQPACKET_BATCH;
+	struct mmsghdr msgs[SEQ_BATCH];
+	struct iovec iov[2 * SEQ_BATCH];
+	int ends[SEQ_BATCH];
+	int sent = 0;
+	while (sent < n) {
+		int num = 0, off = sent;
+		memset(msgs, 0, sizeof(msgs));
+		while (off < n && num < SEQ_BATCH) {
+			uint16_t len;
+			memcpy(&len, buf + off, 2);
+			struct iovec *v = &iov[2 * num];
+			msgs[num].msg_hdr.msg_iov = v;
+			msgs[num].msg_hdr.msg_iovlen = 2;
+			if (t->seqpacket == SEQ_BATCHES) {
+				int end = off;
+				while (end < n && end - off <= SEQ_FILL) {
+					memcpy(&len, buf + end, 2);
+					end += 2 + (len & VCAN_LEN_MASK);
+				}
+				v[0].iov_base = (void *)&batch;
+				v[0].iov_len = 4;
+				v[1].iov_base = (char *)buf + off;
+				v[1].iov_len = end - off;
+				off = end;
+			} else {
+				v[0].iov_base = (void *)&ctrl;
+				v[0].iov_len = len & VCAN_CTRL ? 4 : 0;
+				v[1].iov_base = (char *)buf + off + 2;
+				v[1].iov_len = len & VCAN_LEN_MASK;
+				off += 2 + (len & VCAN_LEN_MASK);
+			}
+			ends[num++] = off;
+		}
+
+		int r = sendmmsg(t->fd, msgs, num, MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else if (r < 0) {
+			return -1;
+		} else if (r) {
+			sent = ends[r - 1];
+		}
+		if (r < num) {
+			break;
+		}
+	}
+	return sent;
+}
+
+/* Appends what arrived to r->buf as records, returning the bytes added, 0 if
+ * the client has gone or -1 with errno set. Empty batches are skipped. */
+static int seq_recv(struct remote *r)
+{
+	static char (*area)[SEQ_MSG];
+	static struct mmsghdr msgs[SEQ_BATCH];
+	static struct iovec iov[SEQ_BATCH];
+	if (!area) {
+		area = malloc(SEQ_BATCH * sizeof(*area));
+		for (int i = 0; i < SEQ_BATCH; i++) {
+			iov[i].iov_base = area[i];
+			iov[i].iov_len = SEQ_MSG;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+	}
+
+	int num;
+again:
+	/* a batch at a time for those sending them, to keep to the quota */
+	num = recvmmsg(r->fd, msgs, r->seqpacket == SEQ_BATCHES ? 1 : SEQ_BATCH,
+		       0, NULL);
+	if (num <= 0) {
+		return num;
+	}
+	int need = 0;
+	for (int i = 0; i < num; i++) {
+		need += 2 + msgs[i].msg_len;
+	}
+	input_room(r, r->sz + need);
+
+	char *p = r->buf + r->sz;
+	for (int i = 0; i < num; i++) {
+		const char *m = area[i];
+		int n = msgs[i].msg_len;
+		uint32_t id = 0;
+		if (!n) {
+			/* end of file, after the messages before it */
+			return p - (r->buf + r->sz);
+		} else if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			errno = EMSGSIZE;
+			return -1;
+		} else if (n >= 4) {
+			memcpy(&id, m, 4);
+		}
+
+		if (id == VCAN_SEQPACKET_BATCH) {
+			/* whole records only */
+			const char *e = m + n;
+			uint16_t len;
+			for (m += 4; e - m >= 2;) {
+				memcpy(&len, m, 2);
+				if (e - m < 2 + (len & VCAN_LEN_MASK)) {
+					break;
+				}
+				m += 2 + (len & VCAN_LEN_MASK);
+			}
+			if (m != e) {
+				errno = EPROTO;
+				return -1;
+			}
+			memcpy(p, area[i] + 4, n - 4);
+			p += n - 4;
+			r->seqpacket = SEQ_BATCHES;
+			continue;
+		}
+
+		uint16_t len = 0;
+		if (id == VCAN_SEQPACKET_CTRL) {
+			m += 4;
+			n -= 4;
+			len = VCAN_CTRL;
+		}
+		if (n > VCAN_LEN_MASK) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		len |= n;
+		memcpy(p, &len, 2);
+		memcpy(p + 2, m, n);
+		p += 2 + n;
+	}
+	if (p == r->buf + r->sz) {
+		goto again;
+	}
+	return p - (r->buf + r->sz);
+}
+
+/*
+ * epoll back end
+ *
+ * Connections are edge triggered. Listening sockets and the other fds are
+ * level triggered, their handlers taking what is there. Ticks are waited for
+ * on a timerfd, armed for the next tick with work.
+ */
+static int io_efd = -1, io_tfd = -1;
+static uint64_t io_armed;
+
+static void io_timer_ready(struct source *s, int events)
+{
+	uint64_t expirations;
+	if (read(io_tfd, &expirations, 8) < 0 && errno != EAGAIN) {
+		perror("timerfd");
+	}
+}
+
+static struct source io_timer_src = {&io_timer_ready};
+
+static int io_watch(fd_t fd, struct source *s)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = s,
+	};
+	if (epoll_ctl(io_efd, EPOLL_CTL_ADD, fd, &ev)) {
+		perror("epoll");
+		return -1;
+	}
+	return 0;
+}
+
+static int io_open(void)
+{
+	io_efd = epoll_create1(0);
+	if (io_efd < 0) {
+		perror("epoll");
+		return -1;
+	}
+	io_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (io_tfd < 0) {
+		perror("timerfd");
+		return -1;
+	} else if (io_watch(io_tfd, &io_timer_src)) {
+		return -1;
+	}
+
+#ifdef EPIOCSPARAMS
+	if (busy_poll) {
+		struct epoll_params params = {
+			.busy_poll_usecs = 50,
+			.busy_poll_budget = 8,
+			.prefer_busy_poll = 1,
+		};
+		ioctl(io_efd, EPIOCSPARAMS, &params);
+	}
+#endif
+	return 0;
+}
+
+static int io_listen(struct listener *l)
+{
+	return io_watch(l->fd, &l->src);
+}
+
+static fd_t io_accept(struct listener *l)
+{
+	for (;;) {
+		int fd = accept(l->fd, NULL, NULL);
+		if (fd < 0 && errno == EINTR) {
+			continue;
+		} else if (fd < 0 && errno == EAGAIN) {
+			return INVALID_SOCKET;
+		} else if (fd < 0) {
+			perror("accept");
+			exit(1);
+		}
+		return fd;
+	}
+}
+
+static void io_add(struct remote *r)
+{
+	fcntl(r->fd, F_SETFL, O_NONBLOCK);
+	if (busy_poll) {
+		busy_poll_socket(r->fd);
+	}
+	if (r->seqpacket) {
+		r->write = &seq_send;
+	}
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLOUT | EPOLLET,
+		.data.ptr = &r->src,
+	};
+	epoll_ctl(io_efd, EPOLL_CTL_ADD, r->fd, &ev);
+}
+
+/* SOCK_SEQPACKET input is appended to r->buf as records rather than to p */
+static int io_read(struct remote *r, char *p, int n)
+{
+	int got;
+	do {
+		got = r->seqpacket ? seq_recv(r)
+				   : recv(r->fd, p, n, MSG_NOSIGNAL);
+	} while (got < 0 && errno == EINTR);
+	return got < 0 && errno == EAGAIN ? IO_AGAIN : got;
+}
+
+static int sock_send(struct remote *t, const char *buf, int n)
+{
+	int r;
+	do {
+		r = send(t->fd, buf, n, MSG_NOSIGNAL);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 0;
+	}
+	return r;
+}
+
+static void io_timer(uint64_t due)
+{
+	if (due != io_armed) {
+		io_armed = due;
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = due * TICK_NS / 1000000000;
+		its.it_value.tv_nsec = due * TICK_NS % 1000000000;
+		timerfd_settime(io_tfd, TFD_TIMER_ABSTIME, &its, NULL);
+	}
+}
+
+static int io_wait(struct io_event *ev, int n, int timeout)
+{
+	struct epoll_event e[IO_EVENTS];
+	int num = epoll_wait(io_efd, e, n < IO_EVENTS ? n : IO_EVENTS,
+			     timeout);
+	if (num < 0 && errno == EINTR) {
+		return 0;
+	}
+	for (int i = 0; i < num; i++) {
+		ev[i].s = e[i].data.ptr;
+		ev[i].events = (e[i].events & EPOLLOUT ? IO_OUT : 0) |
+			       (e[i].events & ~EPOLLOUT ? IO_IN : 0);
+	}
+	return num;
+}
+
+static void io_close(struct remote *r)
+{
+	close(r->fd);
+}
+#endif
+
+/*
+ * Fair reading
+ *
+ * Connections are edge triggered, so one has to be read until IO_AGAIN
+ * before the back end reports it again. Rather than drain one client while
+ * the rest wait, read_more stops once it has read the quota and puts the
+ * connection on the ready list. Each pass of the loop then polls without
+ * blocking and gives every connection on the list, in the order they went
+ * on, another quota. Trunks carry the traffic of a whole daemon and get
+ * TRUNK_WEIGHT times as much.
+ */
+#define TRUNK_WEIGHT 8
+
+static struct remote *ready_head, **ready_tail = &ready_head;
+
+static void ready_push(struct remote *r)
+{
+	r->ready = 1;
+	r->ready_next = NULL;
+	*ready_tail = r;
+	ready_tail = &r->ready_next;
+}
+
+static void ready_remove(struct remote *r)
+{
+	for (struct remote **pp = &ready_head; *pp; pp = &(*pp)->ready_next) {
+		if (*pp == r) {
+			*pp = r->ready_next;
+			if (ready_tail == &r->ready_next) {
+				ready_tail = pp;
+			}
+			break;
+		}
+	}
+	r->ready = 0;
+}
+
+static void read_more(struct remote *r)
+{
+	char zbuf[4096];
+	int quota = read_quota * (r->trunk ? TRUNK_WEIGHT : 1);
+	for (;;) {
+		if (!r->z) {
+			fit_record(r);
+		}
+		/* io_read appends SOCK_SEQPACKET input to r->buf itself and
+		 * may move it */
+		char *p = r->seqpacket ? NULL : r->z ? zbuf : r->buf + r->sz;
+		int cap = r->z ? sizeof(zbuf) : r->cap - r->sz;
+		int n = io_read(r, p, cap);
+		if (n == IO_AGAIN) {
+			break;
+		} else if (n < 0) {
+			perror("recv");
+			close_remote(r);
+			return;
+		} else if (!n) {
+			close_remote(r);
+			return;
+		}
+		took_input(r, p, n);
+		if (!r->prev) {
+			return;
+		} else if (read_quota && (quota -= n) <= 0) {
+			ready_push(r);
+			return;
+		}
+	}
+}
+
+/* Gives each connection that was left with data another quota. Those that
+ * use it up again go to the back of the list. Ones closed meanwhile were
+ * taken off the list but not yet freed. */
+static void read_ready(void)
+{
+	struct remote *r = ready_head;
+	ready_head = NULL;
+	ready_tail = &ready_head;
+	while (r) {
+		struct remote *next = r->ready_next;
+		if (r->ready) {
+			r->ready = 0;
+			read_more(r);
+		}
+		r = next;
+	}
+}
+
+/* Connections closed earlier in the pass are only freed at its end */
+static void conn_ready(struct source *s, int events)
+{
+	struct remote *r = (struct remote *)s;
+	if ((events & IO_OUT) && r->prev && flush_output(r)) {
+		close_remote(r);
+	}
+	if ((events & IO_IN) && r->prev && !r->ready) {
+		read_more(r);
+	}
+}
+
+static void accept_ready(struct source *s, int events)
+{
+	struct listener *l = (struct listener *)s;
+	fd_t fd;
+	while ((fd = io_accept(l)) != INVALID_SOCKET) {
+		struct remote *r = new_remote(fd);
+		r->seqpacket = l->seqpacket;
+		io_add(r);
+		accepted(r);
+	}
+}
+
+static struct listener listener = {{&accept_ready}, INVALID_SOCKET, 0};
+
+#ifndef _WIN32
+static struct listener seq_listener = {{&accept_ready}, -1, SEQ_RECORDS};
+
+static void trunk_dial(struct wheel *w, struct timer *t)
+{
+	struct trunk_link *l = (struct trunk_link *)t;
+	struct addrinfo *ai, *res;
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+
+	int fd = -1;
+	if (!getaddrinfo(l->host, l->port, &hints, &res)) {
+		for (ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+			fd = socket(ai->ai_family,
+				    ai->ai_socktype | SOCK_NONBLOCK,
+				    ai->ai_protocol);
+			if (fd >= 0 &&
+			    connect(fd, ai->ai_addr, ai->ai_addrlen) &&
+			    errno != EINPROGRESS) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		freeaddrinfo(res);
+	}
+	if (fd < 0) {
+		timer_start(w, t, w->now + TRUNK_REDIAL_TICKS);
+		return;
+	}
+
+	struct remote *r = new_remote(fd);
+	TRACE_IF(trace_every, accept, r->id, fd, 0);
+	io_add(r);
+	add_remote(r);
+	trunk_open(r, t);
+}
+
+/*
+ * Multicast bus (-m GROUP PORT)
+ *
+ * Joins vcand daemons on other hosts into one bus over UDP multicast. The
+ * group socket is a remote of its own so that it gets the same fanout as a
+ * client. Frames to it are batched and sent once per loop as datagrams
+ * numbered per sender, the last MC_HISTORY of which are kept to resend.
+ *
+ * Receivers hold datagrams that arrive early and NACK the gaps every
+ * MC_NACK_TICKS. A gap that is still open after MC_NACK_TRIES, or that the
+ * sender answers with VCAN_MC_LOST, is skipped and reported as lost. Idle
+ * senders send a heartbeat with their next sequence number so that losing
+ * the last datagram of a burst is noticed too.
+ *
+ * A frame too large for MC_DATAGRAM, such as a long CAN XL frame, is sent in
+ * a datagram of its own and left to IP fragmentation.
+ */
+#define MC_DATAGRAM 1472 /* largest unfragmented UDP payload on Ethernet */
+#define MC_PAYLOAD (MC_DATAGRAM - (int)sizeof(struct vcan_mcast))
+#define MC_MAX_DATAGRAM ((int)sizeof(struct vcan_mcast) + 2 + VCAN_LEN_MASK)
+#define MC_HISTORY 1024
+#define MC_WINDOW 1024
+#define MC_PEERS 64
+#define MC_NACK_DELAY 2
+#define MC_NACK_TICKS 20
+#define MC_NACK_TRIES 5
+#define MC_HEARTBEAT_TICKS 100
+
+struct mc_peer {
+	struct timer nack;
+	int used, tries;
+	uint32_t id;
+	uint32_t next, high;
+	uint64_t heard;
+	uint16_t held_len[MC_WINDOW];
+	char *held[MC_WINDOW];
+};
+
+static struct sockaddr_storage mc_group;
+static socklen_t mc_grouplen;
+static uint32_t mc_seq, mc_kept;
+static struct scratch mc_history[MC_HISTORY];
+static uint16_t mc_history_len[MC_HISTORY];
+static char mc_batch[2 + VCAN_LEN_MASK];
+static int mc_batch_sz;
+static int mc_idle;
+static struct timer mc_heartbeat;
+static struct mc_peer mc_peers[MC_PEERS];
+
+static void mc_write(const void *buf, int n)
+{
+	/* a datagram dropped here is recovered like one lost on the wire */
+	while (sendto(mc_remote->fd, buf, n, 0, (struct sockaddr *)&mc_group,
+		      mc_grouplen) < 0 &&
+	       errno == EINTR) {
+	}
+}
+
+static void mc_ctrl(int type, uint32_t source, uint32_t seq, uint32_t count)
+{
+	struct vcan_mcast h;
+	memset(&h, 0, sizeof(h));
+	h.magic = VCAN_MC_MAGIC;
+	h.type = type;
+	h.sender = daemon_id;
+	h.source = source;
+	h.seq = seq;
+	h.count = count;
+	mc_write(&h, sizeof(h));
+}
+
+static void mc_flush(void)
+{
+	if (!mc_batch_sz) {
+		return;
+	}
+
+	uint32_t seq = mc_seq++;
+	char *d = reserve(&mc_history[seq % MC_HISTORY],
+			  sizeof(struct vcan_mcast) + mc_batch_sz);
+	struct vcan_mcast h;
+	memset(&h, 0, sizeof(h));
+	h.magic = VCAN_MC_MAGIC;
+	h.type = VCAN_MC_DATA;
+	h.sender = daemon_id;
+	h.source = daemon_id;
+	h.seq = seq;
+	memcpy(d, &h, sizeof(h));
+	memcpy(d + sizeof(h), mc_batch, mc_batch_sz);
+	mc_history_len[seq % MC_HISTORY] = sizeof(h) + mc_batch_sz;
+	if (mc_kept < MC_HISTORY) {
+		mc_kept++;
+	}
+
+	TRACE(send, 0, mc_remote->id, mc_batch_sz);
+	mc_write(d, sizeof(h) + mc_batch_sz);
+	mc_batch_sz = 0;
+	mc_idle = 0;
+}
+
+static int mc_send(struct remote *t, const char *buf, int n)
+{
+	const char *e = buf + n;
+	while (buf < e) {
+		uint16_t len;
+		memcpy(&len, buf, 2);
+		int sz = 2 + (len & VCAN_LEN_MASK);
+		if (!(len & VCAN_CTRL)) {
+			if (mc_batch_sz && mc_batch_sz + sz > MC_PAYLOAD) {
+				mc_flush();
+			}
+			memcpy(mc_batch + mc_batch_sz, buf, sz);
+			mc_batch_sz += sz;
+		}
+		buf += sz;
+	}
+	return 0;
+}
+
+static void mc_resend(uint32_t seq, uint32_t count)
+{
+	uint32_t oldest = mc_seq - mc_kept;
+	if ((int32_t)(seq - oldest) < 0) {
+		uint32_t gone = oldest - seq;
+		if (gone > count) {
+			gone = count;
+		}
+		mc_ctrl(VCAN_MC_LOST, daemon_id, seq, gone);
+		seq += gone;
+		count -= gone;
+	}
+	for (; count && seq != mc_seq; seq++, count--) {
+		mc_write(mc_history[seq % MC_HISTORY].p,
+			 mc_history_len[seq % MC_HISTORY]);
+	}
+}
+
+static void mc_heartbeat_fire(struct wheel *w, struct timer *t)
+{
+	if (mc_idle) {
+		mc_ctrl(VCAN_MC_HEARTBEAT, daemon_id, mc_seq, 0);
+	}
+	mc_idle = 1;
+	timer_start(w, t, w->now + MC_HEARTBEAT_TICKS);
+}
+
+static void mc_deliver(char *p, int n)
+{
+	if (valid_records(p, n)) {
+		forward_frames(mc_remote, p, n);
+	}
+}
+
+/* end of the part of [next, high) that fits in the window */
+static uint32_t mc_window_end(struct mc_peer *p)
+{
+	return p->high - p->next > MC_WINDOW ? p->next + MC_WINDOW : p->high;
+}
+
+static void mc_drain(struct mc_peer *p)
+{
+	for (;;) {
+		int i = p->next % MC_WINDOW;
+		if (!p->held[i]) {
+			break;
+		}
+		mc_deliver(p->held[i], p->held_len[i]);
+		free(p->held[i]);
+		p->held[i] = NULL;
+		p->next++;
+	}
+
+	if ((int32_t)(p->high - p->next) <= 0) {
+		p->high = p->next;
+		p->tries = 0;
+		timer_stop(&wheel, &p->nack);
+	} else if (!timer_active(&p->nack)) {
+		timer_start(&wheel, &p->nack, wheel.now + MC_NACK_DELAY);
+	}
+}
+
+/* Moves p on to seq, delivering what is held and counting the rest lost */
+static void mc_skip(struct mc_peer *p, uint32_t seq)
+{
+	uint32_t gap = seq - p->next;
+	uint32_t lost = 0;
+	if ((int32_t)gap <= 0) {
+		return;
+	}
+	for (uint32_t k = 0; k < gap && k < MC_WINDOW; k++) {
+		int i = p->next % MC_WINDOW;
+		if (p->held[i]) {
+			mc_deliver(p->held[i], p->held_len[i]);
+			free(p->held[i]);
+			p->held[i] = NULL;
+		} else {
+			lost++;
+		}
+		p->next++;
+	}
+	if (gap > MC_WINDOW) {
+		lost += gap - MC_WINDOW;
+		p->next = seq;
+	}
+	if (lost) {
+		fprintf(stderr, "vcand: lost %u datagrams from %08x\n", lost,
+			p->id);
+	}
+	p->tries = 0;
+	mc_drain(p);
+}
+
+static void mc_nack_fire(struct wheel *w, struct timer *t)
+{
+	struct mc_peer *p = (struct mc_peer *)t;
+	uint32_t end = mc_window_end(p);
+
+	if (++p->tries > MC_NACK_TRIES) {
+		/* give up on the first gap and carry on after it */
+		uint32_t s = p->next;
+		while (s != end && !p->held[s % MC_WINDOW]) {
+			s++;
+		}
+		mc_skip(p, s);
+		return;
+	}
+
+	for (uint32_t s = p->next; s != end;) {
+		if (p->held[s % MC_WINDOW]) {
+			s++;
+			continue;
+		}
+		uint32_t e = s;
+		while (e != end && !p->held[e % MC_WINDOW]) {
+			e++;
+		}
+		mc_ctrl(VCAN_MC_NACK, p->id, s, e - s);
+		s = e;
+	}
+	timer_start(w, t, w->now + MC_NACK_TICKS);
+}
+
+/* Finds the peer for id, replacing the one heard from least recently if
+ * create is set and it is new. New peers start at seq. */
+static struct mc_peer *mc_peer(uint32_t id, uint32_t seq, int create)
+{
+	struct mc_peer *victim = NULL;
+	for (int i = 0; i < MC_PEERS; i++) {
+		struct mc_peer *p = &mc_peers[i];
+		if (p->used && p->id == id) {
+			p->heard = trace_now();
+			return p;
+		} else if (!victim || (victim->used &&
+				       (!p->used || p->heard < victim->heard))) {
+			victim = p;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	struct mc_peer *p = victim;
+	timer_stop(&wheel, &p->nack);
+	for (int i = 0; i < MC_WINDOW; i++) {
+		free(p->held[i]);
+		p->held[i] = NULL;
+	}
+	p->nack.fn = &mc_nack_fire;
+	p->used = 1;
+	p->tries = 0;
+	p->id = id;
+	p->next = seq;
+	p->high = seq;
+	p->heard = trace_now();
+	return p;
+}
+
+static void mc_data(struct mc_peer *p, uint32_t seq, char *buf, int n)
+{
+	if ((int32_t)(seq - p->next) < 0) {
+		return;
+	} else if (seq - p->next >= MC_WINDOW) {
+		mc_skip(p, seq - MC_WINDOW + 1);
+	}
+
+	if ((int32_t)(seq + 1 - p->high) > 0) {
+		p->high = seq + 1;
+	}
+
+	if (seq == p->next) {
+		p->next++;
+		p->tries = 0;
+		mc_deliver(buf, n);
+	} else if (!p->held[seq % MC_WINDOW]) {
+		p->held[seq % MC_WINDOW] = malloc(n);
+		p->held_len[seq % MC_WINDOW] = n;
+		memcpy(p->held[seq % MC_WINDOW], buf, n);
+	}
+	mc_drain(p);
+}
+
+static void mc_read(void)
+{
+	static char buf[MC_MAX_DATAGRAM];
 	for (;;) {
-		int fd = accept(lfd, NULL, NULL);
-		if (fd < 0 && errno == EINTR) {
+		int n = recv(mc_remote->fd, buf, sizeof(buf), MSG_TRUNC);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			break;
+		}
+
+		struct vcan_mcast h;
+		if (n < sizeof(h) || n > sizeof(buf)) {
+			continue;
+		}
+		memcpy(&h, buf, sizeof(h));
+		if (h.magic != VCAN_MC_MAGIC || h.sender == daemon_id) {
+			continue;
+		}
+
+		trace_sample();
+		TRACE(recv, mc_remote->id, n, h.sender);
+		struct mc_peer *p;
+		switch (h.type) {
+		case VCAN_MC_DATA:
+			p = mc_peer(h.source, h.seq, 1);
+			mc_data(p, h.seq, buf + sizeof(h), n - sizeof(h));
+			break;
+		case VCAN_MC_HEARTBEAT:
+			p = mc_peer(h.source, h.seq, 1);
+			if ((int32_t)(h.seq - p->high) > 0) {
+				p->high = h.seq;
+			}
+			mc_drain(p);
+			break;
+		case VCAN_MC_LOST:
+			p = mc_peer(h.source, h.seq, 0);
+			if (p && (int32_t)(h.seq - p->next) <= 0) {
+				mc_skip(p, h.seq + h.count);
+			}
+			break;
+		case VCAN_MC_NACK:
+			if (h.source == daemon_id) {
+				mc_resend(h.seq, h.count);
+			}
+			break;
+		}
+		trace_sampled = 0;
+	}
+}
+
+static void mc_ready(struct source *s, int events)
+{
+	mc_read();
+}
+
+static int mc_open(void)
+{
+	struct addrinfo *res;
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+	if (getaddrinfo(mc_addr, mc_port, &hints, &res)) {
+		perror("getaddrinfo");
+		return -1;
+	}
+	memcpy(&mc_group, res->ai_addr, res->ai_addrlen);
+	mc_grouplen = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	unsigned ifindex = 0;
+	if (mc_ifname && !(ifindex = if_nametoindex(mc_ifname))) {
+		perror("multicast interface");
+		return -1;
+	}
+
+	int fd = socket(mc_group.ss_family, SOCK_DGRAM | SOCK_NONBLOCK,
+			IPPROTO_UDP);
+	int one = 1;
+	int rcvbuf = 1 << 20;
+	if (fd < 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
+		perror("multicast socket");
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	/* binding to the group keeps out other traffic to the port */
+	int err = bind(fd, (struct sockaddr *)&mc_group, mc_grouplen);
+	if (!err && mc_group.ss_family == AF_INET) {
+		struct ip_mreqn mreq;
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.imr_multiaddr = ((struct sockaddr_in *)&mc_group)->sin_addr;
+		mreq.imr_ifindex = ifindex;
+		err = setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+				 sizeof(mreq)) ||
+		      setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq,
+				 sizeof(mreq));
+	} else if (!err) {
+		struct sockaddr_in6 *sa = (struct sockaddr_in6 *)&mc_group;
+		struct ipv6_mreq mreq;
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.ipv6mr_multiaddr = sa->sin6_addr;
+		mreq.ipv6mr_interface = ifindex ? ifindex : sa->sin6_scope_id;
+		err = setsockopt(fd, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, &mreq,
+				 sizeof(mreq)) ||
+		      setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+				 &mreq.ipv6mr_interface,
+				 sizeof(mreq.ipv6mr_interface));
+	}
+	if (err) {
+		perror("join group");
+		return -1;
+	}
+	if (busy_poll) {
+		busy_poll_socket(fd);
+	}
+
+	mc_remote = new_remote(fd);
+	mc_remote->src.ready = &mc_ready;
+	mc_remote->send = &mc_send;
+	add_remote(mc_remote);
+	if (io_watch(fd, &mc_remote->src)) {
+		return -1;
+	}
+
+	mc_idle = 1;
+	mc_heartbeat.fn = &mc_heartbeat_fire;
+	timer_start(&wheel, &mc_heartbeat, wheel.now + MC_HEARTBEAT_TICKS);
+	return 0;
+}
+
+/*
+ * Plugins (-P PATH[:ARG], -W N)
+ *
+ * Each plugin is a remote without a socket. Records sent to it go to its
+ * recv callback, and records it sends are appended to its input buffer and
+ * run through distribute_data once per loop, so that a plugin sending from
+ * within a callback never re-enters the fanout.
+ *
+ * Worker plugins are spread over the -W threads, each plugin getting a
+ * single producer, single consumer ring in either direction. A worker with
+ * nothing to do says so and then checks its rings once more before sleeping
+ * on an eventfd, which the loop only writes to if it saw the worker asleep.
+ * The loop is likewise only woken once between looks at the rings.
+ */
+#define PLUGIN_RING (1 << 20)
+#define PLUGIN_ROUNDS 8
+#define PLUGIN_BATCH 64
+
+struct ring {
+	_Atomic uint64_t head; /* advanced by the producer */
+	char __pad[56];
+	_Atomic uint64_t tail; /* advanced by the consumer */
+	char __pad2[56];
+	char *buf;
+};
+
+enum {
+	PM_RECV = 1,
+	PM_TIMER,
+	PM_MEMBER,
+	PM_SEND,
+	PM_SET_TIMER,
+};
+
+struct pm_hdr {
+	uint32_t type;
+	uint32_t len; /* of the payload that follows */
+	uint64_t arg; /* the time, or the id and joined bit for PM_MEMBER */
+};
+
+struct worker {
+	pthread_t thread;
+	int efd;
+	_Atomic int sleeping;
+	int n;
+	struct plugin *plugins[MAX_PLUGINS];
+};
+
+struct plugin {
+	struct timer timer;
+	struct vcand_plugin p;
+	struct remote *r;
+	struct worker *w;
+	struct ring in, out; /* to and from the worker */
+	_Atomic uint64_t dropped;
+	uint64_t now;
+};
+
+static struct plugin plugins[MAX_PLUGINS];
+static struct worker workers[MAX_WORKERS];
+static int loop_efd = -1;
+static _Atomic int loop_kicked;
+static int plugins_dirty;
+
+static void ring_write(struct ring *q, uint64_t at, const void *p, uint32_t n)
+{
+	uint32_t off = at & (PLUGIN_RING - 1);
+	uint32_t first = PLUGIN_RING - off < n ? PLUGIN_RING - off : n;
+	memcpy(q->buf + off, p, first);
+	memcpy(q->buf, (const char *)p + first, n - first);
+}
+
+static void ring_read(struct ring *q, uint64_t at, void *p, uint32_t n)
+{
+	uint32_t off = at & (PLUGIN_RING - 1);
+	uint32_t first = PLUGIN_RING - off < n ? PLUGIN_RING - off : n;
+	memcpy(p, q->buf + off, first);
+	memcpy((char *)p + first, q->buf, n - first);
+}
+
+static uint32_t ring_size(const struct pm_hdr *h)
+{
+	return (sizeof(*h) + h->len + 7) & ~7U;
+}
+
+static int ring_put(struct ring *q, const struct pm_hdr *h, const void *p)
+{
+	uint64_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	if (PLUGIN_RING - (head - tail) < ring_size(h)) {
+		return -1;
+	}
+	ring_write(q, head, h, sizeof(*h));
+	ring_write(q, head + sizeof(*h), p, h->len);
+	atomic_store_explicit(&q->head, head + ring_size(h),
+			      memory_order_release);
+	return 0;
+}
+
+/* Returns the payload of the next message, valid until ring_next, with the
+ * header in *h. Payloads that wrap around are copied to s. */
+static const char *ring_peek(struct ring *q, struct pm_hdr *h,
+			     struct scratch *s)
+{
+	uint64_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	if (tail == atomic_load_explicit(&q->head, memory_order_acquire)) {
+		return NULL;
+	}
+	ring_read(q, tail, h, sizeof(*h));
+	uint32_t off = (tail + sizeof(*h)) & (PLUGIN_RING - 1);
+	if (off + h->len <= PLUGIN_RING) {
+		return q->buf + off;
+	}
+	char *p = reserve(s, h->len);
+	ring_read(q, tail + sizeof(*h), p, h->len);
+	return p;
+}
+
+static void ring_next(struct ring *q, const struct pm_hdr *h)
+{
+	uint64_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	atomic_store_explicit(&q->tail, tail + ring_size(h),
+			      memory_order_release);
+}
+
+static int ring_empty(struct ring *q)
+{
+	return atomic_load(&q->tail) == atomic_load(&q->head);
+}
+
+static void kick_loop(void)
+{
+	uint64_t one = 1;
+	if (!atomic_exchange(&loop_kicked, 1) &&
+	    write(loop_efd, &one, sizeof(one)) < 0) {
+		perror("plugin wakeup");
+	}
+}
+
+static uint64_t plugin_clock(void)
+{
+	return lockstep ? vclock : trace_now();
+}
+
+/* Passes a message to a worker plugin, dropping it if the ring is full */
+static void plugin_post(struct plugin *pl, const struct pm_hdr *h,
+			const void *p)
+{
+	if (ring_put(&pl->in, h, p)) {
+		atomic_fetch_add(&pl->dropped, 1);
+		return;
+	}
+	/* pairs with the worker saying it sleeps before a last look */
+	atomic_thread_fence(memory_order_seq_cst);
+	uint64_t one = 1;
+	if (atomic_load(&pl->w->sleeping) &&
+	    write(pl->w->efd, &one, sizeof(one)) < 0) {
+		perror("plugin wakeup");
+	}
+}
+
+/* Runs the plugin's callback for a message, on whichever thread it runs */
+static void plugin_dispatch(struct plugin *pl, const struct pm_hdr *h,
+			    const char *p)
+{
+	switch (h->type) {
+	case PM_RECV:
+		pl->now = h->arg;
+		pl->p.recv(pl->p.ctx, h->arg, p, h->len);
+		break;
+	case PM_TIMER:
+		pl->now = h->arg;
+		pl->p.timer(pl->p.ctx, h->arg);
+		break;
+	case PM_MEMBER:
+		pl->p.member(pl->p.ctx, (unsigned)(h->arg >> 1), h->arg & 1);
+		break;
+	}
+}
+
+static void plugin_call(struct plugin *pl, const struct pm_hdr *h,
+			const void *p)
+{
+	if (pl->w) {
+		plugin_post(pl, h, p);
+	} else {
+		plugin_dispatch(pl, h, p);
+	}
+}
+
+static int plugin_recv(struct remote *t, const char *buf, int n)
+{
+	struct plugin *pl = t->plugin;
+	struct pm_hdr h = {PM_RECV, n, plugin_clock()};
+	if (pl->p.recv) {
+		plugin_call(pl, &h, buf);
+	}
+	return 0;
+}
+
+static void plugin_fire(struct wheel *w, struct timer *t)
+{
+	struct plugin *pl = (struct plugin *)t;
+	struct pm_hdr h = {PM_TIMER, 0, t->expires * TICK_NS};
+	if (pl->p.timer) {
+		plugin_call(pl, &h, NULL);
+	}
+}
+
+/* Tells the plugins that r joined or left the bus */
+static void plugin_member(struct remote *r, int joined)
+{
+	if (r->plugin || r == mc_remote) {
+		return;
+	}
+	struct pm_hdr h = {PM_MEMBER, 0, (uint64_t)r->id << 1 | !!joined};
+	for (int i = 0; i < nplugins; i++) {
+		struct plugin *pl = &plugins[i];
+		if (pl->r && pl->p.member) {
+			plugin_call(pl, &h, NULL);
+		}
+	}
+}
+
+static void plugin_set_timer(struct plugin *pl, uint64_t ns)
+{
+	if (!ns) {
+		timer_stop(&wheel, &pl->timer);
+		return;
+	} else if (!wheel.count) {
+		wheel.now = wheel_clock();
+	}
+	timer_start(&wheel, &pl->timer, ns_to_ticks(ns));
+}
+
+/* Appends records from the plugin to its input, run on the loop thread */
+static int plugin_input(struct plugin *pl, const char *recs, int n)
+{
+	struct remote *r = pl->r;
+	if (r->sz + n > MAX_QUEUE) {
+		return -1;
+	} else if (r->sz + n > r->cap) {
+		input_room(r, 2 * (r->sz + n));
+	}
+	memcpy(r->buf + r->sz, recs, n);
+	r->sz += n;
+	plugins_dirty = 1;
+	return 0;
+}
+
+static int host_send(struct vcand_host *h, const void *recs, int n)
+{
+	struct plugin *pl = (struct plugin *)h;
+	const char *p = recs;
+	int off = 0;
+	while (off + 2 <= n) {
+		uint16_t len;
+		memcpy(&len, p + off, 2);
+		off += 2 + (len & VCAN_LEN_MASK);
+	}
+	if (n <= 0 || off != n) {
+		return -1;
+	} else if (!pl->w) {
+		return plugin_input(pl, recs, n);
+	}
+
+	struct pm_hdr m = {PM_SEND, n, 0};
+	if (ring_put(&pl->out, &m, recs)) {
+		return -1;
+	}
+	kick_loop();
+	return 0;
+}
+
+static void host_set_timer(struct vcand_host *h, uint64_t ns)
+{
+	struct plugin *pl = (struct plugin *)h;
+	struct pm_hdr m = {PM_SET_TIMER, 0, ns};
+	if (!pl->w) {
+		plugin_set_timer(pl, ns);
+	} else if (!ring_put(&pl->out, &m, NULL)) {
+		kick_loop();
+	}
+}
+
+static uint64_t host_now(struct vcand_host *h)
+{
+	return ((struct plugin *)h)->now;
+}
+
+static uint64_t host_dropped(struct vcand_host *h)
+{
+	return atomic_load(&((struct plugin *)h)->dropped);
+}
+
+static const struct vcand_host_api host_api = {
+	VCAND_PLUGIN_ABI, &host_send, &host_set_timer, &host_now, &host_dropped,
+};
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct scratch s = {NULL, 0};
+	for (;;) {
+		int busy = 0;
+		for (int i = 0; i < w->n; i++) {
+			struct plugin *pl = w->plugins[i];
+			struct pm_hdr h;
+			const char *p;
+			for (int k = 0; k < PLUGIN_BATCH &&
+					(p = ring_peek(&pl->in, &h, &s));
+			     k++) {
+				plugin_dispatch(pl, &h, p);
+				ring_next(&pl->in, &h);
+				busy = 1;
+			}
+		}
+		if (busy) {
+			continue;
+		}
+
+		atomic_store(&w->sleeping, 1);
+		for (int i = 0; i < w->n && !busy; i++) {
+			busy = !ring_empty(&w->plugins[i]->in);
+		}
+		uint64_t v;
+		if (!busy && read(w->efd, &v, sizeof(v)) < 0 &&
+		    errno != EINTR) {
+			perror("plugin worker");
+			return NULL;
+		}
+		atomic_store(&w->sleeping, 0);
+	}
+}
+
+/* Takes in what the plugins sent and runs it through the fanout */
+static void plugin_flush(void)
+{
+	static struct scratch s;
+	if (!nplugins) {
+		return;
+	}
+	atomic_store(&loop_kicked, 0);
+	for (int round = 0; round < PLUGIN_ROUNDS; round++) {
+		plugins_dirty = 0;
+		for (int i = 0; i < nplugins; i++) {
+			struct plugin *pl = &plugins[i];
+			struct pm_hdr h;
+			const char *p;
+			while (pl->w && (p = ring_peek(&pl->out, &h, &s))) {
+				if (h.type == PM_SEND) {
+					plugin_input(pl, p, h.len);
+				} else if (h.type == PM_SET_TIMER) {
+					plugin_set_timer(pl, h.arg);
+				}
+				ring_next(&pl->out, &h);
+			}
+			if (pl->r->sz) {
+				distribute_data(pl->r);
+			}
+		}
+		if (!plugins_dirty) {
+			return;
+		}
+	}
+	/* plugins answering each other, come back after the sockets */
+	kick_loop();
+}
+
+static int plugin_load(struct plugin *pl, const char *path, const char *arg)
+{
+	void *dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	vcand_plugin_init_fn init =
+		dl ? (vcand_plugin_init_fn)dlsym(dl, "vcand_plugin_init") :
+		     NULL;
+	if (!init) {
+		fprintf(stderr, "vcand: %s\n", dlerror());
+		return -1;
+	}
+
+	struct remote *r = new_remote(INVALID_SOCKET);
+	r->plugin = pl;
+	r->send = &plugin_recv;
+	pl->r = r;
+	pl->timer.fn = &plugin_fire;
+	pl->now = plugin_clock();
+	if (init((struct vcand_host *)pl, &host_api, arg, &pl->p) ||
+	    pl->p.abi != VCAND_PLUGIN_ABI) {
+		fprintf(stderr, "vcand: %s failed to start\n", path);
+		return -1;
+	}
+
+	if (pl->p.flags & VCAND_PLUGIN_WORKER) {
+		struct worker *w = &workers[(pl - plugins) % nworkers];
+		if (!w->n && (w->efd = eventfd(0, EFD_CLOEXEC)) < 0) {
+			perror("eventfd");
+			return -1;
+		}
+		w->plugins[w->n++] = pl;
+		pl->w = w;
+		pl->in.buf = malloc(PLUGIN_RING);
+		pl->out.buf = malloc(PLUGIN_RING);
+	}
+
+	/* the connections already there */
+	for (struct remote *t = remotes, *last = t ? t->prev : NULL; t;) {
+		struct remote *next = t->next;
+		int done = t == last;
+		struct pm_hdr h = {PM_MEMBER, 0, (uint64_t)t->id << 1 | 1};
+		if (!t->plugin && t != mc_remote && pl->p.member) {
+			plugin_call(pl, &h, NULL);
+		}
+		t = done ? NULL : next;
+	}
+	add_remote(r);
+	if (cache) {
+		send_snapshot(r);
+	}
+	return 0;
+}
+
+static void plugin_wakeup(struct source *s, int events)
+{
+	uint64_t kicks;
+	if (read(loop_efd, &kicks, 8) < 0) {
+		perror("plugin wakeup");
+	}
+}
+
+static struct source plugin_src = {&plugin_wakeup};
+
+static int plugins_start(void)
+{
+	loop_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop_efd < 0) {
+		perror("eventfd");
+		return -1;
+	} else if (io_watch(loop_efd, &plugin_src)) {
+		return -1;
+	}
+
+	for (int i = 0; i < nplugins; i++) {
+		if (plugin_load(&plugins[i], plugin_paths[i], plugin_args[i])) {
+			return -1;
+		}
+	}
+	for (int i = 0; i < nworkers; i++) {
+		if (workers[i].n &&
+		    pthread_create(&workers[i].thread, NULL, &worker_main,
+				   &workers[i])) {
+			perror("plugin worker");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Hot restart (-u PATH)
+ *
+ * vcand listens for its successor on the unix socket PATH. A new vcand given
+ * the same PATH connects to it first and, if one answers, takes over its
+ * listening socket and connections instead of binding its own. The old
+ * process sends its state as a series of messages with the fds attached
+ * using SCM_RIGHTS, waits for the new one to confirm and exits without
+ * touching the sockets again. Input read but not yet parsed and output still
+ * queued go with the state, and whatever is in the kernel buffers is read by
+ * the new process, so nothing is lost or sent twice. If the new process
+ * fails before confirming, the old one carries on.
+ *
+ * Deflate compressed connections cannot be carried over as zlib has no way
+ * to save a stream, so they are closed along with the old process. The
+ * multicast socket is reopened by the new process, which keeps the daemon
+ * id and sequence numbers so that peers see no change.
+ */
+#define HO_VERSION 4
+
+enum {
+	HO_STATE = 1,
+	HO_LISTEN,
+	HO_REMOTE,
+	HO_JOB,
+	HO_VALUES,
+	HO_PENDING,
+	HO_DONE,
+	HO_RX,
+	HO_SESSION,
+	HO_HISTORY,
+	HO_RATE,
+};
+
+struct ho_hdr {
+	uint32_t type;
+	uint32_t len;
+};
+
+struct ho_state {
+	uint32_t version;
+	uint32_t daemon_id;
+	uint32_t next_id;
+	uint32_t trunk_seq;
+	uint32_t mc_seq;
+	uint32_t pending_seq;
+	uint64_t vclock;
+	uint64_t hist_seq;
+};
+
+struct ho_remote {
+	uint32_t id;
+	int32_t joined, waiting;
+	uint32_t node;
+	uint64_t vtime, barrier;
+	int32_t nfilter, sz, out_sz;
+	int32_t zflags, zin_sz;
+	int32_t trunk, quiet;
+	uint32_t daemon;
+	int32_t link_sz;
+	int32_t seqpacket;
+	int32_t tap;
+};
+
+/* A job of the preceding remote */
+struct ho_job {
+	canid_t id;
+	int32_t flags;
+	uint32_t count;
+	uint32_t len;
+	uint64_t ival1, ival2;
+	int64_t left;
+};
+
+/* A change filter of the preceding remote */
+struct ho_rx {
+	canid_t id, key;
+	int32_t primed, last_len, mask_len;
+	uint64_t timeout;
+	int64_t left;
+};
+
+/* A session, attached to the remote with id if that was carried over */
+struct ho_session {
+	uint64_t token, seq, sent;
+	uint32_t id, last_id;
+	int32_t replaying;
+	int64_t left;
+};
+
+/* A downsampling rule of the preceding remote, in order */
+struct ho_rate {
+	struct vcan_filter filter;
+	int32_t flags, start, len;
+	uint64_t ival;
+};
+
+static struct scratch ho_scratch;
+
+static void ho_put(int *sz, const void *p, int n)
+{
+	char *b = reserve(&ho_scratch, *sz + n);
+	memcpy(b + *sz, p, n);
+	*sz += n;
+}
+
+static int ho_get(char **p, char *e, void *dst, size_t n)
+{
+	if (e - *p < n) {
+		return -1;
+	}
+	memcpy(dst, *p, n);
+	*p += n;
+	return 0;
+}
+
+static int ho_send(int fd, uint32_t type, const void *p, uint32_t n,
+		   int pass)
+{
+	struct ho_hdr h = {type, n};
+	struct iovec iov = {&h, sizeof(h)};
+	union {
+		struct cmsghdr c;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (pass >= 0) {
+		msg.msg_control = ctl.buf;
+		msg.msg_controllen = sizeof(ctl.buf);
+		struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(c), &pass, sizeof(int));
+	}
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(h)) {
+		return -1;
+	}
+
+	const char *b = p;
+	while (n) {
+		ssize_t w = send(fd, b, n, MSG_NOSIGNAL);
+		if (w < 0 && errno == EINTR) {
 			continue;
-		} else if (fd < 0 && errno == EAGAIN) {
+		} else if (w <= 0) {
+			return -1;
+		}
+		b += w;
+		n -= w;
+	}
+	return 0;
+}
+
+/* Reads the next message into ho_scratch along with any fd attached */
+static int ho_recv(int fd, struct ho_hdr *h, int *pfd)
+{
+	struct iovec iov = {h, sizeof(*h)};
+	union {
+		struct cmsghdr c;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	*pfd = -1;
+	if (recvmsg(fd, &msg, MSG_WAITALL) != sizeof(*h)) {
+		return -1;
+	}
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+		memcpy(pfd, CMSG_DATA(c), sizeof(int));
+	}
+
+	char *b = reserve(&ho_scratch, h->len);
+	for (uint32_t got = 0; got < h->len;) {
+		ssize_t n = recv(fd, b + got, h->len - got, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return -1;
+		}
+		got += n;
+	}
+	return 0;
+}
+
+static int handoff_remote(int fd, struct remote *r)
+{
+	if (r->z && (r->z->flags & VCAN_COMPRESS_DEFLATE)) {
+		return 0;
+	}
+
+	struct ho_remote h;
+	memset(&h, 0, sizeof(h));
+	h.id = r->id;
+	h.joined = r->joined;
+	h.waiting = r->waiting;
+	h.node = r->node;
+	h.vtime = r->vtime;
+	h.barrier = r->barrier;
+	h.nfilter = r->nfilter;
+	h.sz = r->sz;
+	h.out_sz = r->out_sz;
+	h.seqpacket = r->seqpacket;
+	h.tap = r->tap;
+	const char *host = "", *port = "";
+	if (r->z) {
+		h.zflags = r->z->flags;
+		h.zin_sz = r->z->in_sz;
+	}
+	if (r->trunk) {
+		h.trunk = 1;
+		h.quiet = r->trunk->quiet;
+		h.daemon = r->trunk->daemon;
+		if (r->trunk->redial) {
+			struct trunk_link *l =
+				(struct trunk_link *)r->trunk->redial;
+			host = l->host;
+			port = l->port;
+			h.link_sz = strlen(host) + strlen(port) + 2;
+		}
+	}
+
+	int sz = 0;
+	ho_put(&sz, &h, sizeof(h));
+	ho_put(&sz, r->filter, r->nfilter * sizeof(*r->filter));
+	ho_put(&sz, r->buf, r->sz);
+	ho_put(&sz, r->out, r->out_sz);
+	if (r->z) {
+		ho_put(&sz, &r->z->tx, sizeof(r->z->tx));
+		ho_put(&sz, &r->z->rx, sizeof(r->z->rx));
+		ho_put(&sz, r->z->in, r->z->in_sz);
+	}
+	if (h.link_sz) {
+		ho_put(&sz, host, strlen(host) + 1);
+		ho_put(&sz, port, strlen(port) + 1);
+	}
+	if (ho_send(fd, HO_REMOTE, ho_scratch.p, sz, r->fd)) {
+		return -1;
+	}
+
+	for (struct tx_job *j = r->jobs; j != NULL; j = j->next) {
+		struct ho_job hj;
+		memset(&hj, 0, sizeof(hj));
+		hj.id = j->id;
+		hj.flags = j->flags;
+		hj.count = j->count;
+		hj.len = j->len;
+		hj.ival1 = j->ival1;
+		hj.ival2 = j->ival2;
+		hj.left = timer_active(&j->timer) ?
+				  (int64_t)(j->timer.expires - wheel.now) :
+				  -1;
+		sz = 0;
+		ho_put(&sz, &hj, sizeof(hj));
+		ho_put(&sz, j->rec, j->len);
+		if (ho_send(fd, HO_JOB, ho_scratch.p, sz, -1)) {
+			return -1;
+		}
+	}
+
+	for (int i = 0; i < r->rx_cap; i++) {
+		struct rx_filter *f = r->rx[i];
+		if (!f) {
+			continue;
+		}
+		struct ho_rx hr;
+		memset(&hr, 0, sizeof(hr));
+		hr.id = f->id;
+		hr.key = f->key;
+		hr.primed = f->primed;
+		hr.last_len = f->last_len;
+		hr.mask_len = f->mask_len;
+		hr.timeout = f->timeout;
+		hr.left = timer_active(&f->timer) ?
+				  (int64_t)(f->seen + f->timeout - wheel.now) :
+				  -1;
+		sz = 0;
+		ho_put(&sz, &hr, sizeof(hr));
+		ho_put(&sz, f->mask_last, 2 * f->mask_len);
+		if (ho_send(fd, HO_RX, ho_scratch.p, sz, -1)) {
+			return -1;
+		}
+	}
+
+	for (struct rate_rule *u = r->rates; u != NULL; u = u->next) {
+		struct ho_rate hr;
+		memset(&hr, 0, sizeof(hr));
+		hr.filter = u->filter;
+		hr.flags = u->flags;
+		hr.start = u->start;
+		hr.len = u->len;
+		hr.ival = u->ival;
+		if (ho_send(fd, HO_RATE, &hr, sizeof(hr), -1)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int handoff_values(int fd)
+{
+	int sz = 0;
+	for (int i = 0; i <= CAN_SFF_MASK; i++) {
+		if (lv_sff[i]) {
+			ho_put(&sz, lv_sff[i]->rec, lv_sff[i]->len);
+		}
+	}
+	for (int i = 0; i < lv_eff_cap; i++) {
+		if (lv_eff[i]) {
+			ho_put(&sz, lv_eff[i]->rec, lv_eff[i]->len);
+		}
+	}
+	return ho_send(fd, HO_VALUES, ho_scratch.p, sz, -1);
+}
+
+static int handoff_sessions(int fd)
+{
+	for (struct session *s = sessions; s != NULL; s = s->next) {
+		struct ho_session h;
+		memset(&h, 0, sizeof(h));
+		h.token = s->token;
+		h.seq = s->seq;
+		h.sent = s->sent;
+		h.last_id = s->last_id;
+		if (s->r) {
+			h.id = s->r->id;
+			h.replaying = s->r->replaying;
+		}
+		h.left = timer_active(&s->linger) ?
+				 (int64_t)(s->linger.expires - wheel.now) :
+				 -1;
+		if (ho_send(fd, HO_SESSION, &h, sizeof(h), -1)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Sends the history as the first seq followed by (from, record) pairs */
+static int handoff_history(int fd)
+{
+	int sz = 0;
+	ho_put(&sz, &hist_first, sizeof(hist_first));
+	for (uint64_t seq = hist_first; seq < hist_seq; seq++) {
+		struct hist_entry *h = &hist[seq & (hist_slots - 1)];
+		uint32_t from = h->from;
+		ho_put(&sz, &from, sizeof(from));
+		ho_put(&sz, hist_buf + h->pos % hist_cap, h->len);
+	}
+	return ho_send(fd, HO_HISTORY, ho_scratch.p, sz, -1);
+}
+
+/* Hands everything to the successor connecting on hfd. Returns 0 once the
+ * successor has taken over, when the caller must exit straight away. */
+static int handoff_send(int hfd, int lfd)
+{
+	int fd = accept(hfd, NULL, NULL);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (mc_remote) {
+		mc_flush();
+	}
+	trunk_flush();
+	for (struct remote *t = remotes, *last = t ? t->prev : NULL; t;) {
+		struct remote *next = t->next;
+		int done = t == last;
+		/* held frames go out early rather than with the state */
+		if (t->rates) {
+			rate_flush(t);
+		}
+		t = done ? NULL : next;
+	}
+
+	struct ho_state st;
+	memset(&st, 0, sizeof(st));
+	st.version = HO_VERSION;
+	st.daemon_id = daemon_id;
+	st.next_id = next_id;
+	st.trunk_seq = trunk_seq;
+	st.mc_seq = mc_seq;
+	st.pending_seq = pending_seq;
+	st.vclock = vclock;
+	st.hist_seq = hist_seq;
+
+	/* HO_LISTEN carries 1 for the SOCK_SEQPACKET listener */
+	int32_t seq = 1;
+	int err = ho_send(fd, HO_STATE, &st, sizeof(st), -1) ||
+		  ho_send(fd, HO_LISTEN, NULL, 0, lfd) ||
+		  (seq_lfd >= 0 &&
+		   ho_send(fd, HO_LISTEN, &seq, sizeof(seq), seq_lfd));
+	for (struct remote *t = remotes, *last = t ? t->prev : NULL;
+	     t && !err;) {
+		if (t != mc_remote && !t->plugin) {
+			err = handoff_remote(fd, t);
+		}
+		t = (t == last) ? NULL : t->next;
+	}
+
+	if (!err && cache) {
+		err = handoff_values(fd);
+	}
+	if (!err) {
+		err = handoff_sessions(fd);
+	}
+	if (!err && hist_buf) {
+		err = handoff_history(fd);
+	}
+	if (!err && pending_num) {
+		int sz = 0;
+		ho_put(&sz, &pending_num, sizeof(pending_num));
+		ho_put(&sz, pending, pending_num * sizeof(*pending));
+		ho_put(&sz, pending_buf, pending_sz);
+		err = ho_send(fd, HO_PENDING, ho_scratch.p, sz, -1);
+	}
+
+	char ack;
+	if (err || ho_send(fd, HO_DONE, NULL, 0, -1) ||
+	    recv(fd, &ack, 1, MSG_WAITALL) != 1) {
+		fputs("vcand: handoff failed, carrying on\n", stderr);
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/* Where a successor started with -u PATH connects */
+static int handoff_fd = -1;
+
+static void handoff_ready(struct source *s, int events)
+{
+	if (!handoff_send(handoff_fd, listener.fd)) {
+		_exit(0);
+	}
+}
+
+static struct source handoff_src = {&handoff_ready};
+
+static struct remote *handoff_new_remote(int fd, char *p, char *e)
+{
+	struct ho_remote h;
+	if (fd < 0 || ho_get(&p, e, &h, sizeof(h)) || h.nfilter < 0 ||
+	    h.sz < 0 || h.sz > 2 + VCAN_LEN_MASK ||
+	    h.out_sz < 0 || h.zin_sz < 0 || h.link_sz < 0) {
+		return NULL;
+	}
+
+	struct remote *r = new_remote(fd);
+	r->id = h.id;
+	r->joined = h.joined;
+	r->waiting = h.waiting;
+	r->node = h.node;
+	r->vtime = h.vtime;
+	r->barrier = h.barrier;
+	r->seqpacket = h.seqpacket;
+	r->write = h.seqpacket ? &seq_send : &sock_send;
+	r->tap = h.tap != 0;
+	ntaps += r->tap;
+	r->nfilter = h.nfilter;
+	r->filter = malloc(h.nfilter * sizeof(*r->filter));
+	input_room(r, h.zflags ? 2 + VCAN_LEN_MASK : h.sz);
+	r->sz = h.sz;
+	r->out_sz = h.out_sz;
+	r->out_cap = h.out_sz;
+	r->out = malloc(h.out_sz);
+	int err = ho_get(&p, e, r->filter, h.nfilter * sizeof(*r->filter)) ||
+		  ho_get(&p, e, r->buf, h.sz) ||
+		  ho_get(&p, e, r->out, h.out_sz);
+
+	if (h.zflags) {
+		struct zlink *z = calloc(1, sizeof(*z));
+		z->flags = h.zflags;
+		z->in_sz = h.zin_sz;
+		z->in_cap = h.zin_sz;
+		z->in = malloc(h.zin_sz);
+		err = err || ho_get(&p, e, &z->tx, sizeof(z->tx)) ||
+		      ho_get(&p, e, &z->rx, sizeof(z->rx)) ||
+		      ho_get(&p, e, z->in, h.zin_sz);
+		r->z = z;
+		r->send = &z_send;
+	}
+
+	if (h.trunk) {
+		r->trunk = calloc(1, sizeof(*r->trunk));
+		r->trunk->quiet = h.quiet;
+		r->trunk->daemon = h.daemon;
+		ntrunks++;
+	}
+	if (h.trunk && h.link_sz && e - p >= h.link_sz && !e[-1]) {
+		const char *host = p;
+		const char *port = host + strlen(host) + 1;
+		for (int i = 0; i < nlinks; i++) {
+			if (!strcmp(links[i].host, host) &&
+			    !strcmp(links[i].port, port)) {
+				r->trunk->redial = &links[i].timer;
+			}
+		}
+	}
+
+	add_remote(r);
+	if (err) {
+		close_remote(r);
+		return NULL;
+	}
+	return r;
+}
+
+static int handoff_job(struct remote *r, char *p, char *e)
+{
+	struct ho_job h;
+	if (!r || ho_get(&p, e, &h, sizeof(h)) || h.len > 2 + CANXL_MTU ||
+	    e - p < h.len) {
+		return -1;
+	}
+	struct tx_job *j = calloc(1, sizeof(*j));
+	j->timer.fn = &tx_fire;
+	j->owner = r;
+	j->id = h.id;
+	j->flags = h.flags;
+	j->count = h.count;
+	j->ival1 = h.ival1;
+	j->ival2 = h.ival2;
+	j->len = h.len;
+	memcpy(j->rec, p, h.len);
+	j->next = r->jobs;
+	r->jobs = j;
+	if (h.left >= 0) {
+		timer_start(&wheel, &j->timer, wheel.now + h.left);
+	}
+	return 0;
+}
+
+static int handoff_rx(struct remote *r, char *p, char *e)
+{
+	struct ho_rx h;
+	if (!r || ho_get(&p, e, &h, sizeof(h)) || h.mask_len < 0 ||
+	    h.mask_len > CANXL_MAX_DLEN || e - p < 2 * h.mask_len) {
+		return -1;
+	}
+	struct rx_filter *f = rx_add(r, h.id, h.key, h.mask_len);
+	memcpy(f->mask_last, p, 2 * h.mask_len);
+	f->primed = h.primed;
+	f->last_len = h.last_len;
+	f->timeout = h.timeout;
+	if (h.left >= 0) {
+		f->seen = wheel.now + h.left - h.timeout;
+		timer_start(&wheel, &f->timer, wheel.now + h.left);
+	}
+	return 0;
+}
+
+static int handoff_session(char *p, char *e)
+{
+	struct ho_session h;
+	if (ho_get(&p, e, &h, sizeof(h))) {
+		return -1;
+	}
+	struct session *s = new_session(h.token);
+	s->seq = h.seq;
+	s->sent = h.sent;
+	s->last_id = h.last_id;
+	for (struct remote *r = remotes, *last = r ? r->prev : NULL;
+	     r && h.id;) {
+		if (r->id == h.id) {
+			s->r = r;
+			r->session = s;
+			r->replaying = h.replaying;
+			return 0;
+		}
+		r = (r == last) ? NULL : r->next;
+	}
+	/* the connection was not carried over, or had closed */
+	timer_start(&wheel, &s->linger,
+		    wheel.now + (h.left >= 0 ? h.left : SESSION_LINGER_TICKS));
+	return 0;
+}
+
+/* Rebuilds the history, which may be held to a different -r than before */
+static int handoff_history_in(char *p, char *e)
+{
+	uint64_t first;
+	if (ho_get(&p, e, &first, sizeof(first)) || first > hist_seq) {
+		return -1;
+	}
+	uint64_t end = hist_seq;
+	hist_first = hist_seq = first;
+	while (p < e) {
+		uint32_t from;
+		uint16_t len;
+		if (ho_get(&p, e, &from, sizeof(from)) || e - p < 2) {
+			return -1;
+		}
+		memcpy(&len, p, 2);
+		if (e - p < 2 + (len & VCAN_LEN_MASK)) {
+			return -1;
+		}
+		history_append(from, p, 2 + (len & VCAN_LEN_MASK));
+		p += 2 + (len & VCAN_LEN_MASK);
+	}
+	return hist_seq == end ? 0 : -1;
+}
+
+static int handoff_rate(struct remote *r, char *p, char *e)
+{
+	struct ho_rate h;
+	if (!r || ho_get(&p, e, &h, sizeof(h))) {
+		return -1;
+	}
+	struct rate_rule **pu = &r->rates;
+	while (*pu) {
+		pu = &(*pu)->next;
+	}
+	struct rate_rule *u = calloc(1, sizeof(*u));
+	u->timer.fn = &rate_fire;
+	u->owner = r;
+	u->filter = h.filter;
+	u->flags = h.flags;
+	u->start = h.start;
+	u->len = h.len;
+	u->ival = h.ival;
+	u->dirty_tail = &u->dirty;
+	*pu = u;
+	return 0;
+}
+
+static int handoff_pending(char *p, char *e)
+{
+	int num;
+	if (ho_get(&p, e, &num, sizeof(num)) || num < 0 ||
+	    (e - p) / sizeof(*pending) < num) {
+		return -1;
+	}
+	pending_num = pending_cap = num;
+	pending = malloc(num * sizeof(*pending));
+	ho_get(&p, e, pending, num * sizeof(*pending));
+	pending_sz = pending_bufcap = e - p;
+	pending_buf = malloc(pending_sz);
+	memcpy(pending_buf, p, pending_sz);
+	return 0;
+}
+
+/*
+ * Takes over from the vcand listening on handoff_path, if any. Returns 1
+ * with the listening socket in *plfd once it has, 0 if there is nobody to
+ * take over from or -1 on error.
+ */
+static int link_taken(struct trunk_link *l)
+{
+	for (struct remote *r = remotes, *last = r ? r->prev : NULL; r;) {
+		if (r->trunk && r->trunk->redial == &l->timer) {
+			return 1;
+		}
+		r = (r == last) ? NULL : r->next;
+	}
+	return 0;
+}
+
+static int handoff_receive(int *plfd)
+{
+	struct sockaddr_un su;
+	memset(&su, 0, sizeof(su));
+	su.sun_family = AF_UNIX;
+	strncpy(su.sun_path, handoff_path, sizeof(su.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&su, sizeof(su))) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 0;
+	}
+
+	struct remote *last = NULL;
+	int lfd = -1;
+	for (;;) {
+		struct ho_hdr h;
+		int pfd;
+		if (ho_recv(fd, &h, &pfd)) {
+			goto fail;
+		}
+		char *p = ho_scratch.p;
+		char *e = p + h.len;
+		struct ho_state st;
+
+		switch (h.type) {
+		case HO_STATE:
+			if (ho_get(&p, e, &st, sizeof(st)) ||
+			    st.version != HO_VERSION) {
+				fputs("vcand: predecessor version differs\n",
+				      stderr);
+				goto fail;
+			}
+			daemon_id = st.daemon_id;
+			next_id = st.next_id;
+			trunk_seq = st.trunk_seq;
+			mc_seq = st.mc_seq;
+			pending_seq = st.pending_seq;
+			vclock = st.vclock;
+			hist_first = hist_seq = st.hist_seq;
+			wheel.now = wheel_clock();
+			break;
+		case HO_LISTEN:
+			if (e - p >= 4) {
+				seq_lfd = pfd;
+			} else {
+				lfd = pfd;
+			}
+			break;
+		case HO_REMOTE:
+			last = handoff_new_remote(pfd, p, e);
+			break;
+		case HO_JOB:
+			if (handoff_job(last, p, e)) {
+				goto fail;
+			}
+			break;
+		case HO_RX:
+			if (handoff_rx(last, p, e)) {
+				goto fail;
+			}
+			break;
+		case HO_RATE:
+			if (handoff_rate(last, p, e)) {
+				goto fail;
+			}
+			break;
+		case HO_VALUES:
+			if (cache && valid_records(p, e - p)) {
+				cache_frames(p, e - p);
+			}
+			break;
+		case HO_PENDING:
+			if (handoff_pending(p, e)) {
+				goto fail;
+			}
+			break;
+		case HO_SESSION:
+			if (handoff_session(p, e)) {
+				goto fail;
+			}
+			break;
+		case HO_HISTORY:
+			if (hist_cap && handoff_history_in(p, e)) {
+				goto fail;
+			}
+			break;
+		case HO_DONE:
+			if (lfd < 0 || write(fd, "", 1) != 1) {
+				goto fail;
+			}
+			close(fd);
+			*plfd = lfd;
+			return 1;
+		default:
+			if (pfd >= 0) {
+				close(pfd);
+			}
 			break;
-		} else if (fd < 0) {
-			perror("accept");
-			exit(1);
 		}
-		fcntl(fd, F_SETFL, O_NONBLOCK);
-		struct remote *r = new_remote(fd);
-		struct epoll_event ev = {
-			.events = EPOLLIN | EPOLLET,
-			.data.ptr = r,
-		};
-		epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
-		add_remote(r);
-		read_more(r);
 	}
+
+fail:
+	fputs("vcand: handoff failed\n", stderr);
+	close(fd);
+	return -1;
 }
+
+#endif
+
 int main(int argc, char *argv[])
 {
+#ifndef _WIN32
 	struct sigaction sa;
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_handler = &on_sigterm;
 	sigaction(SIGTERM, &sa, NULL);
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGHUP, &sa, NULL);
+	sa.sa_handler = &on_sigusr1;
+	sigaction(SIGUSR1, &sa, NULL);
+#endif
 
-	int lfd;
-	if (do_bind(&lfd, argc, argv)) {
-		fputs("usage ./vcand host tcp-port\n", stderr);
-		fputs("usage ./vcand unix-socket\n", stderr);
+	int shift = parse_options(argc, argv);
+	int taken = 0;
+	wheel_init(&wheel, wheel_clock());
+	daemon_id = (uint32_t)trace_now() * 2654435761U ^ (uint32_t)getpid();
+	if (shift >= 0 && loop_clients) {
+		return loop_bench();
+	} else if (shift >= 0 && io_open()) {
+		return 1;
+	}
+#ifndef _WIN32
+	if (shift >= 0 && handoff_path) {
+		taken = handoff_receive(&listener.fd);
+		if (taken < 0) {
+			return 1;
+		}
+	}
+#endif
+	if (shift < 0 || (argc - shift != 2 && argc - shift != 3) ||
+	    (!taken && do_bind(&listener.fd, argc - shift, argv + shift))) {
+		fputs("usage ./vcand [options] host tcp-port\n", stderr);
+#ifndef _WIN32
+		fputs("usage ./vcand [options] unix-socket\n", stderr);
+#endif
+		fputs(usage_options, stderr);
+		return 2;
+	} else if (io_listen(&listener)) {
 		return 2;
 	}
 
-	int efd = epoll_create1(0);
-	struct epoll_event ev = {
-		.events = EPOLLIN | EPOLLET,
-		.data.ptr = NULL,
-	};
-	if (efd < 0 || epoll_ctl(efd, EPOLL_CTL_ADD, lfd, &ev)) {
-		perror("epoll");
+#ifndef _WIN32
+	if (taken && argc - shift == 2) {
+		term_unlink_path = argv[shift + 1];
+	}
+	if (seq_lfd < 0 && seq_path) {
+		if (listen_unix(&seq_lfd, seq_path, SOCK_SEQPACKET)) {
+			return 2;
+		}
+	}
+	if (seq_path) {
+		term_unlink_seq = seq_path;
+	}
+	seq_listener.fd = seq_lfd;
+	if (seq_lfd >= 0 && io_listen(&seq_listener)) {
 		return 2;
 	}
 
-	accept_more(efd, lfd);
+	if (handoff_path) {
+		unlink(handoff_path);
+		if (listen_unix(&handoff_fd, handoff_path, SOCK_STREAM) ||
+		    io_watch(handoff_fd, &handoff_src)) {
+			return 2;
+		}
+	}
+
+	/* connections taken over from the previous process */
+	for (struct remote *r = remotes, *last = r ? r->prev : NULL; r;) {
+		io_add(r);
+		r = (r == last) ? NULL : r->next;
+	}
+
+	if (mc_addr && mc_open()) {
+		return 2;
+	}
+	for (int i = 0; i < nlinks; i++) {
+		links[i].timer.fn = &trunk_dial;
+		if (!link_taken(&links[i])) {
+			trunk_dial(&wheel, &links[i].timer);
+		}
+	}
+	if (nplugins && plugins_start()) {
+		return 2;
+	}
+	if (seq_lfd >= 0) {
+		accept_ready(&seq_listener.src, IO_IN);
+	}
+#endif
+	accept_ready(&listener.src, IO_IN);
 
+	uint64_t last_event = 0;
 	for (;;) {
-		struct epoll_event ev[16];
-		int n = epoll_wait(efd, ev, sizeof(ev) / sizeof(ev[0]), -1);
-		if (n < 0 && errno == EINTR) {
-			continue;
-		} else if (n <= 0) {
+		int timeout = -1;
+		if (ready_head ||
+		    (busy_poll && trace_now() - last_event < busy_idle_ns)) {
+			timeout = 0;
+		}
+
+		struct io_event ev[IO_EVENTS];
+		int n = io_wait(ev, IO_EVENTS, timeout);
+		if (trace_dump) {
+			trace_dump = 0;
+			dump_trace();
+		}
+		if (n < 0) {
 			break;
+		} else if (!n && !ready_head) {
+			if (timeout == 0) {
+				/* let anything sharing the CPU run */
+				sched_yield();
+			}
+			continue;
+		} else if (n && busy_poll) {
+			last_event = trace_now();
 		}
 
 		for (int i = 0; i < n; i++) {
-			struct remote *r = ev[i].data.ptr;
-			if (!r) {
-				accept_more(efd, lfd);
-			} else if (r->prev) {
-				read_more(r);
-			}
+			ev[i].s->ready(ev[i].s, ev[i].events);
 		}
+		read_ready();
 
-		free_remotes();
+#ifndef _WIN32
+		plugin_flush();
+#endif
+		if (lockstep) {
+			lockstep_step();
+		} else {
+			/* sleep until the next tick with work, if any */
+			run_timers();
+			io_timer(wheel.count ? wheel_next(&wheel) : 0);
+		}
+#ifndef _WIN32
+		if (plugins_dirty) {
+			/* sent from timers, run on the next pass */
+			kick_loop();
+		}
+		if (mc_remote) {
+			mc_flush();
+		}
+#endif
+		end_pass();
 	}
+	return 1;
 }
-#endif
\ No newline at end of file
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "vcan.h"
+
+/*
+ * vcand plugins (vcand -P PATH[:ARG])
+ *
+ * A plugin is a shared object that vcand loads with dlopen and that joins the
+ * bus as if it were a client, without the socket. It sends and receives
+ * records exactly as on the stream described in vcan.h, so a plugin can
+ * subscribe, set up cyclic frames, join the lockstep clock and so on with the
+ * same control messages a client would use.
+ *
+ * vcand calls vcand_plugin_init once at startup with the text after the ':'
+ * in the -P argument, or "" if there is none. The plugin fills in p, setting
+ * abi to VCAND_PLUGIN_ABI, and returns 0, or returns non zero to make vcand
+ * exit. h identifies the plugin in calls to the host.
+ *
+ * Callbacks run on the event loop thread unless VCAND_PLUGIN_WORKER is set,
+ * in which case they run on one of vcand's worker threads (vcand -W) and
+ * exchange messages with the loop through lock free queues. A plugin's
+ * callbacks are never run concurrently with each other either way. On the
+ * loop thread they must not block.
+ *
+ *   recv	records sent to the plugin, ns being vcand's clock when they
+ *		were, in virtual time with vcand -l
+ *   timer	the time set with set_timer has come
+ *   member	a connection with id joined (joined = 1) or left the bus,
+ *		also called at startup for the connections already there
+ *
+ * Any callback may be NULL. The host calls may only be made from within a
+ * callback or vcand_plugin_init:
+ *
+ *   send	queues n bytes of whole records to go out as if sent by the
+ *		plugin, returning -1 if they are not whole records or the
+ *		queue is full. Records are processed after the callback.
+ *   set_timer	calls timer once vcand's clock reaches ns, replacing any
+ *		time set before. 0 cancels it. The timer has vcand's 1 ms
+ *		tick.
+ *   now	returns vcand's clock as of the callback being run
+ *   dropped	returns how many messages to a worker plugin, mostly batches
+ *		of records, were dropped as it fell behind.
+ *
+ * vcand exits without unloading plugins, and does not carry their state over
+ * a hot restart, where the successor loads its own.
+ */
+#define VCAND_PLUGIN_ABI 1
+
+#define VCAND_PLUGIN_WORKER 0x01
+
+struct vcand_host;
+
+struct vcand_host_api {
+	uint32_t abi;
+	int (*send)(struct vcand_host *h, const void *recs, int n);
+	void (*set_timer)(struct vcand_host *h, uint64_t ns);
+	uint64_t (*now)(struct vcand_host *h);
+	uint64_t (*dropped)(struct vcand_host *h);
+};
+
+struct vcand_plugin {
+	uint32_t abi;
+	uint32_t flags;
+	void *ctx;
+	void (*recv)(void *ctx, uint64_t ns, const void *recs, int n);
+	void (*timer)(void *ctx, uint64_t ns);
+	void (*member)(void *ctx, unsigned id, int joined);
+};
+
+typedef int (*vcand_plugin_init_fn)(struct vcand_host *h,
+				    const struct vcand_host_api *api,
+				    const char *arg, struct vcand_plugin *p);
+
+int vcand_plugin_init(struct vcand_host *h, const struct vcand_host_api *api,
+		      const char *arg, struct vcand_plugin *p);
@@ -0,0 +1,359 @@
+#pragma once
+
+#include "vcan.h"
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef VCAN_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+ * Link compression (VCAN_COMPRESS)
+ *
+ * Each side keeps a table of the last payload per CAN ID for each direction
+ * and codes records as a tag byte followed by:
+ *
+ *   VZ_RAW	varint length word, record bytes
+ *   VZ_FULL	varint id, len, [flags,] payload
+ *   VZ_DELTA	varint id, bitmask of changed bytes, XOR of the changed bytes
+ *   VZ_SAME	varint id
+ *
+ * The tag also carries the frame type and the EFF/RTR/ERR flags so that ids
+ * are coded without them and SFF ids fit in two bytes. Control records and
+ * frames that would not survive the round trip (non zero padding, classic
+ * frames with len8_dlc) go through as VZ_RAW.
+ *
+ * Tables are only updated by the records themselves so both ends evict
+ * identically. With VCAN_COMPRESS_DEFLATE the coded stream is further run
+ * through zlib with a sync flush per write.
+ */
+#define VZ_RAW 0
+#define VZ_FULL 1
+#define VZ_DELTA 2
+#define VZ_SAME 3
+#define VZ_KIND 3
+#define VZ_FD 0x04
+#define VZ_EFF 0x08
+#define VZ_RTR 0x10
+#define VZ_ERR 0x20
+
+#define VZ_TABLE_BITS 10
+#define VZ_TABLE (1 << VZ_TABLE_BITS)
+#define VZ_PROBE 8
+
+/* worst case coded size of n bytes of records */
+#define VZ_BOUND(n) (2 * (n) + 16)
+
+struct vz_entry {
+	canid_t id;
+	uint8_t used, fd, len, flags;
+	uint8_t data[CANFD_MAX_DLEN];
+};
+
+struct vz_table {
+	struct vz_entry e[VZ_TABLE];
+};
+
+static struct vz_entry *vz_lookup(struct vz_table *t, canid_t id, int *found)
+{
+	uint32_t h = (id * 2654435761U) >> (32 - VZ_TABLE_BITS);
+	for (int i = 0; i < VZ_PROBE; i++) {
+		struct vz_entry *e = &t->e[(h + i) & (VZ_TABLE - 1)];
+		if (!e->used || e->id == id) {
+			*found = e->used;
+			return e;
+		}
+	}
+	*found = 0;
+	return &t->e[h];
+}
+
+static int vz_put_varint(char *p, uint32_t v)
+{
+	int n = 0;
+	while (v >= 0x80) {
+		p[n++] = (char)(v | 0x80);
+		v >>= 7;
+	}
+	p[n++] = (char)v;
+	return n;
+}
+
+static int vz_get_varint(const char *p, const char *e, uint32_t *pv)
+{
+	uint32_t v = 0;
+	for (int n = 0; n < 5 && p + n < e; n++) {
+		v |= (uint32_t)(p[n] & 0x7F) << (7 * n);
+		if (!(p[n] & 0x80)) {
+			*pv = v;
+			return n + 1;
+		}
+	}
+	return 0;
+}
+
+/* Frames are laid out as id[4] len[1] flags[1] res[2] data[] for both
+ * struct can_frame and struct canfd_frame */
+static int vz_codable(const uint8_t *r, int len)
+{
+	int max;
+	if (len == CAN_MTU) {
+		max = CAN_MAX_DLEN;
+		if (r[5]) {
+			return 0;
+		}
+	} else if (len == CANFD_MTU) {
+		max = CANFD_MAX_DLEN;
+	} else {
+		return 0;
+	}
+	if (r[4] > max || r[6] || r[7]) {
+		return 0;
+	}
+	for (int i = 8 + r[4]; i < len; i++) {
+		if (r[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int vz_encode(struct vz_table *t, const char *in, int n, char *out)
+{
+	const char *p = in;
+	const char *e = in + n;
+	char *o = out;
+
+	while (p + 2 <= e) {
+		uint16_t hdr;
+		memcpy(&hdr, p, 2);
+		int len = hdr & VCAN_LEN_MASK;
+		const uint8_t *r = (const uint8_t *)p + 2;
+		p += 2 + len;
+
+		if ((hdr & VCAN_CTRL) || !vz_codable(r, len)) {
+			*o++ = VZ_RAW;
+			o += vz_put_varint(o, hdr);
+			memcpy(o, r, len);
+			o += len;
+			continue;
+		}
+
+		canid_t id;
+		memcpy(&id, r, 4);
+		uint8_t fd = len == CANFD_MTU;
+		uint8_t dlen = r[4];
+		uint8_t flags = fd ? r[5] : 0;
+		uint8_t tag = (fd ? VZ_FD : 0) |
+			      ((id & CAN_EFF_FLAG) ? VZ_EFF : 0) |
+			      ((id & CAN_RTR_FLAG) ? VZ_RTR : 0) |
+			      ((id & CAN_ERR_FLAG) ? VZ_ERR : 0);
+
+		char *tagp = o++;
+		o += vz_put_varint(o, id & CAN_EFF_MASK);
+
+		int found;
+		struct vz_entry *v = vz_lookup(t, id, &found);
+		if (found && v->fd == fd && v->len == dlen && v->flags == flags) {
+			uint8_t *mask = (uint8_t *)o;
+			int nmask = (dlen + 7) / 8;
+			memset(mask, 0, nmask);
+			o += nmask;
+			for (int i = 0; i < dlen; i++) {
+				uint8_t x = r[8 + i] ^ v->data[i];
+				if (x) {
+					mask[i / 8] |= 1 << (i % 8);
+					*o++ = (char)x;
+				}
+			}
+			if (o == (char *)mask + nmask) {
+				o = (char *)mask;
+				tag |= VZ_SAME;
+			} else {
+				tag |= VZ_DELTA;
+			}
+		} else {
+			tag |= VZ_FULL;
+			*o++ = (char)dlen;
+			if (fd) {
+				*o++ = (char)flags;
+			}
+			memcpy(o, r + 8, dlen);
+			o += dlen;
+		}
+		*tagp = (char)tag;
+
+		v->used = 1;
+		v->id = id;
+		v->fd = fd;
+		v->len = dlen;
+		v->flags = flags;
+		memcpy(v->data, r + 8, dlen);
+	}
+
+	return (int)(o - out);
+}
+
+/*
+ * Decodes whole items from in into records in out. Stops at the first
+ * incomplete item or once the next record does not fit in cap. Returns the
+ * number of bytes written with *used set to the bytes consumed, or -1 if the
+ * stream is corrupt.
+ */
+static int vz_decode(struct vz_table *t, const char *in, int n, int *used,
+		     char *out, int cap)
+{
+	const char *p = in;
+	const char *e = in + n;
+	char *o = out;
+
+	while (p < e) {
+		const char *s = p;
+		uint8_t tag = (uint8_t)*p++;
+		uint32_t v;
+		int k = vz_get_varint(p, e, &v);
+		if (!k) {
+			p = s;
+			break;
+		}
+		p += k;
+
+		if ((tag & VZ_KIND) == VZ_RAW) {
+			uint16_t hdr = (uint16_t)v;
+			int len = hdr & VCAN_LEN_MASK;
+			if (2 + len > cap) {
+				return -1;
+			} else if (p + len > e) {
+				p = s;
+				break;
+			} else if (o + 2 + len > out + cap) {
+				p = s;
+				break;
+			}
+			memcpy(o, &hdr, 2);
+			memcpy(o + 2, p, len);
+			o += 2 + len;
+			p += len;
+			continue;
+		}
+
+		uint8_t fd = (tag & VZ_FD) != 0;
+		uint16_t len = fd ? CANFD_MTU : CAN_MTU;
+		if (o + 2 + len > out + cap) {
+			p = s;
+			break;
+		}
+
+		canid_t id = (v & CAN_EFF_MASK) |
+			     ((tag & VZ_EFF) ? CAN_EFF_FLAG : 0) |
+			     ((tag & VZ_RTR) ? CAN_RTR_FLAG : 0) |
+			     ((tag & VZ_ERR) ? CAN_ERR_FLAG : 0);
+
+		int found;
+		struct vz_entry *x = vz_lookup(t, id, &found);
+		uint8_t data[CANFD_MAX_DLEN];
+		uint8_t dlen, flags;
+
+		if ((tag & VZ_KIND) == VZ_FULL) {
+			if (p + 1 + fd > e) {
+				p = s;
+				break;
+			}
+			dlen = (uint8_t)p[0];
+			flags = fd ? (uint8_t)p[1] : 0;
+			if (dlen > (fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN)) {
+				return -1;
+			} else if (p + 1 + fd + dlen > e) {
+				p = s;
+				break;
+			}
+			memcpy(data, p + 1 + fd, dlen);
+			p += 1 + fd + dlen;
+		} else {
+			if (!found || x->fd != fd) {
+				return -1;
+			}
+			dlen = x->len;
+			flags = x->flags;
+			memcpy(data, x->data, dlen);
+			if ((tag & VZ_KIND) == VZ_DELTA) {
+				int nmask = (dlen + 7) / 8;
+				if (p + nmask > e) {
+					p = s;
+					break;
+				}
+				const uint8_t *mask = (const uint8_t *)p;
+				const char *d = p + nmask;
+				for (int i = 0; i < dlen; i++) {
+					if (!(mask[i / 8] & (1 << (i % 8)))) {
+						continue;
+					} else if (d == e) {
+						d = NULL;
+						break;
+					}
+					data[i] ^= (uint8_t)*d++;
+				}
+				if (!d) {
+					p = s;
+					break;
+				}
+				p = d;
+			}
+		}
+
+		x->used = 1;
+		x->id = id;
+		x->fd = fd;
+		x->len = dlen;
+		x->flags = flags;
+		memcpy(x->data, data, dlen);
+
+		memcpy(o, &len, 2);
+		memset(o + 2, 0, len);
+		memcpy(o + 2, &id, 4);
+		o[6] = (char)dlen;
+		o[7] = (char)flags;
+		memcpy(o + 10, data, dlen);
+		o += 2 + len;
+	}
+
+	*used = (int)(p - in);
+	return (int)(o - out);
+}
+
+#ifdef VCAN_ZLIB
+static int vz_deflate(z_stream *z, const char *in, int n, char *out, int cap)
+{
+	z->next_in = (Bytef *)in;
+	z->avail_in = n;
+	z->next_out = (Bytef *)out;
+	z->avail_out = cap;
+	if (deflate(z, Z_SYNC_FLUSH) != Z_OK || z->avail_in) {
+		return -1;
+	}
+	return cap - (int)z->avail_out;
+}
+
+/* Inflates in, appending to the buffer at *pout which is grown as needed */
+static int vz_inflate(z_stream *z, const char *in, int n, char **pout,
+		      int *psz, int *pcap)
+{
+	z->next_in = (Bytef *)in;
+	z->avail_in = n;
+	while (z->avail_in) {
+		if (*pcap - *psz < 4096) {
+			*pcap = 2 * *pcap + 4096;
+			*pout = realloc(*pout, *pcap);
+		}
+		z->next_out = (Bytef *)*pout + *psz;
+		z->avail_out = *pcap - *psz;
+		int err = inflate(z, Z_SYNC_FLUSH);
+		*psz = *pcap - (int)z->avail_out;
+		if (err != Z_OK && err != Z_BUF_ERROR) {
+			return -1;
+		}
+	}
+	return 0;
+}
+#endif
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Hierarchical timer wheel
+ *
+ * Four levels of 64 slots. Level 0 holds timers due in the next 64 ticks,
+ * level 1 the next 64^2 and so on. When level 0 wraps the next level 1 slot
+ * is redistributed into level 0, and likewise up the levels, so starting,
+ * stopping and expiring a timer are all O(1). Timers further out than 64^4
+ * ticks park in the top level and are redistributed until they come into
+ * range. Ticks are whatever unit the caller advances the wheel in.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_RANGE ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+struct wheel;
+
+struct timer {
+	struct timer *next, *prev;
+	uint64_t expires;
+	void (*fn)(struct wheel *w, struct timer *t);
+};
+
+struct wheel {
+	uint64_t now;
+	int count;
+	struct timer slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+static void wheel_init(struct wheel *w, uint64_t now)
+{
+	w->now = now;
+	w->count = 0;
+	for (int l = 0; l < WHEEL_LEVELS; l++) {
+		for (int i = 0; i < WHEEL_SIZE; i++) {
+			struct timer *s = &w->slots[l][i];
+			s->next = s;
+			s->prev = s;
+		}
+	}
+}
+
+static int timer_active(const struct timer *t)
+{
+	return t->next != NULL;
+}
+
+static void wheel_insert(struct wheel *w, struct timer *t)
+{
+	uint64_t at = t->expires;
+	if (at - w->now >= WHEEL_RANGE) {
+		at = w->now + WHEEL_RANGE - 1;
+	}
+	uint64_t delta = at - w->now;
+
+	int l = 0;
+	while (l < WHEEL_LEVELS - 1 && delta >= (uint64_t)1
+						 << (WHEEL_BITS * (l + 1))) {
+		l++;
+	}
+
+	struct timer *s = &w->slots[l][(at >> (WHEEL_BITS * l)) & WHEEL_MASK];
+	t->next = s;
+	t->prev = s->prev;
+	t->prev->next = t;
+	s->prev = t;
+}
+
+/* Starts or restarts t to fire on the first advance to or past expires */
+static void timer_start(struct wheel *w, struct timer *t, uint64_t expires)
+{
+	if (timer_active(t)) {
+		t->next->prev = t->prev;
+		t->prev->next = t->next;
+	} else {
+		w->count++;
+	}
+	t->expires = expires > w->now ? expires : w->now + 1;
+	wheel_insert(w, t);
+}
+
+static void timer_stop(struct wheel *w, struct timer *t)
+{
+	if (timer_active(t)) {
+		t->next->prev = t->prev;
+		t->prev->next = t->next;
+		t->next = NULL;
+		t->prev = NULL;
+		w->count--;
+	}
+}
+
+static void wheel_cascade(struct wheel *w, int l)
+{
+	struct timer *s = &w->slots[l][(w->now >> (WHEEL_BITS * l)) & WHEEL_MASK];
+	struct timer *t = s->next;
+	s->next = s;
+	s->prev = s;
+	while (t != s) {
+		struct timer *next = t->next;
+		wheel_insert(w, t);
+		t = next;
+	}
+}
+
+/* Runs the callback of every timer due up to and including tick now. The
+ * timer is stopped before its callback, which may restart it. */
+static void wheel_advance(struct wheel *w, uint64_t now)
+{
+	if (!w->count && now > w->now) {
+		w->now = now;
+		return;
+	}
+
+	while (w->now < now) {
+		w->now++;
+		for (int l = 1; l < WHEEL_LEVELS; l++) {
+			if (w->now & (((uint64_t)1 << (WHEEL_BITS * l)) - 1)) {
+				break;
+			}
+			wheel_cascade(w, l);
+		}
+
+		struct timer *s = &w->slots[0][w->now & WHEEL_MASK];
+		while (s->next != s) {
+			struct timer *t = s->next;
+			timer_stop(w, t);
+			t->fn(w, t);
+		}
+
+		if (!w->count) {
+			w->now = now;
+		}
+	}
+}
+
+/* Returns the earliest tick at which advancing could run a callback. This
+ * can be early when the next work is a redistribution of a higher level. */
+static uint64_t wheel_next(const struct wheel *w)
+{
+	uint64_t t = w->now + 1;
+	for (;; t++) {
+		const struct timer *s = &w->slots[0][t & WHEEL_MASK];
+		if (s->next != s || !(t & WHEEL_MASK)) {
+			return t;
+		}
+	}
+}